@@ -0,0 +1,116 @@
+// Compares the SIMD Mat / vec4f and pixel span operations against the plain loops
+// they replaced.
+// Build and run with "make bench".
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "../src/Mat.h"
+#include "../src/PixelSpans.h"
+
+namespace
+{
+    constexpr size_t item_count = 1024 ;
+    constexpr size_t pass_count = 2000 ;
+
+    Mat scalar_multiply( const Mat& a, const Mat& b )
+    {
+        Mat output ;
+        for( size_t i = 0 ; i < 4 ; ++i )
+        for( size_t j = 0 ; j < 4 ; ++j )
+        for( size_t k = 0 ; k < 4 ; ++k )
+            output.elements[ i * 4 + j ] += a.elements[ i * 4 + k ] * b.elements[ k * 4 + j ] ;
+        return output ;
+    }
+
+    vec4f scalar_cross_normalize( const vec4f& a, const vec4f& b )
+    {
+        vec4f c { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x, 0 } ;
+        auto length = std::sqrt( c.x * c.x + c.y * c.y + c.z * c.z ) ;
+        return { c.x / length, c.y / length, c.z / length, 0 } ;
+    }
+
+    // Runs "body" "call_count" times per pass and returns nanoseconds per item,
+    // where each call handles "items_per_call" items
+    template<typename Body>
+    double time_per_item( size_t call_count, size_t items_per_call, Body body )
+    {
+        auto start = std::chrono::steady_clock::now() ;
+        for( size_t pass = 0 ; pass < pass_count ; ++pass )
+        for( size_t i = 0 ; i < call_count ; ++i )
+            body( i ) ;
+        auto elapsed = std::chrono::steady_clock::now() - start ;
+        return std::chrono::duration<double, std::nano>( elapsed ).count()
+            / static_cast<double>( pass_count * call_count * items_per_call ) ;
+    }
+
+    template<typename Body>
+    double time_per_call( Body body )
+    {
+        return time_per_item( item_count, 1, body ) ;
+    }
+
+    void report( const char* name, double scalar_ns, double simd_ns )
+    {
+        std::printf( "%-22s scalar %7.2f ns   simd %7.2f ns   speedup %5.2fx\n",
+            name, scalar_ns, simd_ns, scalar_ns / simd_ns ) ;
+    }
+}
+
+int main()
+{
+    std::vector<Mat>   matrices( item_count ) ;
+    std::vector<vec4f> vectors( item_count ) ;
+    for( size_t i = 0 ; i < item_count ; ++i )
+    {
+        auto f = static_cast<float>( i ) ;
+        matrices[ i ] = Mat::get_translation_scale_matrix( { f, -f, 0.5f * f }, 1 + f / item_count )
+                      * Mat::get_rotation_matrix( f, { 1, f, 2 } ) ;
+        vectors[ i ] = { f, 1 - f, 2 * f, 1 } ;
+    }
+
+    std::vector<Mat>   matrix_results( item_count ) ;
+    std::vector<vec4f> vector_results( item_count ) ;
+    const auto& camera = matrices[ 7 ] ;
+
+    report( "Mat * Mat",
+        time_per_call( [ & ]( size_t i ) { matrix_results[ i ] = scalar_multiply( camera, matrices[ i ] ) ; } ),
+        time_per_call( [ & ]( size_t i ) { matrix_results[ i ] = camera * matrices[ i ] ; } ) ) ;
+
+    report( "cross + normalize",
+        time_per_call( [ & ]( size_t i ) {
+            vector_results[ i ] = scalar_cross_normalize( vectors[ i ], vectors[ ( i + 1 ) % item_count ] ) ; } ),
+        time_per_call( [ & ]( size_t i ) {
+            vector_results[ i ] = compute_normalized(
+                compute_cross_product( vectors[ i ], vectors[ ( i + 1 ) % item_count ] ) ) ; } ) ) ;
+
+    // Pixel spans, reported per pixel
+    std::vector<Pixel> pixels( item_count ) ;
+    for( size_t i = 0 ; i < item_count ; ++i )
+        pixels[ i ] = Pixel( static_cast<uint32_t>( i * 2654435761u ) ) ;
+    Pixel translucent { 200, 100, 50, 96 } ;
+
+    report( "blend over (span)",
+        time_per_item( 1, item_count, [ & ]( size_t ) {
+            for( auto& pixel : pixels )
+                pixel = blend_over( pixel, translucent ) ; } ),
+        time_per_item( 1, item_count, [ & ]( size_t ) {
+            blend_span_over( pixels.data(), pixels.size(), translucent ) ; } ) ) ;
+
+    report( "blend additive (span)",
+        time_per_item( 1, item_count, [ & ]( size_t ) {
+            for( auto& pixel : pixels )
+                pixel = blend_additive( pixel, translucent ) ; } ),
+        time_per_item( 1, item_count, [ & ]( size_t ) {
+            blend_span_additive( pixels.data(), pixels.size(), translucent ) ; } ) ) ;
+
+    // Keep the results alive so the loops are not optimized away
+    float checksum = 0 ;
+    for( size_t i = 0 ; i < item_count ; ++i )
+        checksum += matrix_results[ i ].elements[ i % 16 ] + vector_results[ i ].x
+                  + static_cast<float>( pixels[ i ].get_green() ) ;
+    std::printf( "checksum %f\n", checksum ) ;
+
+    return 0 ;
+}
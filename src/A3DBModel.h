@@ -4,6 +4,7 @@
 #include <strings.h>
 #include <vector>
 #include <fstream>
+#include <istream>
 
 #include "Vec.h"
 #include "Color.h"
@@ -13,17 +14,22 @@
 class A3DBModel
 {
 public:
-    static std::unique_ptr<Model> load( const std::string& file_name )
+    static std::unique_ptr<Model> load( const std::string& file_name, ModelStorage storage = ModelStorage::full )
     {
-        std::vector<vec3f> vertices        ;
-        std::vector<vec3i> indices         ;
-        std::vector<Color> triangle_colors ;
-
         std::ifstream in_file( file_name ) ;
 
         if( !in_file.good() )
             return nullptr ;
 
+        return load( in_file, storage ) ;
+    }
+
+    static std::unique_ptr<Model> load( std::istream& in_file, ModelStorage storage = ModelStorage::full )
+    {
+        std::vector<vec3f> vertices        ;
+        std::vector<vec3i> indices         ;
+        std::vector<Color> triangle_colors ;
+
         while( !in_file.eof() )
         {
             std::string object ;
@@ -61,10 +67,19 @@ public:
             }
         }
 
+        auto vertex_count = static_cast<int>( vertices.size() ) ;
+        auto is_vertex = [ vertex_count ]( int index ) { return index >= 0 && index < vertex_count ; } ;
+
         std::vector<Triangle> triangles ;
         for( size_t i = 0 ; i < indices.size() ; ++i )
+        {
+            // E.g. a file read while it is still being written
+            if( ! is_vertex( indices[ i ].x ) || ! is_vertex( indices[ i ].y ) || ! is_vertex( indices[ i ].z ) )
+                return nullptr ;
+
             triangles.push_back( { indices[ i ], triangle_colors[ i ] } ) ;
+        }
 
-        return std::make_unique<Model>( Model { vertices, triangles } ) ;
+        return std::make_unique<Model>( Model { std::move( vertices ), std::move( triangles ), storage } ) ;
     }
 } ;
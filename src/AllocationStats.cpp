@@ -0,0 +1,78 @@
+#include "AllocationStats.h"
+
+#if defined( RASTERIZER_ALLOCATION_STATS )
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global allocation functions, see AllocationStats.h. Each block starts
+// with a header recording where malloc put it and how many bytes were counted, so
+// every variant, aligned or not, frees the same way.
+namespace
+{
+    struct Header
+    {
+        void*  block ;
+        size_t counted_bytes ;  // 0 when the allocation was not counted
+    } ;
+
+    void* allocate( size_t size, size_t alignment ) noexcept
+    {
+        alignment = std::max( alignment, alignof( std::max_align_t ) ) ;
+        auto block = std::malloc( sizeof( Header ) + alignment + size ) ;
+        if( block == nullptr )
+            return nullptr ;
+
+        auto address = reinterpret_cast<uintptr_t>( block ) + sizeof( Header ) ;
+        address = ( address + alignment - 1 ) / alignment * alignment ;
+
+        auto header = reinterpret_cast<Header*>( address ) - 1 ;
+        header->block = block ;
+        header->counted_bytes = AllocationStats::record_allocation( size ) ? size : 0 ;
+        return reinterpret_cast<void*>( address ) ;
+    }
+
+    void* allocate_or_throw( size_t size, size_t alignment )
+    {
+        auto memory = allocate( size, alignment ) ;
+        if( memory == nullptr )
+            throw std::bad_alloc() ;
+        return memory ;
+    }
+
+    void release( void* memory ) noexcept
+    {
+        if( memory == nullptr )
+            return ;
+
+        auto header = static_cast<Header*>( memory ) - 1 ;
+        if( header->counted_bytes != 0 )
+            AllocationStats::record_release( header->counted_bytes ) ;
+        std::free( header->block ) ;
+    }
+}
+
+void* operator new( size_t size )                                            { return allocate_or_throw( size, 0 ) ; }
+void* operator new[]( size_t size )                                          { return allocate_or_throw( size, 0 ) ; }
+void* operator new( size_t size, std::align_val_t alignment )                { return allocate_or_throw( size, static_cast<size_t>( alignment ) ) ; }
+void* operator new[]( size_t size, std::align_val_t alignment )              { return allocate_or_throw( size, static_cast<size_t>( alignment ) ) ; }
+void* operator new( size_t size, const std::nothrow_t& ) noexcept            { return allocate( size, 0 ) ; }
+void* operator new[]( size_t size, const std::nothrow_t& ) noexcept          { return allocate( size, 0 ) ; }
+void* operator new( size_t size, std::align_val_t alignment, const std::nothrow_t& ) noexcept   { return allocate( size, static_cast<size_t>( alignment ) ) ; }
+void* operator new[]( size_t size, std::align_val_t alignment, const std::nothrow_t& ) noexcept { return allocate( size, static_cast<size_t>( alignment ) ) ; }
+
+void operator delete( void* memory ) noexcept                                { release( memory ) ; }
+void operator delete[]( void* memory ) noexcept                              { release( memory ) ; }
+void operator delete( void* memory, size_t ) noexcept                        { release( memory ) ; }
+void operator delete[]( void* memory, size_t ) noexcept                      { release( memory ) ; }
+void operator delete( void* memory, std::align_val_t ) noexcept              { release( memory ) ; }
+void operator delete[]( void* memory, std::align_val_t ) noexcept            { release( memory ) ; }
+void operator delete( void* memory, size_t, std::align_val_t ) noexcept      { release( memory ) ; }
+void operator delete[]( void* memory, size_t, std::align_val_t ) noexcept    { release( memory ) ; }
+void operator delete( void* memory, const std::nothrow_t& ) noexcept         { release( memory ) ; }
+void operator delete[]( void* memory, const std::nothrow_t& ) noexcept       { release( memory ) ; }
+void operator delete( void* memory, std::align_val_t, const std::nothrow_t& ) noexcept   { release( memory ) ; }
+void operator delete[]( void* memory, std::align_val_t, const std::nothrow_t& ) noexcept { release( memory ) ; }
+
+#endif
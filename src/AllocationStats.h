@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Heap allocations made while rendering, counted per pipeline stage.
+//
+// Opt in by building with RASTERIZER_ALLOCATION_STATS defined ("make ALLOCATION_STATS=1"):
+// AllocationStats.cpp then replaces the global operator new and delete, which sees
+// every container and Model the draw path creates. Only allocations made by a thread
+// inside a stage count: Canvas puts the thread calling clear() in the submission stage
+// until present() returns, and its own work, on any thread, in the other stages. Other
+// threads, such as model loaders, are not counted. Without the define, every count
+// stays 0 and the stage scopes compile to nothing.
+enum class RenderStage : uint8_t
+{
+    submission,     // Between clear() and present(), outside the stages below
+    sorting,        // Ordering the render queue
+    geometry,       // Transforming, clipping and projecting
+    rasterization,
+    composition,    // Translucency, overlay lines and handing the frame over
+} ;
+
+constexpr size_t render_stage_count = 5 ;
+
+class AllocationCounts
+{
+public:
+    uint64_t allocations[ render_stage_count ] = {} ;
+    uint64_t bytes[ render_stage_count ] = {} ;
+
+    uint64_t get_allocation_count() const
+    {
+        uint64_t total = 0 ;
+        for( auto count : allocations )
+            total += count ;
+        return total ;
+    }
+
+    uint64_t get_allocated_bytes() const
+    {
+        uint64_t total = 0 ;
+        for( auto count : bytes )
+            total += count ;
+        return total ;
+    }
+} ;
+
+class AllocationStats
+{
+public:
+    static constexpr bool is_enabled()
+    {
+#if defined( RASTERIZER_ALLOCATION_STATS )
+        return true ;
+#else
+        return false ;
+#endif
+    }
+
+    // Puts the calling thread in a stage until destroyed
+    class StageScope
+    {
+    public:
+#if defined( RASTERIZER_ALLOCATION_STATS )
+        explicit StageScope( RenderStage stage )
+            : _previous( _stage )
+        {
+            _stage = static_cast<int>( stage ) ;
+        }
+
+        ~StageScope()
+        {
+            _stage = _previous ;
+        }
+
+    private:
+        int _previous ;
+#else
+        explicit StageScope( RenderStage )
+        {}
+#endif
+
+    public:
+        StageScope( const StageScope& ) = delete ;
+        StageScope& operator=( const StageScope& ) = delete ;
+    } ;
+
+    // Everything counted so far
+    static AllocationCounts get_counts()
+    {
+        AllocationCounts counts ;
+        for( size_t stage = 0 ; stage < render_stage_count ; ++stage )
+        {
+            counts.allocations[ stage ] = _allocations[ stage ].load( std::memory_order_relaxed ) ;
+            counts.bytes[ stage ] = _bytes[ stage ].load( std::memory_order_relaxed ) ;
+        }
+        return counts ;
+    }
+
+    // Bytes allocated in stages and not freed yet, by any thread
+    static int64_t get_live_bytes()
+    {
+        return _live_bytes.load( std::memory_order_relaxed ) ;
+    }
+
+    // The most get_live_bytes() reached since the last reset
+    static int64_t get_peak_live_bytes()
+    {
+        return _peak_live_bytes.load( std::memory_order_relaxed ) ;
+    }
+
+    static void reset_peak_live_bytes()
+    {
+        _peak_live_bytes.store( get_live_bytes(), std::memory_order_relaxed ) ;
+    }
+
+    // Called by the replaced operator new; returns whether the allocation was counted,
+    // in which case its release must be passed to record_release()
+    static bool record_allocation( size_t size )
+    {
+        if( _stage < 0 )
+            return false ;
+
+        _allocations[ _stage ].fetch_add( 1, std::memory_order_relaxed ) ;
+        _bytes[ _stage ].fetch_add( size, std::memory_order_relaxed ) ;
+
+        auto live = _live_bytes.fetch_add( static_cast<int64_t>( size ), std::memory_order_relaxed ) + static_cast<int64_t>( size ) ;
+        auto peak = _peak_live_bytes.load( std::memory_order_relaxed ) ;
+        while( live > peak && ! _peak_live_bytes.compare_exchange_weak( peak, live, std::memory_order_relaxed ) )
+        {
+        }
+        return true ;
+    }
+
+    static void record_release( size_t size )
+    {
+        _live_bytes.fetch_sub( static_cast<int64_t>( size ), std::memory_order_relaxed ) ;
+    }
+
+private:
+    // The calling thread's stage, or -1 outside of them
+    static inline thread_local int              _stage = -1 ;
+    static inline std::atomic<uint64_t>         _allocations[ render_stage_count ] = {} ;
+    static inline std::atomic<uint64_t>         _bytes[ render_stage_count ] = {} ;
+    static inline std::atomic<int64_t>          _live_bytes { 0 } ;
+    static inline std::atomic<int64_t>          _peak_live_bytes { 0 } ;
+} ;
+
+inline const char* get_stage_name( RenderStage stage )
+{
+    static const char* const names[ render_stage_count ] = {
+        "submission", "sorting", "geometry", "rasterization", "composition" } ;
+    return names[ static_cast<size_t>( stage ) ] ;
+}
+
+// One frame, as reported by Canvas::get_frame_stats()
+class FrameStats
+{
+public:
+    double           milliseconds = 0 ;         // From clear() to the end of present()
+    AllocationCounts allocations ;              // Made during the frame
+    int64_t          peak_scratch_bytes = 0 ;   // Most bytes allocated during the frame and not freed yet, at any moment
+} ;
@@ -1,21 +1,153 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <limits>
 #include <memory>
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "Mat.h"
+#include "Rect.h"
+#include "Ray.h"
 #include "Plane.h"
+#include "RadixSort.h"
+#include "LineBatch.h"
 #include "CanvasBase.h"
+#include "RasterState.h"
+#include "ShadowMap.h"
+#include "PointCloud.h"
+#include "RenderView.h"
+#include "TriangleEdges.h"
+#include "JobSystem.h"
+#include "AllocationStats.h"
+#include "DepthPyramid.h"
 #include "ModelInstance.h"
+#include "TransformStore.h"
 
 class Canvas final : public CanvasBase
 {
-    struct correspondingCoordinateLists{
-        std::vector<float> left;
-        std::vector<float> right;
+    // Where the raster kernels draw: the canvas itself, or a shadow map's depth
+    struct RasterTarget{
+        float* depth;
+        Pixel* color;   // Null for depth only targets
+        int    width;
+        int    height;
     };
 
+    // What the geometry stage needs to know about one thing to draw
+    struct DrawItem{
+        const void*  key;       // Identifies the drawn object from frame to frame
+        const Model* model;
+        const Mat*   transform; // Model to world
+        float        scale;
+        uint64_t     revision;  // Changes whenever *transform does
+    };
+
+    // An instance's triangles ready for rasterization: clipped, front facing, and
+    // indexing into the projected verticies and their camera space depths.
+    struct ProjectedGeometry{
+        const Model*          model             = nullptr;
+        uint64_t              item_revision     = 0;
+        uint64_t              camera_revision   = 0;
+        uint64_t              last_used_frame   = 0;
+        bool                  is_built          = false;
+        Mat                   transform;
+        std::vector<vec2i>    projected_verticies;
+        std::vector<float>    depths;
+        std::vector<Triangle> triangles;
+
+        bool is_current(const DrawItem& item, uint64_t camera) const{
+            return model == item.model
+                && item_revision == item.revision
+                && camera_revision == camera;
+        }
+    };
+
+    // Clipping's working space, one per geometry thread, kept between frames so that
+    // clipping stops allocating once the vectors have grown to fit
+    struct ClipScratch{
+        std::vector<vec3f>    verticies;
+        std::vector<Triangle> triangles;
+        std::vector<Triangle> clipped_triangles;
+        std::vector<uint8_t>  outside_planes;       // Per vertex, one bit per clipping plane
+        std::vector<Triangle> crossing;             // One triangle being clipped, see clip_model()
+        std::vector<Triangle> crossing_clipped;
+    };
+
+    // One draw_simple_model call while redrawing incrementally, replayed in present()
+    struct DrawRecord{
+        DrawItem             item;
+        PipelineState        state;
+        Rect                 bounds;
+    };
+
+    // A draw held back by the render queue until present()
+    struct QueuedDraw{
+        DrawItem             item;
+        PipelineState        state;
+    };
+
+    // A model's number in the current batch of queued draws, see make_sort_key()
+    struct QueuedModel{
+        uint64_t             id    = 0;
+        uint64_t             batch = 0;
+    };
+
+    // Position of a queued draw in execution order, see make_sort_key()
+    struct DrawOrder{
+        uint64_t             key;
+        uint32_t             index;     // Into _queued_draws
+    };
+
+    // Geometry a queued draw needs built, see build_queued_geometry()
+    struct GeometryBuild{
+        const DrawItem*      item;
+        ProjectedGeometry*   geometry;
+    };
+
+    // Where a bounding sphere is relative to the view frustum
+    enum class SphereSide{
+        outside,
+        inside,
+        crossing,   // Its triangles need clipping
+    };
+
+    // Past this many separate dirty rectangles, they are redrawn as their bounding box
+    static constexpr size_t max_dirty_rects = 16;
+
+    // Cache entries for instances that have not been drawn for this many frames are dropped
+    static constexpr uint64_t geometry_cache_keep_frames = 8;
+
+    // Debug lines are cut off just in front of the camera instead of projected through it
+    static constexpr float min_debug_line_z = 0.01f;
+
+    // Points nearer to the camera than this are not drawn
+    static constexpr float min_point_z = 0.01f;
+
+    // Segments per circle when outlining a bounding sphere
+    static constexpr int debug_circle_segments = 32;
+
+    // Order dependent draws queued at once, see make_sort_key()
+    static constexpr uint64_t max_draw_segment = 0xffff;
+
+    // How close to a clipping plane both ends of an edge must be to count as cut by it
+    static constexpr float clip_edge_tolerance = 1e-4f;
+
+    // Bounds of the depth weight given to translucent fragments (McGuire and Bavoil 2013)
+    static constexpr float min_translucency_weight = 1e-2f;
+    static constexpr float max_translucency_weight = 3e3f;
+
     static constexpr float viewport_size = 1;
     static constexpr float projection_z = 1;
     static const     Plane clipping_planes[ 5 ];
@@ -25,84 +157,1403 @@ public:
         : CanvasBase(window_title, height, width),
         _camera_pos({0, 0, 0}),
         _camera_orient(Mat::get_identity_matrix()),
-        _camera_transform(Mat::get_identity_matrix()){
+        _camera_transform(Mat::get_identity_matrix()),
+        _scissor({0, 0, static_cast<int>(_width), static_cast<int>(_height)}){
+            _depth_buffer = std::vector<float>(_width * _height, 0.0f);
+            _target = get_main_target();
+    }
+
+    // Without a window, see CanvasBase
+    Canvas (size_t width, size_t height)
+        : CanvasBase(width, height),
+        _camera_pos({0, 0, 0}),
+        _camera_orient(Mat::get_identity_matrix()),
+        _camera_transform(Mat::get_identity_matrix()),
+        _scissor({0, 0, static_cast<int>(_width), static_cast<int>(_height)}){
             _depth_buffer = std::vector<float>(_width * _height, 0.0f);
+            _target = get_main_target();
+    }
+
+    void clear() override
+    {
+        begin_frame();
+        ++_frame_index;
+        evict_stale_geometry();
+
+        if (_incremental_redraw)
+        {
+            // Color and depth are kept; present() repairs what changed since last frame
+            _previous_draws.swap(_current_draws);
+            _current_draws.clear();
+            return;
+        }
+
+        CanvasBase::clear();
+
+        _translucent_draws.clear();
+        discard_queued_draws();
+        std::fill(_depth_buffer.begin(), _depth_buffer.end(), 0.0f);
+        _depth_pyramid.invalidate();
+    }
+
+    void present() override
+    {
+        if (_incremental_redraw)
+        {
+            redraw_dirty_regions();
+        }
+        else
+        {
+            execute_queued_draws();
+
+            AllocationStats::StageScope stage(RenderStage::composition);
+            draw_translucent_records();
+        }
+
+        {
+            AllocationStats::StageScope stage(RenderStage::composition);
+
+            // The overlay goes over the finished picture. Incremental redraw repairs the
+            // pixels under it next frame, since the framebuffer keeps them otherwise.
+            _overlay_bounds = _overlay_lines.get_bounds();
+            flush_lines(_overlay_lines);
+
+            CanvasBase::present();
+        }
+
+        end_frame();
+    }
+
+    // The last frame, from clear() to the end of present(). Allocations are only
+    // counted when built with RASTERIZER_ALLOCATION_STATS, see AllocationStats.h.
+    const FrameStats& get_frame_stats() const {
+        return _frame_stats;
+    }
+
+    // Makes present() throw std::runtime_error, naming the stages, when the frame
+    // allocated: once models are loaded and caches are warm, a steady scene should not.
+    // Only meaningful when built with RASTERIZER_ALLOCATION_STATS.
+    void set_allocation_check(bool enabled){
+        _allocation_check = enabled;
+    }
+
+    // In incremental mode draw_simple_model only records the draw. present() then
+    // compares the frame with the previous one and re-rasterizes, scissored, just the
+    // screen regions covered by instances that appeared, disappeared, moved or changed
+    // pipeline state. Any camera change redraws everything. Instances must stay alive
+    // until present(), and occlusion culling is not applied in this mode.
+    void set_incremental_redraw(bool enabled){
+        if (enabled == _incremental_redraw)
+        {
+            return;
+        }
+
+        _incremental_redraw = enabled;
+        _translucent_draws.clear();
+        discard_queued_draws();
+        _previous_draws.clear();
+        _current_draws.clear();
+        _redraw_everything = true;
+    }
+
+    // Instances whose bounding sphere is hidden behind what has been drawn before the
+    // last call to build_occlusion_pyramid() are skipped before transforming or clipping.
+    void set_occlusion_culling(bool enabled){
+        _occlusion_culling = enabled;
+    }
+
+    // Typical use: clear(), draw the big occluders, build the pyramid, draw everything else.
+    void build_occlusion_pyramid(){
+        execute_queued_draws();
+        _depth_pyramid.build(_depth_buffer, _width, _height);
+    }
+
+    // Turns on the render queue: draws are held back until present() and then executed
+    // sorted, opaque ones front to back and grouped by model, so nearer surfaces fill
+    // the depth buffer first and hide more of what follows. Draws whose result depends
+    // on submission order (no depth test or write, alpha or additive blending) stay
+    // where they were submitted: only the runs of draws between them are sorted, so they
+    // cover, and are covered by, the same draws as without sorting. Instances must stay
+    // alive until present().
+    // Has no effect in incremental mode, which replays draws in submission order.
+    void set_draw_sorting(bool enabled){
+        if (!enabled)
+        {
+            execute_queued_draws();
+        }
+
+        _draw_sorting = enabled;
+    }
+
+    // Queued draws (see set_draw_sorting) have their geometry transformed, clipped and
+    // projected by this many threads, each instance on one of them, before any of it is
+    // rasterized; 0 uses one per core and 1 the calling thread only. Rasterization still
+    // runs in the sorted order, so the picture does not depend on the thread count.
+    // Point clouds are splatted by the same threads.
+    void set_geometry_threads(size_t count){
+        if (count != _geometry_thread_count)
+        {
+            _geometry_jobs.reset();
+        }
+
+        _geometry_thread_count = count;
+    }
+
+    // Draws the edges of each instance's visible triangles instead of filling them.
+    // Wireframes neither test nor write the depth buffer.
+    void set_wireframe(bool enabled){
+        _wireframe = enabled;
+        _redraw_everything = true;
+    }
+
+    // The debug overlay: lines queued by these calls are drawn over the frame by the next
+    // present(), without depth testing, and then discarded.
+
+    // A world space line
+    void draw_debug_line(const vec3f& from, const vec3f& to, const Color& color){
+        auto camera_from = _camera_transform * from;
+        auto camera_to = _camera_transform * to;
+        add_camera_space_line(_overlay_lines,
+            { camera_from.x, camera_from.y, camera_from.z },
+            { camera_to.x, camera_to.y, camera_to.z }, color);
+    }
+
+    // The instance's bounding sphere, as three great circles
+    void draw_debug_bounding_sphere(const ModelInstance& instance, const Color& color){
+        auto center = instance.get_transformation() * instance.get_model().bounding_sphere.center;
+        auto radius = instance.get_scale() * instance.get_model().bounding_sphere.radius;
+
+        auto previous_angle = 0.0f;
+        for (int i = 1; i <= debug_circle_segments; ++i)
+        {
+            auto angle = 2 * pi * static_cast<float>(i) / debug_circle_segments;
+            auto c0 = radius * std::cos(previous_angle), s0 = radius * std::sin(previous_angle);
+            auto c1 = radius * std::cos(angle),          s1 = radius * std::sin(angle);
+
+            draw_debug_line({ center.x + c0, center.y + s0, center.z },
+                            { center.x + c1, center.y + s1, center.z }, color);
+            draw_debug_line({ center.x, center.y + c0, center.z + s0 },
+                            { center.x, center.y + c1, center.z + s1 }, color);
+            draw_debug_line({ center.x + s0, center.y, center.z + c0 },
+                            { center.x + s1, center.y, center.z + c1 }, color);
+            previous_angle = angle;
+        }
+    }
+
+    // The screen rectangle used to bound the instance for occlusion culling and
+    // incremental redraw
+    void draw_debug_bounds(const ModelInstance& instance, const Color& color){
+        auto bounds = compute_item_bounds(make_draw_item(instance));
+        if (bounds.is_empty())
+        {
+            return;
+        }
+
+        auto full = get_full_rect();
+        _overlay_lines.add({ bounds.x0, bounds.y0 }, { bounds.x1 - 1, bounds.y0 }, color, full);
+        _overlay_lines.add({ bounds.x1 - 1, bounds.y0 }, { bounds.x1 - 1, bounds.y1 - 1 }, color, full);
+        _overlay_lines.add({ bounds.x1 - 1, bounds.y1 - 1 }, { bounds.x0, bounds.y1 - 1 }, color, full);
+        _overlay_lines.add({ bounds.x0, bounds.y1 - 1 }, { bounds.x0, bounds.y0 }, color, full);
+    }
+
+    // The edges along which the frustum's clipping planes cut the instance
+    void draw_debug_clip_edges(const ModelInstance& instance, const Color& color){
+        auto item = make_draw_item(instance);
+        auto& clipped = _clip_scratch[0];
+        if (!clip_model(item, _camera_transform * *item.transform, clipped))
+        {
+            return;
+        }
+
+        const auto& verticies = clipped.verticies;
+        for (auto& triangle : clipped.triangles)
+        {
+            const int indexes[ 3 ] = { triangle.vertex_indexes.x, triangle.vertex_indexes.y, triangle.vertex_indexes.z };
+            for (int i = 0; i < 3; ++i)
+            {
+                const auto& from = verticies[indexes[i]];
+                const auto& to = verticies[indexes[(i + 1) % 3]];
+
+                for (auto& plane : clipping_planes)
+                {
+                    if (std::abs(compute_dot_product(plane.normal, from) + plane.distance) < clip_edge_tolerance
+                        && std::abs(compute_dot_product(plane.normal, to) + plane.distance) < clip_edge_tolerance)
+                    {
+                        add_camera_space_line(_overlay_lines, from, to, color);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // Renders the depth of "casters" as seen from the map's light into the map, with the
+    // depth only kernel. Draws with ColorSource::shadowed then darken what it hides.
+    void render_shadow_map(ShadowMap& map, const std::vector<const ModelInstance*>& casters){
+        map.clear();
+
+        auto saved_scissor = _scissor;
+        auto size = static_cast<int>(map.get_size());
+        _target = { map.get_depth(), nullptr, size, size };
+        _scissor = { 0, 0, size, size };
+
+        PipelineState depth_only;
+        depth_only.color_source = ColorSource::none;
+        auto kernel = select_triangle_kernel(depth_only);
+
+        for (auto caster : casters)
+        {
+            auto item = make_draw_item(*caster);
+            auto& geometry = _scratch_geometry;
+            geometry.transform = map.get_light_transform() * *item.transform;
+            build_projected_geometry(item, geometry, _clip_scratch[0]);
+            rasterize(geometry, kernel);
+        }
+
+        _target = get_main_target();
+        _scissor = saved_scissor;
+
+        if (&map == _shadow_map)
+        {
+            _redraw_everything = true;
+        }
+    }
+
+    // Draws "instances" into every view, with the current pipeline state, in one pass over
+    // the scene. Each instance is culled against all the views' frusta at once, and its
+    // model decoded and moved to world space once; only the move to each view's camera
+    // space, clipping and rasterization are done per view, and clipping is skipped for
+    // views that contain the instance entirely. Views are not cleared first. Translucent
+    // (BlendMode::weighted) draws are blended over, as with BlendMode::alpha.
+    void render_views(const std::vector<RenderView*>& views, const std::vector<const ModelInstance*>& instances){
+        auto saved_state = _pipeline_state;
+        auto saved_scissor = _scissor;
+
+        if (_pipeline_state.blend_mode == BlendMode::weighted)
+        {
+            _pipeline_state.blend_mode = BlendMode::alpha;
+        }
+
+        if (_pipeline_state.color_source == ColorSource::shadowed && _shadow_map == nullptr)
+        {
+            _pipeline_state.color_source = ColorSource::flat;
+        }
+
+        auto kernel = select_triangle_kernel(_pipeline_state);
+
+        auto& sides = _view_sides;
+        auto& world_verticies = _view_world_verticies;
+        auto& camera_verticies = _view_camera_verticies;
+        auto& triangles = _view_triangles;
+        auto& geometry = _scratch_geometry;
+        sides.resize(views.size());
+
+        for (auto instance : instances)
+        {
+            const auto& model = instance->get_model();
+            const auto& transform = instance->get_transformation();
+            auto center = transform * model.bounding_sphere.center;
+            auto radius = instance->get_scale() * model.bounding_sphere.radius;
+
+            // Culled against the union of the frusta
+            auto is_visible = false;
+            for (size_t i = 0; i < views.size(); ++i)
+            {
+                sides[i] = classify_sphere(views[i]->get_camera_transform() * center, radius);
+                is_visible = is_visible || sides[i] != SphereSide::outside;
+            }
+
+            if (!is_visible)
+            {
+                continue;
+            }
+
+            world_verticies.resize(model.get_vertex_count());
+            model.transform_verticies(transform, world_verticies.data());
+            model.get_triangles(triangles);
+
+            for (size_t i = 0; i < views.size(); ++i)
+            {
+                if (sides[i] == SphereSide::outside)
+                {
+                    continue;
+                }
+
+                auto& view = *views[i];
+                camera_verticies.resize(world_verticies.size());
+                view.get_camera_transform().transform_points(world_verticies.data(), camera_verticies.data(),
+                    camera_verticies.size());
+
+                auto width = static_cast<int>(view.get_width());
+                auto height = static_cast<int>(view.get_height());
+                _target = { view.get_depth(), view.get_pixels(), width, height };
+                _scissor = { 0, 0, width, height };
+
+                if (_pipeline_state.color_source == ColorSource::shadowed)
+                {
+                    _camera_to_light = _shadow_map->get_light_transform() * view.get_camera_to_world();
+                }
+
+                if (sides[i] == SphereSide::inside)
+                {
+                    project_triangles(camera_verticies, triangles, geometry);
+                }
+                else
+                {
+                    auto& clipped = _clip_scratch[0];
+                    clipped.verticies.assign(camera_verticies.begin(), camera_verticies.end());
+                    clipped.triangles.assign(triangles.begin(), triangles.end());
+                    clip_triangles(clipped);
+                    project_triangles(clipped.verticies, clipped.triangles, geometry);
+                }
+
+                rasterize(geometry, kernel);
+            }
+        }
+
+        _target = get_main_target();
+        _scissor = saved_scissor;
+        _pipeline_state = saved_state;
+    }
+
+    // Draws each point of the cloud, given in world space, as a point_size x point_size
+    // square, depth tested and written whatever the pipeline state. Blocks in view are
+    // split among the geometry threads (see set_geometry_threads), which write each pixel
+    // with one 64 bit atomic holding the point's depth above its color, so the nearest
+    // point wins without locks, and in the same way for any thread count. The points are
+    // then merged into the frame. They are drawn at once: the render queue and
+    // incremental redraw do not know about them.
+    void draw_point_cloud(const PointCloud& cloud, int point_size = 1){
+        auto pixel_count = _width * _height;
+        if (!_point_buffer)
+        {
+            _point_buffer.reset(new std::atomic<uint64_t>[pixel_count]);
+            for (size_t i = 0; i < pixel_count; ++i)
+            {
+                _point_buffer[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        _visible_point_blocks.clear();
+        for (size_t block = 0; block < cloud.get_block_count(); ++block)
+        {
+            const auto& bounds = cloud.get_block_bounds(block);
+            if (classify_sphere(_camera_transform * bounds.center, bounds.radius) != SphereSide::outside)
+            {
+                _visible_point_blocks.push_back(block);
+            }
+        }
+
+        if (!_geometry_jobs)
+        {
+            _geometry_jobs = std::make_unique<JobSystem>(_geometry_thread_count);
+        }
+
+        _geometry_jobs->run(_visible_point_blocks.size(), [&](size_t index, size_t) {
+            AllocationStats::StageScope stage(RenderStage::rasterization);
+            splat_points(cloud, _visible_point_blocks[index], std::max(1, point_size)); });
+
+        // Merged and cleared for the next cloud; empty pixels are 0
+        auto pixels = get_pixel_row(0);
+        for (size_t i = 0; i < pixel_count; ++i)
+        {
+            auto point = _point_buffer[i].load(std::memory_order_relaxed);
+            if (point == 0)
+            {
+                continue;
+            }
+
+            _point_buffer[i].store(0, std::memory_order_relaxed);
+            auto inverse_z = unpack_point_depth(point);
+            if (inverse_z > _depth_buffer[i])
+            {
+                _depth_buffer[i] = inverse_z;
+                pixels[i] = Pixel(static_cast<uint32_t>(point));
+            }
+        }
+    }
+
+    // The map used by ColorSource::shadowed, or nullptr to draw those unshadowed. The
+    // map must outlive its use; re-rendering it makes incremental mode redraw everything.
+    void set_shadow_map(const ShadowMap* map){
+        _shadow_map = map;
+        _redraw_everything = true;
+    }
+
+    // Selects the raster kernel used by the following draws.
+    //
+    // ColorSource::none with depth writes is a depth only pass; it can serve as a
+    // z-prepass, after which DepthTest::nearer_or_equal without depth writes shades
+    // each visible pixel exactly once.
+    //
+    // Draws with BlendMode::weighted are translucent: they are held back until present(),
+    // rasterized after everything opaque, and blended with weighted blended order
+    // independent transparency, so they need no sorting. Their depth writes are dropped.
+    void set_pipeline_state(const PipelineState& state){
+        _pipeline_state = state;
+        if (state.blend_mode == BlendMode::weighted)
+        {
+            _pipeline_state.depth_write = false;
+        }
+    }
+
+    const PipelineState& get_pipeline_state() const{
+        return _pipeline_state;
+    }
+
+    void set_camera_pos(const vec3f& position){
+        _camera_pos = position;
+        compute_camera_transform();
+        ++_camera_revision;
+    }
+
+    void set_camera_orient(const Mat& orientation){
+        _camera_orient = orientation;
+        compute_camera_transform();
+        ++_camera_revision;
+    }
+
+    // Whether any of a world space sphere is inside the view frustum, as bounded by the
+    // clipping planes
+    bool is_sphere_visible(const vec3f& center, float radius) const{
+        return classify_sphere(_camera_transform * center, radius) != SphereSide::outside;
+    }
+
+    // The world space ray through the center of a pixel, given in buffer coordinates like
+    // a mouse position, for picking with a RayQuery. Its direction has a camera space z of
+    // 1, so distances along it are depths.
+    Ray get_pick_ray(int x, int y) const{
+        auto width = static_cast<float>(_width);
+        auto height = static_cast<float>(_height);
+        vec4f direction {
+            (static_cast<float>(x) + 0.5f - width / 2) * viewport_size / (projection_z * width),
+            (height / 2 - static_cast<float>(y) - 0.5f) * viewport_size / (projection_z * height),
+            1,
+            0 };
+        auto world_direction = _camera_orient * direction;
+        return {_camera_pos, {world_direction.x, world_direction.y, world_direction.z}};
+    }
+
+    // Keeps each instance's transformed, clipped and projected triangles between frames and
+    // reuses them until the instance, its model or the camera changes. On by default.
+    void set_geometry_caching(bool enabled){
+        _geometry_caching = enabled;
+        if (!enabled)
+        {
+            _geometry_cache.clear();
+        }
+    }
+
+    void draw_simple_model(const ModelInstance& instance) {
+        draw( make_draw_item( instance ) ) ;
+    }
+
+    // Draws the instance see-through with the given opacity, in any order relative to
+    // other translucent draws. The instance must stay alive until present().
+    void draw_translucent_model(const ModelInstance& instance, uint8_t opacity) {
+        auto saved_state = _pipeline_state ;
+
+        auto state = saved_state ;
+        state.blend_mode = BlendMode::weighted ;
+        state.opacity = opacity ;
+        set_pipeline_state( state ) ;
+
+        draw_simple_model( instance ) ;
+        _pipeline_state = saved_state ;
+    }
+
+    // Draws an entity straight from a TransformStore, as of its last update(). In
+    // incremental mode the store must not grow between this call and present().
+    void draw_entity(const Model& model, const TransformStore& transforms, TransformStore::entity entity) {
+        const auto& world_matrix = transforms.get_world_matrix( entity ) ;
+        draw( { &world_matrix, &model, &world_matrix,
+                transforms.get_scale( entity ), transforms.get_revision( entity ) } ) ;
+    }
+
+private:
+    vec3f               _camera_pos         ;
+    Mat                 _camera_orient      ;
+    Mat                 _camera_transform   ;
+    std::vector<float>  _depth_buffer{}     ;
+    DepthPyramid        _depth_pyramid      ;
+    bool                _occlusion_culling  = false ;
+    PipelineState       _pipeline_state     ;
+    uint64_t            _camera_revision    = 1 ;
+    uint64_t            _frame_index        = 0 ;
+    bool                _geometry_caching   = true ;
+    std::unordered_map<const void*, ProjectedGeometry> _geometry_cache ;
+    Rect                _scissor            ;
+    bool                _incremental_redraw = false ;
+    bool                _redraw_everything  = true ;
+    uint64_t            _drawn_camera_revision = 0 ;
+    std::vector<DrawRecord> _previous_draws ;
+    std::vector<DrawRecord> _current_draws  ;
+    bool                _wireframe          = false ;
+    LineBatch           _wireframe_lines    ;
+    LineBatch           _overlay_lines      ;
+    Rect                _overlay_bounds     { 0, 0, 0, 0 } ;
+    std::vector<DrawRecord> _translucent_draws ;
+    std::vector<vec4f>  _accumulation       ;   // Weighted premultiplied color, weighted alpha in w
+    std::vector<float>  _revealage          ;   // How much of the background still shows through
+    std::vector<Pixel>  _composite_row      ;
+    RasterTarget        _target             ;
+    const ShadowMap*    _shadow_map         = nullptr ;
+    Mat                 _camera_to_light    ;
+    bool                _draw_sorting       = false ;
+    std::vector<QueuedDraw> _queued_draws   ;
+    std::vector<DrawOrder>  _draw_order     ;
+    std::vector<DrawOrder>  _draw_order_scratch ;
+    std::unordered_map<const Model*, QueuedModel> _queued_models ; // Kept between batches
+    uint64_t            _queue_batch        = 1 ;
+    uint64_t            _queued_model_count = 0 ;   // In this batch
+    uint64_t            _draw_segment       = 0 ;   // See make_sort_key()
+    size_t              _geometry_thread_count = 0 ;
+    std::unique_ptr<JobSystem> _geometry_jobs ;     // Created on first use
+    std::vector<GeometryBuild> _geometry_builds ;
+    std::vector<ProjectedGeometry*> _queued_geometry ; // By index into _queued_draws
+    std::vector<ProjectedGeometry>  _uncached_geometry ; // Same, without geometry caching
+    std::unique_ptr<std::atomic<uint64_t>[]> _point_buffer ; // Per pixel, see draw_point_cloud()
+    std::vector<size_t> _visible_point_blocks ;
+    std::vector<ClipScratch> _clip_scratch = std::vector<ClipScratch>( 1 ) ; // By geometry thread
+    ProjectedGeometry   _scratch_geometry   ;   // Built and drawn at once, outside the queue
+    std::vector<SphereSide> _view_sides     ;   // See render_views()
+    std::vector<vec3f>  _view_world_verticies ;
+    std::vector<vec3f>  _view_camera_verticies ;
+    std::vector<Triangle> _view_triangles   ;
+    std::optional<AllocationStats::StageScope> _frame_stage ;  // Between clear() and present()
+    std::chrono::steady_clock::time_point _frame_start ;
+    AllocationCounts    _frame_start_counts ;
+    int64_t             _frame_start_live_bytes = 0 ;
+    FrameStats          _frame_stats        ;
+    bool                _allocation_check   = false ;
+
+    void begin_frame()
+    {
+        _frame_stage.reset() ;
+        _frame_start = std::chrono::steady_clock::now() ;
+        _frame_start_counts = AllocationStats::get_counts() ;
+        _frame_start_live_bytes = AllocationStats::get_live_bytes() ;
+        AllocationStats::reset_peak_live_bytes() ;
+        _frame_stage.emplace( RenderStage::submission ) ;
+    }
+
+    void end_frame()
+    {
+        // present() without clear() has no frame to report
+        if( ! _frame_stage )
+            return ;
+
+        auto counts = AllocationStats::get_counts() ;
+        for( size_t stage = 0 ; stage < render_stage_count ; ++stage )
+        {
+            _frame_stats.allocations.allocations[ stage ] = counts.allocations[ stage ] - _frame_start_counts.allocations[ stage ] ;
+            _frame_stats.allocations.bytes[ stage ] = counts.bytes[ stage ] - _frame_start_counts.bytes[ stage ] ;
+        }
+        _frame_stats.peak_scratch_bytes = std::max<int64_t>( AllocationStats::get_peak_live_bytes() - _frame_start_live_bytes, 0 ) ;
+        _frame_stats.milliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - _frame_start ).count() ;
+        _frame_stage.reset() ;
+
+        if( ! _allocation_check || _frame_stats.allocations.get_allocation_count() == 0 )
+            return ;
+
+        std::string message = "Frame " + std::to_string( _frame_index ) + " allocated:" ;
+        for( size_t stage = 0 ; stage < render_stage_count ; ++stage )
+        {
+            if( _frame_stats.allocations.allocations[ stage ] != 0 )
+                message += std::string( " " ) + get_stage_name( static_cast<RenderStage>( stage ) ) + " "
+                    + std::to_string( _frame_stats.allocations.allocations[ stage ] ) + " times ("
+                    + std::to_string( _frame_stats.allocations.bytes[ stage ] ) + " bytes)" ;
+        }
+        throw std::runtime_error( message ) ;
+    }
+
+    RasterTarget get_main_target() {
+        return { _depth_buffer.data(), get_pixel_row( 0 ),
+                 static_cast<int>( _width ), static_cast<int>( _height ) } ;
+    }
+
+    using triangle_kernel = void (Canvas::*)(vec2i, vec2i, vec2i, float, float, float, const Color&);
+
+    static DrawItem make_draw_item(const ModelInstance& instance) {
+        return { &instance, &instance.get_model(), &instance.get_transformation(),
+                 instance.get_scale(), instance.get_revision() } ;
+    }
+
+    void draw(const DrawItem& item) {
+        if( _incremental_redraw )
+        {
+            record_draw( item ) ;
+            return ;
+        }
+
+        if( _pipeline_state.blend_mode == BlendMode::weighted )
+        {
+            _translucent_draws.push_back( { item, _pipeline_state, compute_item_bounds( item ) } ) ;
+            return ;
+        }
+
+        if( _draw_sorting )
+        {
+            // The segment would overflow its 16 bits
+            if( _draw_segment == max_draw_segment )
+                execute_queued_draws() ;
+
+            _draw_order.push_back( { make_sort_key( item, _pipeline_state ),
+                                     static_cast<uint32_t>( _queued_draws.size() ) } ) ;
+            _queued_draws.push_back( { item, _pipeline_state } ) ;
+            return ;
+        }
+
+        draw_item( item ) ;
+    }
+
+    // Sort keys, most significant bits first:
+    //
+    //   63 - 48   segment: order dependent draws queued before this one
+    //   47 - 46   pass: 0 depth only, 1 opaque, 2 order dependent
+    //   45 - 22   nearest camera space z of the bounding sphere
+    //   21 -  7   model, numbered in order of first use
+    //    6 -  0   raster kernel
+    //
+    // Order dependent draws only get their segment and pass, and end their segment, so
+    // they run after the draws queued before them and before those queued after them.
+    uint64_t make_sort_key( const DrawItem& item, const PipelineState& state )
+    {
+        static_assert( raster_kernel_count <= 128, "raster kernel index must fit in 7 bits" ) ;
+
+        // Such draws end up the same whatever order they are drawn in
+        auto is_order_independent = state.depth_test != DepthTest::off && state.depth_write
+            && ( state.color_source == ColorSource::none || state.blend_mode == BlendMode::replace ) ;
+
+        auto segment = _draw_segment << 48 ;
+        if( ! is_order_independent )
+        {
+            ++_draw_segment ;
+            return segment | uint64_t { 2 } << 46 ;
+        }
+
+        uint64_t pass = state.color_source == ColorSource::none ? 0 : 1 ;
+
+        auto center = _camera_transform * ( *item.transform * item.model->bounding_sphere.center ) ;
+        auto nearest_z = center.z - item.scale * item.model->bounding_sphere.radius ;
+
+        // Entries outlive their batch, so a steady scene does not allocate map nodes
+        auto& queued_model = _queued_models[ item.model ] ;
+        if( queued_model.batch != _queue_batch )
+            queued_model = { _queued_model_count++, _queue_batch } ;
+        auto model_id = queued_model.id ;
+
+        return segment
+            | pass << 46
+            | uint64_t { quantize_depth( nearest_z ) } << 22
+            | ( model_id & 0x7fff ) << 7
+            | uint64_t { state.get_kernel_index() } ;
+    }
+
+    // 24 bits that sort like "z"; anything reaching behind the camera comes first
+    static uint32_t quantize_depth( float z )
+    {
+        if( ! ( z > 0 ) )
+            return 0 ;
+
+        // Non negative floats sort like their bit patterns
+        uint32_t bits ;
+        std::memcpy( &bits, &z, sizeof( bits ) ) ;
+        return bits >> 8 ;
+    }
+
+    void execute_queued_draws()
+    {
+        if( _queued_draws.empty() )
+            return ;
+
+        {
+            AllocationStats::StageScope stage( RenderStage::sorting ) ;
+            radix_sort( _draw_order, _draw_order_scratch ) ;
+        }
+        build_queued_geometry() ;
+
+        auto saved_state = _pipeline_state ;
+        for( auto& order : _draw_order )
+        {
+            const auto& queued = _queued_draws[ order.index ] ;
+            _pipeline_state = queued.state ;
+            draw_item( queued.item, *_queued_geometry[ order.index ] ) ;
+        }
+
+        _pipeline_state = saved_state ;
+        discard_queued_draws() ;
+    }
+
+    void discard_queued_draws()
+    {
+        _queued_draws.clear() ;
+        _draw_order.clear() ;
+
+        // Drops the models missing from this batch once they make up most of the map
+        if( _queued_models.size() > 2 * _queued_model_count + 256 )
+        {
+            for( auto it = _queued_models.begin() ; it != _queued_models.end() ; )
+                it = it->second.batch == _queue_batch ? std::next( it ) : _queued_models.erase( it ) ;
+        }
+
+        ++_queue_batch ;
+        _queued_model_count = 0 ;
+        _draw_segment = 0 ;
+    }
+
+    // Builds the geometry of every queued draw that needs it, spread over the geometry
+    // threads. Each draw gets its own ProjectedGeometry, so the threads never share
+    // output, and rasterizing them in sorted order afterwards merges them the same way
+    // whichever thread built what.
+    void build_queued_geometry()
+    {
+        AllocationStats::StageScope stage( RenderStage::geometry ) ;
+        _queued_geometry.resize( _queued_draws.size() ) ;
+        if( ! _geometry_caching )
+            _uncached_geometry.resize( _queued_draws.size() ) ;
+
+        _geometry_builds.clear() ;
+        for( auto& order : _draw_order )
+        {
+            const auto& item = _queued_draws[ order.index ].item ;
+
+            auto& geometry = _geometry_caching ? _geometry_cache[ item.key ] : _uncached_geometry[ order.index ] ;
+            update_geometry( item, geometry ) ;
+            if( ! _geometry_caching )
+                geometry.is_built = false ;
+
+            _queued_geometry[ order.index ] = &geometry ;
+            if( ! geometry.is_built )
+                _geometry_builds.push_back( { &item, &geometry } ) ;
+        }
+
+        // An instance drawn twice is built once
+        std::sort( _geometry_builds.begin(), _geometry_builds.end(),
+            []( const GeometryBuild& a, const GeometryBuild& b ) { return a.geometry < b.geometry ; } ) ;
+        _geometry_builds.erase( std::unique( _geometry_builds.begin(), _geometry_builds.end(),
+            []( const GeometryBuild& a, const GeometryBuild& b ) { return a.geometry == b.geometry ; } ),
+            _geometry_builds.end() ) ;
+
+        if( _geometry_builds.size() < 2 )
+            return ;
+
+        if( ! _geometry_jobs )
+            _geometry_jobs = std::make_unique<JobSystem>( _geometry_thread_count ) ;
+        if( _clip_scratch.size() < _geometry_jobs->get_thread_count() )
+            _clip_scratch.resize( _geometry_jobs->get_thread_count() ) ;
+
+        // Occluded draws are left unbuilt, as draw_item() would
+        _geometry_jobs->run( _geometry_builds.size(), [ this ]( size_t index, size_t thread ) {
+            const auto& build = _geometry_builds[ index ] ;
+            if( ! ( _occlusion_culling && is_occluded( *build.item, build.geometry->transform ) ) )
+                build_projected_geometry( *build.item, *build.geometry, _clip_scratch[ thread ] ) ; } ) ;
+    }
+
+    // Inverse depth in the high half, so a larger packed point is a nearer one: positive
+    // floats compare like their bit patterns. Equally near points keep the larger color.
+    static uint64_t pack_point( float inverse_z, Pixel color )
+    {
+        uint32_t depth_bits ;
+        std::memcpy( &depth_bits, &inverse_z, sizeof( depth_bits ) ) ;
+        return static_cast<uint64_t>( depth_bits ) << 32 | color.argb ;
+    }
+
+    static float unpack_point_depth( uint64_t point )
+    {
+        auto depth_bits = static_cast<uint32_t>( point >> 32 ) ;
+        float inverse_z ;
+        std::memcpy( &inverse_z, &depth_bits, sizeof( inverse_z ) ) ;
+        return inverse_z ;
+    }
+
+    // Keeps the nearest point in each pixel of the square; pixels already covered by
+    // something nearer in the depth buffer, which no thread writes meanwhile, are skipped
+    void splat_point( int x, int y, float inverse_z, Pixel color, int point_size )
+    {
+        auto width = static_cast<int>( _width ) ;
+        auto height = static_cast<int>( _height ) ;
+        auto x0 = std::max( x - ( point_size - 1 ) / 2, 0 ) ;
+        auto y0 = std::max( y - ( point_size - 1 ) / 2, 0 ) ;
+        auto x1 = std::min( x + point_size / 2 + 1, width ) ;
+        auto y1 = std::min( y + point_size / 2 + 1, height ) ;
+        auto point = pack_point( inverse_z, color ) ;
+
+        for( auto row = y0 ; row < y1 ; ++row )
+        for( auto column = x0 ; column < x1 ; ++column )
+        {
+            auto index = static_cast<size_t>( row ) * _width + column ;
+            if( inverse_z <= _depth_buffer[ index ] )
+                continue ;
+
+            auto& slot = _point_buffer[ index ] ;
+            auto current = slot.load( std::memory_order_relaxed ) ;
+            while( point > current && ! slot.compare_exchange_weak( current, point, std::memory_order_relaxed ) )
+            {
+            }
+        }
+    }
+
+    // Projects the block's points four at a time and splats those on screen
+    void splat_points( const PointCloud& cloud, size_t block, int point_size )
+    {
+        const auto& m = _camera_transform.elements ;
+        auto width = static_cast<float>( _width ) ;
+        auto height = static_cast<float>( _height ) ;
+        auto scale_x = projection_z * width / viewport_size ;
+        auto scale_y = projection_z * height / viewport_size ;
+        auto x = cloud.get_x() ;
+        auto y = cloud.get_y() ;
+        auto z = cloud.get_z() ;
+        auto colors = cloud.get_colors() ;
+
+#if defined( RASTERIZER_SSE ) && defined( RASTERIZER_SSE2 )
+        auto transform_row = [ & ]( size_t row, __m128 px, __m128 py, __m128 pz ) {
+            auto sum = _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[ row ] ), px ), _mm_set1_ps( m[ row + 3 ] ) ) ;
+            sum = _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( m[ row + 1 ] ), py ) ) ;
+            return _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( m[ row + 2 ] ), pz ) ) ; } ;
+
+        alignas( 16 ) int   screen_x[ 4 ] ;
+        alignas( 16 ) int   screen_y[ 4 ] ;
+        alignas( 16 ) float inverse_z[ 4 ] ;
+        for( auto i = block * PointCloud::block_size ; i < cloud.get_block_end( block ) ; i += 4 )
+        {
+            auto px = _mm_loadu_ps( x + i ) ;
+            auto py = _mm_loadu_ps( y + i ) ;
+            auto pz = _mm_loadu_ps( z + i ) ;
+            auto camera_x = transform_row( 0, px, py, pz ) ;
+            auto camera_y = transform_row( 4, px, py, pz ) ;
+            auto camera_z = transform_row( 8, px, py, pz ) ;
+
+            auto inverse = _mm_div_ps( _mm_set1_ps( 1 ), camera_z ) ;
+            auto sx = _mm_add_ps( _mm_set1_ps( width / 2 ), _mm_mul_ps( _mm_mul_ps( camera_x, inverse ), _mm_set1_ps( scale_x ) ) ) ;
+            auto sy = _mm_sub_ps( _mm_set1_ps( height / 2 ), _mm_mul_ps( _mm_mul_ps( camera_y, inverse ), _mm_set1_ps( scale_y ) ) ) ;
+
+            // Comparisons with NaN padding are false
+            auto visible = _mm_and_ps( _mm_cmpgt_ps( camera_z, _mm_set1_ps( min_point_z ) ),
+                           _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( sx, _mm_setzero_ps() ), _mm_cmplt_ps( sx, _mm_set1_ps( width ) ) ),
+                                       _mm_and_ps( _mm_cmpge_ps( sy, _mm_setzero_ps() ), _mm_cmplt_ps( sy, _mm_set1_ps( height ) ) ) ) ) ;
+            auto mask = _mm_movemask_ps( visible ) ;
+            if( mask == 0 )
+                continue ;
+
+            _mm_store_si128( reinterpret_cast<__m128i*>( screen_x ), _mm_cvttps_epi32( sx ) ) ;
+            _mm_store_si128( reinterpret_cast<__m128i*>( screen_y ), _mm_cvttps_epi32( sy ) ) ;
+            _mm_store_ps( inverse_z, inverse ) ;
+            for( int lane = 0 ; lane < 4 ; ++lane )
+            {
+                if( mask & ( 1 << lane ) )
+                    splat_point( screen_x[ lane ], screen_y[ lane ], inverse_z[ lane ], colors[ i + lane ], point_size ) ;
+            }
+        }
+#else
+        for( auto i = block * PointCloud::block_size ; i < cloud.get_block_end( block ) ; ++i )
+        {
+            auto camera_x = m[ 0 ] * x[ i ] + m[ 1 ] * y[ i ] + m[  2 ] * z[ i ] + m[  3 ] ;
+            auto camera_y = m[ 4 ] * x[ i ] + m[ 5 ] * y[ i ] + m[  6 ] * z[ i ] + m[  7 ] ;
+            auto camera_z = m[ 8 ] * x[ i ] + m[ 9 ] * y[ i ] + m[ 10 ] * z[ i ] + m[ 11 ] ;
+
+            auto inverse = 1.0f / camera_z ;
+            auto sx = width / 2 + camera_x * inverse * scale_x ;
+            auto sy = height / 2 - camera_y * inverse * scale_y ;
+            if( camera_z > min_point_z && sx >= 0 && sx < width && sy >= 0 && sy < height )
+                splat_point( static_cast<int>( sx ), static_cast<int>( sy ), inverse, colors[ i ], point_size ) ;
+        }
+#endif
+    }
+
+    // Starts over when the instance, its model or the camera changed
+    void update_geometry(const DrawItem& item, ProjectedGeometry& geometry) const {
+        geometry.last_used_frame = _frame_index ;
+
+        if( ! geometry.is_current( item, _camera_revision ) )
+        {
+            geometry.model           = item.model ;
+            geometry.item_revision   = item.revision ;
+            geometry.camera_revision = _camera_revision ;
+            geometry.transform       = _camera_transform * *item.transform ;
+            geometry.is_built        = false ;
+        }
+    }
+
+    void draw_item(const DrawItem& item) {
+        auto& geometry = _geometry_caching ? _geometry_cache[ item.key ] : _scratch_geometry ;
+        update_geometry( item, geometry ) ;
+        if( ! _geometry_caching )
+            geometry.is_built = false ;
+
+        draw_item( item, geometry ) ;
+    }
+
+    void draw_item(const DrawItem& item, ProjectedGeometry& geometry) {
+        if( _occlusion_culling && is_occluded( item, geometry.transform ) )
+            return ;
+
+        if( ! geometry.is_built )
+            build_projected_geometry( item, geometry, _clip_scratch[ 0 ] ) ;
+
+        if( _wireframe )
+        {
+            draw_wireframe( geometry ) ;
+            return ;
+        }
+
+        if( _pipeline_state.blend_mode == BlendMode::weighted )
+            allocate_translucency_buffers() ;
+
+        auto state = _pipeline_state ;
+        if( state.color_source == ColorSource::shadowed )
+        {
+            if( _shadow_map == nullptr )
+                state.color_source = ColorSource::flat ;
+            else
+                _camera_to_light = _shadow_map->get_light_transform() * get_camera_to_world() ;
+        }
+
+        rasterize( geometry, select_triangle_kernel( state ) ) ;
     }
 
-    void clear() override
+    void rasterize( const ProjectedGeometry& geometry, triangle_kernel kernel )
     {
-        CanvasBase::clear();
-
-        _depth_buffer = std::vector<float>(_width * _height, 0.0f);
+        AllocationStats::StageScope stage( RenderStage::rasterization ) ;
+        for( auto& triangle : geometry.triangles )
+        {
+            (this->*kernel)(
+                geometry.projected_verticies[ triangle.vertex_indexes.x ],
+                geometry.projected_verticies[ triangle.vertex_indexes.y ],
+                geometry.projected_verticies[ triangle.vertex_indexes.z ],
+                geometry.depths[ triangle.vertex_indexes.x ],
+                geometry.depths[ triangle.vertex_indexes.y ],
+                geometry.depths[ triangle.vertex_indexes.z ],
+                triangle.color ) ;
+        }
     }
 
-    void set_camera_pos(const vec3f& position){
-        _camera_pos = position;
-        compute_camera_transform();
+    void compose_camera_transform()
+    {
+        _camera_transform = _camera_orient.transpose()
+            * Mat::get_translation_matrix( -_camera_pos ) ;
     }
 
-    void set_camera_orient(const Mat& orientation){
-        _camera_orient = orientation;
-        compute_camera_transform();
+    // The inverse of _camera_transform
+    Mat get_camera_to_world() const
+    {
+        return Mat::get_translation_matrix( _camera_pos ) * _camera_orient ;
     }
 
-    void draw_simple_model(const ModelInstance& instance) {
-        auto overall_transform = _camera_transform * instance.get_transformation() ;
-
-        auto clipped_model = clip_model( instance, overall_transform ) ;
+    void build_projected_geometry( const DrawItem& item, ProjectedGeometry& geometry, ClipScratch& scratch ) const
+    {
+        AllocationStats::StageScope stage( RenderStage::geometry ) ;
+        geometry.is_built = true ;
+        geometry.projected_verticies.clear() ;
+        geometry.depths.clear() ;
+        geometry.triangles.clear() ;
 
-        if( clipped_model == nullptr )
+        if( ! clip_model( item, geometry.transform, scratch ) )
             return ;
 
-        std::vector<vec2i> projected_verticies( clipped_model->verticies.size() ) ;
-        for( size_t i = 0 ; i < clipped_model->verticies.size() ; ++i )
-            projected_verticies[ i ] = project_vertex( clipped_model->verticies[ i ] ) ;
+        project_triangles( scratch.verticies, scratch.triangles, geometry ) ;
+    }
+
+    // Projects camera space triangles, which must be in front of the camera, into
+    // "geometry", dropping those facing away
+    void project_triangles( const std::vector<vec3f>& verticies, const std::vector<Triangle>& triangles,
+                            ProjectedGeometry& geometry ) const
+    {
+        AllocationStats::StageScope stage( RenderStage::geometry ) ;
+        geometry.projected_verticies.resize( verticies.size() ) ;
+        geometry.depths.resize( verticies.size() ) ;
+        for( size_t i = 0 ; i < verticies.size() ; ++i )
+        {
+            geometry.projected_verticies[ i ] = project_vertex( verticies[ i ] ) ;
+            geometry.depths[ i ] = verticies[ i ].z ;
+        }
 
-        for( auto& triangle : clipped_model->triangles )
+        geometry.triangles.clear() ;
+        for( auto& triangle : triangles )
         {
-            auto vertex = clipped_model->verticies[triangle.vertex_indexes.x];
+            auto vertex = verticies[triangle.vertex_indexes.x];
             auto normal = compute_triangle_normal(
-                clipped_model->verticies[triangle.vertex_indexes.x],
-                clipped_model->verticies[triangle.vertex_indexes.y],
-                clipped_model->verticies[triangle.vertex_indexes.z] );
+                verticies[triangle.vertex_indexes.x],
+                verticies[triangle.vertex_indexes.y],
+                verticies[triangle.vertex_indexes.z] );
 
             if (compute_dot_product(vertex, normal) <= 0)
             {
                 continue;
             }
-            
-            draw_triangle_2d(
-                projected_verticies[ triangle.vertex_indexes.x ],
-                projected_verticies[ triangle.vertex_indexes.y ],
-                projected_verticies[ triangle.vertex_indexes.z ],
-                clipped_model->verticies[triangle.vertex_indexes.x].z,
-                clipped_model->verticies[triangle.vertex_indexes.y].z,
-                clipped_model->verticies[triangle.vertex_indexes.z].z,
-                triangle.color ) ;
+
+            geometry.triangles.push_back( triangle ) ;
         }
     }
 
-private:
-    vec3f               _camera_pos         ;
-    Mat                 _camera_orient      ;
-    Mat                 _camera_transform   ;
-    std::vector<float>  _depth_buffer{}     ;
+    Rect get_full_rect() const
+    {
+        return { 0, 0, static_cast<int>( _width ), static_cast<int>( _height ) } ;
+    }
 
-    void compose_camera_transform()
+    // Screen region an item can touch, from its bounding sphere
+    Rect compute_item_bounds( const DrawItem& item ) const
     {
-        _camera_transform = _camera_orient.transpose()
-            * Mat::get_translation_matrix( -_camera_pos ) ;
+        auto transform = _camera_transform * *item.transform ;
+        auto center = transform * item.model->bounding_sphere.center ;
+        auto radius = item.scale * item.model->bounding_sphere.radius ;
+
+        Rect  bounds ;
+        float nearest_inverse_z ;
+        if( ! compute_screen_bounds( center, radius, bounds, nearest_inverse_z ) )
+        {
+            // Reaches behind the camera: either entirely behind it or anywhere on screen
+            return center.z + radius <= 0 ? Rect { 0, 0, 0, 0 } : get_full_rect() ;
+        }
+
+        return bounds ;
+    }
+
+    static bool is_same_state( const PipelineState& a, const PipelineState& b )
+    {
+        return a.get_kernel_index() == b.get_kernel_index() && a.opacity == b.opacity ;
+    }
+
+    void record_draw( const DrawItem& item )
+    {
+        DrawRecord record { item, _pipeline_state, {} } ;
+
+        // Unchanged items under an unchanged camera keep last frame's bounds
+        const DrawRecord* previous = nullptr ;
+        if( _current_draws.size() < _previous_draws.size()
+            && _previous_draws[ _current_draws.size() ].item.key == item.key )
+        {
+            previous = &_previous_draws[ _current_draws.size() ] ;
+        }
+
+        if( previous != nullptr && previous->item.model == item.model
+            && previous->item.revision == item.revision
+            && _drawn_camera_revision == _camera_revision )
+        {
+            record.bounds = previous->bounds ;
+        }
+        else
+        {
+            record.bounds = compute_item_bounds( item ) ;
+        }
+
+        _current_draws.push_back( record ) ;
+    }
+
+    std::vector<Rect> compute_dirty_rects() const
+    {
+        if( _redraw_everything || _drawn_camera_revision != _camera_revision )
+            return { get_full_rect() } ;
+
+        std::unordered_map<const void*, const DrawRecord*> previous_by_key ;
+        for( auto& record : _previous_draws )
+            previous_by_key[ record.item.key ] = &record ;
+
+        std::vector<Rect> dirty ;
+        auto add_dirty = [ &dirty ]( const Rect& rect )
+        {
+            if( ! rect.is_empty() )
+                dirty.push_back( rect ) ;
+        } ;
+
+        // Whatever the last overlay was drawn over
+        add_dirty( _overlay_bounds ) ;
+
+        for( size_t i = 0 ; i < _current_draws.size() ; ++i )
+        {
+            const auto& record = _current_draws[ i ] ;
+            auto found = previous_by_key.find( record.item.key ) ;
+
+            if( found == previous_by_key.end() )
+            {
+                add_dirty( record.bounds ) ;
+                continue ;
+            }
+
+            const auto& previous = *found->second ;
+            previous_by_key.erase( found ) ;
+
+            // Draw order only matters once draws blend or skip the depth test
+            auto order_matters = record.state.depth_test != DepthTest::nearer
+                || record.state.blend_mode == BlendMode::alpha
+                || record.state.blend_mode == BlendMode::additive ;
+            auto same_slot = i < _previous_draws.size() && _previous_draws[ i ].item.key == record.item.key ;
+
+            if( previous.item.model != record.item.model
+                || previous.item.revision != record.item.revision
+                || ! is_same_state( previous.state, record.state )
+                || ( order_matters && ! same_slot ) )
+            {
+                add_dirty( previous.bounds.unite( record.bounds ) ) ;
+            }
+        }
+
+        // Items that were not drawn this frame
+        for( auto& removed : previous_by_key )
+            add_dirty( removed.second->bounds ) ;
+
+        return merge_rects( std::move( dirty ) ) ;
+    }
+
+    static Rect get_bounding_rect( const std::vector<Rect>& rects )
+    {
+        Rect output { 0, 0, 0, 0 } ;
+        for( auto& rect : rects )
+            output = output.unite( rect ) ;
+        return output ;
+    }
+
+    // Merges overlapping rectangles so that no pixel is redrawn twice
+    static std::vector<Rect> merge_rects( std::vector<Rect> rects )
+    {
+        auto merged_any = true ;
+        while( merged_any )
+        {
+            merged_any = false ;
+            for( size_t i = 0 ; i < rects.size() && ! merged_any ; ++i )
+            for( size_t j = i + 1 ; j < rects.size() && ! merged_any ; ++j )
+            {
+                if( rects[ i ].intersects( rects[ j ] ) )
+                {
+                    rects[ i ] = rects[ i ].unite( rects[ j ] ) ;
+                    rects.erase( rects.begin() + static_cast<std::ptrdiff_t>( j ) ) ;
+                    merged_any = true ;
+                }
+            }
+        }
+
+        if( rects.size() > max_dirty_rects )
+            return { get_bounding_rect( rects ) } ;
+
+        return rects ;
+    }
+
+    void redraw_dirty_regions()
+    {
+        auto saved_state = _pipeline_state ;
+        auto saved_occlusion_culling = _occlusion_culling ;
+        _occlusion_culling = false ;
+
+        for( auto& region : compute_dirty_rects() )
+        {
+            auto rect = region.intersect( get_full_rect() ) ;
+            if( rect.is_empty() )
+                continue ;
+
+            clear_region( rect ) ;
+            for( auto y = rect.y0 ; y < rect.y1 ; ++y )
+                std::fill( _depth_buffer.begin() + y * static_cast<int>( _width ) + rect.x0,
+                           _depth_buffer.begin() + y * static_cast<int>( _width ) + rect.x1, 0.0f ) ;
+
+            // Everything opaque first, so translucent draws are tested against all of it
+            _scissor = rect ;
+            auto has_translucency = false ;
+            for( auto translucent : { false, true } )
+            for( auto& record : _current_draws )
+            {
+                if( ! record.bounds.intersects( rect )
+                    || ( record.state.blend_mode == BlendMode::weighted ) != translucent )
+                {
+                    continue ;
+                }
+
+                _pipeline_state = record.state ;
+                draw_item( record.item ) ;
+                has_translucency |= translucent ;
+            }
+
+            if( has_translucency )
+                composite_translucency( rect ) ;
+        }
+
+        _scissor = get_full_rect() ;
+        _pipeline_state = saved_state ;
+        _occlusion_culling = saved_occlusion_culling ;
+        _redraw_everything = false ;
+        _drawn_camera_revision = _camera_revision ;
+    }
+
+    // Non incremental mode: rasterizes the translucent draws held back since clear(),
+    // then composites them
+    void draw_translucent_records()
+    {
+        if( _translucent_draws.empty() )
+            return ;
+
+        auto saved_state = _pipeline_state ;
+        Rect touched { 0, 0, 0, 0 } ;
+
+        for( auto& record : _translucent_draws )
+        {
+            _pipeline_state = record.state ;
+            draw_item( record.item ) ;
+            touched = touched.unite( record.bounds ) ;
+        }
+
+        composite_translucency( touched.intersect( get_full_rect() ) ) ;
+        _translucent_draws.clear() ;
+        _pipeline_state = saved_state ;
+    }
+
+    void allocate_translucency_buffers()
+    {
+        if( ! _revealage.empty() )
+            return ;
+
+        _accumulation.assign( _width * _height, { 0, 0, 0, 0 } ) ;
+        _revealage.assign( _width * _height, 1.0f ) ;
+        _composite_row.resize( _width ) ;
+    }
+
+    // Blends the average accumulated translucent color over "rect" of the framebuffer,
+    // weighted by how much is covered, and resets the accumulation buffers there.
+    // Translucent draws only ever touch pixels inside the rectangles composited later.
+    void composite_translucency( const Rect& rect )
+    {
+        if( _revealage.empty() || rect.is_empty() )
+            return ;
+
+        auto to_byte = []( float value ) {
+            return static_cast<uint8_t>( std::min( std::max( value, 0.0f ), 1.0f ) * 255.0f + 0.5f ) ; } ;
+
+        for( auto y = rect.y0 ; y < rect.y1 ; ++y )
+        {
+            auto offset = static_cast<size_t>( y ) * _width ;
+            auto accumulation_row = _accumulation.data() + offset ;
+            auto revealage_row = _revealage.data() + offset ;
+
+            for( auto x = rect.x0 ; x < rect.x1 ; ++x )
+            {
+                auto& source = _composite_row[ static_cast<size_t>( x - rect.x0 ) ] ;
+                auto revealage = revealage_row[ x ] ;
+                if( revealage >= 1.0f )
+                {
+                    source = Pixel( 0u ) ;  // Zero alpha leaves the pixel as it is
+                    continue ;
+                }
+
+                auto& accumulated = accumulation_row[ x ] ;
+                auto inverse_weight = 1.0f / std::max( accumulated.w, 1e-5f ) ;
+                source = { to_byte( accumulated.x * inverse_weight ),
+                           to_byte( accumulated.y * inverse_weight ),
+                           to_byte( accumulated.z * inverse_weight ),
+                           to_byte( 1.0f - revealage ) } ;
+
+                accumulated = { 0, 0, 0, 0 } ;
+                revealage_row[ x ] = 1.0f ;
+            }
+
+            blend_span_over( get_pixel_row( y ) + rect.x0, _composite_row.data(),
+                             static_cast<size_t>( rect.x1 - rect.x0 ) ) ;
+        }
+    }
+
+    // Favors nearer fragments so that they dominate the average, without sorting
+    static float compute_translucency_weight( float z, float alpha )
+    {
+        auto z_near = z / 5.0f ;
+        auto z_far = z / 200.0f ;
+        auto z_far_cubed = z_far * z_far * z_far ;
+        auto weight = 10.0f / ( 1e-5f + z_near * z_near + z_far_cubed * z_far_cubed ) ;
+        return alpha * std::min( std::max( weight, min_translucency_weight ), max_translucency_weight ) ;
+    }
+
+    void evict_stale_geometry()
+    {
+        for( auto it = _geometry_cache.begin() ; it != _geometry_cache.end() ; )
+        {
+            if( it->second.last_used_frame + geometry_cache_keep_frames < _frame_index )
+                it = _geometry_cache.erase( it ) ;
+            else
+                ++it ;
+        }
+    }
+
+    // Computes a conservative depth buffer rectangle covering the projection of a camera
+    // space sphere, along with the inverse z of its nearest point. Returns false when the
+    // sphere reaches behind the camera, in which case it can not be bounded on screen.
+    bool compute_screen_bounds( const vec4f& center, float radius,
+        Rect& bounds, float& nearest_inverse_z ) const
+    {
+        auto near_z = center.z - radius ;
+        auto far_z  = center.z + radius ;
+
+        if( near_z <= std::numeric_limits<float>::epsilon() )
+            return false ;
+
+        auto w = static_cast<float>( _width ) ;
+        auto h = static_cast<float>( _height ) ;
+
+        // The sphere lies inside the box center +/- radius, and x / z over that box is
+        // extreme at one of the corners, so checking the near and far faces is enough.
+        auto x_min = std::min( ( center.x - radius ) / near_z, ( center.x - radius ) / far_z ) * w / viewport_size ;
+        auto x_max = std::max( ( center.x + radius ) / near_z, ( center.x + radius ) / far_z ) * w / viewport_size ;
+        auto y_min = std::min( ( center.y - radius ) / near_z, ( center.y - radius ) / far_z ) * h / viewport_size ;
+        auto y_max = std::max( ( center.y + radius ) / near_z, ( center.y + radius ) / far_z ) * h / viewport_size ;
+
+        // Convert to depth buffer coordinates, padding a pixel for truncation in projection
+        auto half_w = static_cast<float>( static_cast<int>( _width ) / 2 ) ;
+        auto half_h = static_cast<float>( static_cast<int>( _height ) / 2 ) ;
+
+        Rect unclamped {
+            static_cast<int>( std::max( std::floor( half_w + x_min ) - 1, -1.0f ) ),
+            static_cast<int>( std::max( std::floor( half_h - y_max ) - 1, -1.0f ) ),
+            static_cast<int>( std::min( std::ceil ( half_w + x_max ) + 2, w + 1 ) ),
+            static_cast<int>( std::min( std::ceil ( half_h - y_min ) + 2, h + 1 ) ) } ;
+
+        bounds = unclamped.intersect( { 0, 0, static_cast<int>( _width ), static_cast<int>( _height ) } ) ;
+        nearest_inverse_z = 1.0f / near_z ;
+        return true ;
+    }
+
+    bool is_occluded( const DrawItem& item, const Mat& transform ) const
+    {
+        if( ! _depth_pyramid.is_valid() )
+            return false ;
+
+        auto center = transform * item.model->bounding_sphere.center ;
+        auto radius = item.scale * item.model->bounding_sphere.radius ;
+
+        Rect  bounds ;
+        float nearest_inverse_z ;
+        if( ! compute_screen_bounds( center, radius, bounds, nearest_inverse_z ) )
+            return false ;
+
+        // Entirely off screen; the frustum test in clip_model will reject it
+        if( bounds.is_empty() )
+            return false ;
+
+        return _depth_pyramid.is_occluded( bounds, nearest_inverse_z ) ;
+    }
+
+    // "center" is in camera space
+    static SphereSide classify_sphere( const vec4f& center, float radius )
+    {
+        auto side = SphereSide::inside ;
+        for( auto& clipping_plane : clipping_planes )
+        {
+            auto distance = compute_dot_product( clipping_plane.normal, center ) + clipping_plane.distance ;
+            if( distance < -radius )
+                return SphereSide::outside ;
+
+            if( distance <= radius + clip_edge_tolerance )
+                side = SphereSide::crossing ;
+        }
+        return side ;
     }
 
-    std::unique_ptr<Model> clip_model( const ModelInstance& instance, const Mat& transform ) const
+    // Leaves the clipped camera space triangles in "scratch"; false if nothing is left
+    bool clip_model( const DrawItem& item, const Mat& transform, ClipScratch& scratch ) const
     {
         //----------------------------------------------------------------------------------------
         // Phase 1: Reject the model if it is clipped entirely
         //----------------------------------------------------------------------------------------
 
         // Get the transformed center and radius of the model's bounding sphere
-        auto transformed_center = transform * instance.model.bounding_sphere.center;
-        auto transformed_radius = instance.get_scale() * instance.model.bounding_sphere.radius;
+        const auto& model = *item.model;
+        auto transformed_center = transform * model.bounding_sphere.center;
+        auto transformed_radius = item.scale * model.bounding_sphere.radius;
 
         // Discard instance if it is entirely outside of the viewing frustrum
         for (auto& clipping_plane : clipping_planes)
@@ -112,7 +1563,7 @@ private:
 
             if (distance < -transformed_radius)
             {
-                return nullptr;
+                return false;
             }
         }
 
@@ -121,39 +1572,90 @@ private:
         //----------------------------------------------------------------------------------------
 
         // Transform verticies
-        std::vector<vec3f> verticies(instance.model.verticies.size());
+        scratch.verticies.resize(model.get_vertex_count());
+
+        model.transform_verticies(transform, scratch.verticies.data());
+
+        AllocationStats::StageScope stage( RenderStage::geometry ) ;
+
+        // Step 1.) Flag the planes each vertex is outside of
+        auto vertex_count = scratch.verticies.size();
+        scratch.outside_planes.resize(vertex_count);
+        for (size_t i = 0; i < vertex_count; ++i)
+        {
+            uint8_t outside = 0;
+            for (size_t plane = 0; plane < std::size(clipping_planes); ++plane)
+            {
+                auto distance = compute_dot_product(clipping_planes[plane].normal, scratch.verticies[i])
+                    + clipping_planes[plane].distance;
+                outside |= distance > 0 ? 0 : static_cast<uint8_t>(1u << plane);
+            }
+            scratch.outside_planes[i] = outside;
+        }
+
+        // Step 2.) Read the model's triangles once, decoding compact ones on the fly. Those
+        //          inside every plane are kept as they are, those outside any one plane
+        //          dropped, and only those crossing a plane are clipped. The result is the
+        //          same, in the same order, as clipping every triangle against every plane.
+        scratch.triangles.clear();
+        model.for_each_triangle([&](const Triangle& triangle){
+            auto a = scratch.outside_planes[triangle.vertex_indexes.x];
+            auto b = scratch.outside_planes[triangle.vertex_indexes.y];
+            auto c = scratch.outside_planes[triangle.vertex_indexes.z];
+            if ((a | b | c) == 0)
+            {
+                scratch.triangles.push_back(triangle);
+            }
+            else if ((a & b & c) == 0)
+            {
+                clip_crossing_triangle(triangle, scratch);
+            }
+        });
 
-        for (size_t i = 0; i < instance.model.verticies.size(); ++i)
+        return true;
+    }
+
+    // Clips one triangle that crosses the frustum against every plane, appending what is
+    // left of it to scratch.triangles
+    void clip_crossing_triangle( const Triangle& triangle, ClipScratch& scratch ) const
+    {
+        scratch.crossing.assign( 1, triangle ) ;
+        for( auto& clipping_plane : clipping_planes )
         {
-            auto tv = transform * instance.model.verticies[i];
-            verticies[i] = {tv.x, tv.y, tv.z};
-        }        
+            scratch.crossing_clipped.clear() ;
+            for( auto& unclipped_triangle : scratch.crossing )
+                clip_triangle( clipping_plane, unclipped_triangle, scratch.verticies, scratch.crossing_clipped ) ;
 
-        // Clip each of the triangles (with transformed verticies) against each successive plane
+            scratch.crossing.swap( scratch.crossing_clipped ) ;
+        }
 
-        // Step 1.) Copy model triangles to vectors we will call "unclipped"
-        std::vector<Triangle> unclipped_triangles{instance.model.triangles};
+        scratch.triangles.insert( scratch.triangles.end(), scratch.crossing.begin(), scratch.crossing.end() ) ;
+    }
 
+    // Clips each of the scratch triangles (with camera space verticies) against each
+    // successive plane, in place
+    void clip_triangles( ClipScratch& scratch ) const
+    {
+        AllocationStats::StageScope stage( RenderStage::geometry ) ;
         // Step 2.) Go through each of the clipping planes
         for(auto& clipping_plane : clipping_planes){
-            // Step 3.) Create empty vectors to hold the triangles after they are clipped
-            std::vector<Triangle> clipped_trianges;
+            // Step 3.) Empty the vector that holds the triangles after they are clipped
+            scratch.clipped_triangles.clear();
 
             // Step 4.) Go through each of the triangles (for the current clipping plane)
-            for(auto& unclipped_triangle : unclipped_triangles){
-                // Step 5.) Add the clipped triangles to the clipped triangle vectors
-                clip_triangle(clipping_plane, unclipped_triangle, verticies, clipped_trianges);
+            for(auto& unclipped_triangle : scratch.triangles){
+                // Step 5.) Add the clipped triangles to the clipped triangle vector
+                clip_triangle(clipping_plane, unclipped_triangle, scratch.verticies, scratch.clipped_triangles);
             }
 
-            // Step 6.) The vectors now have triangles clipped relative to the current clipping plane.
-            //          Copy them to the unclipped vectors because they have not yet been clipped relative
+            // Step 6.) The vector now has triangles clipped relative to the current clipping plane.
+            //          Swap it with the unclipped one because they have not yet been clipped relative
             //            to the next clipping plane.
-            unclipped_triangles = std::vector<Triangle>{clipped_trianges};
+            scratch.triangles.swap(scratch.clipped_triangles);
         }
 
-        // Step 7.) There was not a next clipping plane, so the triangles that are in the "unclipped" vectors
-        //            are actually fully clipped.  So, pass back a new model made up of the clipped triangles.
-        return std::make_unique<Model>(Model{verticies, unclipped_triangles});
+        // Step 7.) There was not a next clipping plane, so the triangles that are in the "unclipped" vector
+        //            are actually fully clipped.
     }
 
     void clip_triangle( const Plane& plane, const Triangle& triangle,
@@ -257,39 +1759,51 @@ private:
         }
     }
 
-    void draw_line_2d(vec2i pt1, vec2i pt2, const Color& color) const {
-        auto dx = pt2.x - pt1.x;
-        auto dy = pt2.y - pt1.y;
+    void draw_wireframe( const ProjectedGeometry& geometry )
+    {
+        for( auto& triangle : geometry.triangles )
+        {
+            auto pt1 = canvas_to_buffer( geometry.projected_verticies[ triangle.vertex_indexes.x ] ) ;
+            auto pt2 = canvas_to_buffer( geometry.projected_verticies[ triangle.vertex_indexes.y ] ) ;
+            auto pt3 = canvas_to_buffer( geometry.projected_verticies[ triangle.vertex_indexes.z ] ) ;
 
-        if (std::abs(dx) > std::abs(dy)){
-            if(dx<0){
-                std::swap(pt1, pt2);
-            }
-            auto ys = interpolate(pt1.x, static_cast<float>(pt1.y), pt2.x, static_cast<float>(pt2.y));
-            for (int x = pt1.x; x < pt2.x; ++x)
-            {
-                put_pixel({x, static_cast<int>(ys[x - pt1.x])}, color);
-            }
-            
+            _wireframe_lines.add( pt1, pt2, triangle.color, _scissor ) ;
+            _wireframe_lines.add( pt2, pt3, triangle.color, _scissor ) ;
+            _wireframe_lines.add( pt3, pt1, triangle.color, _scissor ) ;
         }
-        else{
-            if(dy<0){
-                std::swap(pt1, pt2);
-            }
-            auto xs = interpolate(pt1.y, static_cast<float>(pt1.x), pt2.y, static_cast<float>(pt2.x));
-            for (int y = pt1.y; y < pt2.y; ++y)
-            {
-                put_pixel({static_cast<int>(xs[y - pt1.y]), y}, color);
-            }
+
+        flush_lines( _wireframe_lines ) ;
+    }
+
+    // Cuts a camera space line off in front of the camera, then projects it into "lines"
+    void add_camera_space_line( LineBatch& lines, vec3f from, vec3f to, const Color& color ) const
+    {
+        if( from.z < min_debug_line_z && to.z < min_debug_line_z )
+            return ;
+
+        if( from.z < min_debug_line_z || to.z < min_debug_line_z )
+        {
+            auto& behind = from.z < min_debug_line_z ? from : to ;
+            const auto& ahead = from.z < min_debug_line_z ? to : from ;
+            auto t = ( min_debug_line_z - ahead.z ) / ( behind.z - ahead.z ) ;
+            behind = { ahead.x + t * ( behind.x - ahead.x ), ahead.y + t * ( behind.y - ahead.y ), min_debug_line_z } ;
         }
+
+        lines.add( canvas_to_buffer( project_vertex( from ) ), canvas_to_buffer( project_vertex( to ) ),
+                   color, get_full_rect() ) ;
     }
 
-    void draw_triangle_2d_outline(vec2i pt1, vec2i pt2, vec2i pt3, const Color& color) const {
-        draw_line_2d(pt1,pt2,color);
-        draw_line_2d(pt3,pt2,color);
-        draw_line_2d(pt3,pt1,color);
+    void flush_lines( LineBatch& lines )
+    {
+        lines.flush( [ this ]( const SDL_Point* points, size_t count, const Color& color )
+        {
+            put_points( points, count, color ) ;
+        } ) ;
     }
 
+    // Raster kernel, instantiated once per RasterState. All the state checks below are
+    // resolved at compile time, so the per pixel loop only does the work it needs.
+    template<typename State>
     void draw_triangle_2d(vec2i pt1, vec2i pt2, vec2i pt3, float pt1_z, float pt2_z, float pt3_z, const Color& color) {
         //Sort points by height
         if (pt2.y < pt1.y)
@@ -310,131 +1824,259 @@ private:
             std::swap(pt2_z, pt3_z);
         }
         
-        //Create interpolations
-        auto x_coords_per_y = interpolate_between_edges(
+        // Walked row by row, including rows above the scissor rectangle, so every kernel
+        // gets the same values for the same triangle
+        TriangleEdges x_edges(
             pt1.y, static_cast<float>(pt1.x),
             pt2.y, static_cast<float>(pt2.x),
-            pt3.y, static_cast<float>(pt3.x)
-        );
+            pt3.y, static_cast<float>(pt3.x));
 
-        // Interpolate inverse Z Coord
-        auto inv_z_coords_per_y = interpolate_between_edges(
+        TriangleEdges inverse_z_edges(
             pt1.y, 1.0f/pt1_z,
             pt2.y, 1.0f/pt2_z,
-            pt3.y, 1.0f/pt3_z
-        );
+            pt3.y, 1.0f/pt3_z,
+            x_edges);
 
-        //working through lists
-        for (auto y = pt1.y; y <= pt3.y; ++y)
+        auto next_row = [&]{
+            x_edges.step();
+            if constexpr (State::needs_depth)
+            {
+                inverse_z_edges.step();
+            }
+        };
+
+        auto w = _target.width;
+        auto half_w = w / 2;
+        auto half_h = _target.height / 2;
+
+        // Constant over the triangle; opacity only matters when blending
+        auto opacity = State::blend_mode == BlendMode::replace ? uint8_t(255) : _pipeline_state.opacity;
+        auto alpha = static_cast<float>(_pipeline_state.opacity) / 255.0f;
+        auto pixel = color.to_pixel(opacity);
+        auto premultiplied_color = get_premultiplied_color(color, alpha);
+
+        // The colors used where the shadow map says the surface is in shadow
+        Pixel shadow_pixel;
+        vec4f shadow_premultiplied_color {};
+        if constexpr (State::shadowed)
         {
-            auto idx_into_lists = y - pt1.y;
+            auto shadow_color = get_shadow_color(color);
+            shadow_pixel = shadow_color.to_pixel(opacity);
+            shadow_premultiplied_color = get_premultiplied_color(shadow_color, alpha);
+        }
+
+        // Rows and columns outside the scissor rectangle are dropped up front instead of per pixel
+        auto y_first = std::max(pt1.y, half_h - _scissor.y1 + 1);
+        auto y_last = std::min(pt3.y, half_h - _scissor.y0);
 
-            auto x_start = static_cast<int>(x_coords_per_y.left[idx_into_lists]);
-            auto x_end = static_cast<int>(x_coords_per_y.right[idx_into_lists]);
+        for (auto y = pt1.y; y < y_first; ++y)
+        {
+            next_row();
+        }
 
-            auto z_left = inv_z_coords_per_y.left[idx_into_lists];
-            auto z_right = inv_z_coords_per_y.right[idx_into_lists];
-            
-            auto zscan = interpolate(
-                x_start, z_left, x_end, z_right
-            );
+        for (auto y = y_first; y <= y_last; ++y, next_row())
+        {
+            auto x_start = static_cast<int>(x_edges.get_left());
+            auto x_end = static_cast<int>(x_edges.get_right());
 
-            for(int x = x_start; x <= x_end; ++x){
-                if(check_and_update_depth_buffer(x, y, zscan[x - x_start])){
-                    put_pixel({x,y}, color);
-                }
+            auto x_first = std::max(x_start, _scissor.x0 - half_w);
+            auto x_last = std::min(x_end, _scissor.x1 - 1 - half_w);
+
+            if (x_first > x_last)
+            {
+                continue;
             }
-        }
-    }
 
-    bool check_and_update_depth_buffer(int x, int y, float inverse_z) {
-        auto w = static_cast<int>(_width);
-        auto h = static_cast<int>(_height);
+            // Rows point at the pixel for x == 0
+            auto offset = (half_h - y) * w + half_w;
+            auto depth_row = _target.depth + offset;
 
-        // convert x & y to list of values from normalized origin
-        x = w / 2 +x;
-        y = h / 2 -y;
+            float z_left = 0;
+            float inverse_z_step = 0;
+            if constexpr (State::needs_depth)
+            {
+                z_left = inverse_z_edges.get_left();
+                auto z_right = inverse_z_edges.get_right();
 
-        if(x < 0 || x >= w || y < 0 || y>= h){
-            return false;
-        }
+                if (x_end != x_start)
+                {
+                    inverse_z_step = (z_right - z_left) / static_cast<float>(x_end - x_start);
+                }
+            }
 
-        auto offset = w * y + x;
+            Pixel* color_row = nullptr;
+            if constexpr (State::writes_color)
+            {
+                color_row = _target.color + offset;
+            }
 
-        if(_depth_buffer[offset] < inverse_z){
-            _depth_buffer[offset] = inverse_z;
-            return true;
-        }
+            vec4f* accumulation_row = nullptr;
+            float* revealage_row = nullptr;
+            if constexpr (State::accumulates)
+            {
+                accumulation_row = _accumulation.data() + offset;
+                revealage_row = _revealage.data() + offset;
+            }
+
+            if constexpr (State::needs_depth)
+            {
+                for(int x = x_first; x <= x_last; ++x){
+                    // Computed from the span start rather than accumulated, so a pixel gets the
+                    // same depth however the span was clipped
+                    auto inverse_z = z_left + inverse_z_step * static_cast<float>(x - x_start);
+
+                    if constexpr (State::depth_test == DepthTest::nearer)
+                    {
+                        if (!(depth_row[x] < inverse_z))
+                        {
+                            continue;
+                        }
+                    }
+                    else if constexpr (State::depth_test == DepthTest::nearer_or_equal)
+                    {
+                        if (!(depth_row[x] <= inverse_z))
+                        {
+                            continue;
+                        }
+                    }
+
+                    if constexpr (State::depth_write)
+                    {
+                        depth_row[x] = inverse_z;
+                    }
+
+                    auto lit = true;
+                    if constexpr (State::shadowed)
+                    {
+                        lit = is_lit({x, y}, inverse_z);
+                    }
+
+                    if constexpr (State::accumulates)
+                    {
+                        auto weight = compute_translucency_weight(1.0f / inverse_z, alpha);
+                        accumulation_row[x] = accumulation_row[x]
+                            + weight * (lit ? premultiplied_color : shadow_premultiplied_color);
+                        revealage_row[x] *= 1.0f - alpha;
+                    }
+                    else if constexpr (State::writes_color && !State::writes_spans)
+                    {
+                        write_pixel<State>(color_row[x], lit ? pixel : shadow_pixel);
+                    }
+                }
+            }
 
-        return false;
+            // Without a depth test every pixel of the span is written, so do it as a span
+            if constexpr (State::writes_spans)
+            {
+                write_span<State>(color_row + x_first, static_cast<size_t>(x_last - x_first + 1), pixel);
+            }
+        }
     }
 
-    void draw_line_3d(const vec3f pt1, const vec3f pt2, const Color& color){
-        auto pv1 = project_vertex(pt1);
-        auto pv2 = project_vertex(pt2);
-        draw_line_2d(pv1, pv2, color);
+    static vec4f get_premultiplied_color(const Color& color, float alpha)
+    {
+        return {
+            alpha * static_cast<float>(color.r) / 255.0f,
+            alpha * static_cast<float>(color.g) / 255.0f,
+            alpha * static_cast<float>(color.b) / 255.0f,
+            alpha };
     }
-    
-    void draw_triangle_3d(const vec3f& v1, const vec3f& v2, const vec3f& v3, Color color) const{
-        auto pv1 = project_vertex(v1);
-        auto pv2 = project_vertex(v2);
-        auto pv3 = project_vertex(v3);
 
-        draw_line_2d(pv1, pv2, color);
-        draw_line_2d(pv2, pv3, color);
-        draw_line_2d(pv1, pv3, color);
+    Color get_shadow_color(const Color& color) const
+    {
+        auto brightness = _shadow_map->get_shadow_brightness();
+        auto scale = [brightness](uint8_t channel){
+            return static_cast<uint8_t>(static_cast<float>(channel) * brightness + 0.5f); };
+        return Color::custom(scale(color.r), scale(color.g), scale(color.b));
     }
 
-    static std::vector<float> interpolate(int i0, float d0, int i1, float d1){
-        if (i0 == i1)
+    // Looks up a pixel of the main view, given in canvas coordinates, in the shadow map
+    bool is_lit(const vec2i& pt, float inverse_z) const
+    {
+        // Back to camera space by undoing the projection, then over to light space
+        auto z = 1.0f / inverse_z;
+        vec3f camera_point {
+            static_cast<float>(pt.x) * z * viewport_size / (projection_z * static_cast<float>(_target.width)),
+            static_cast<float>(pt.y) * z * viewport_size / (projection_z * static_cast<float>(_target.height)),
+            z };
+        auto light_point = _camera_to_light * camera_point;
+
+        if (light_point.z <= std::numeric_limits<float>::epsilon())
         {
-            return std::vector <float> {d0};
+            return true;
         }
-        else{
-            auto values = std::vector<float>();
 
-            auto a = (d1-d0)/static_cast<float>(i1-i0);
-            auto d = d0;
+        auto size = static_cast<int>(_shadow_map->get_size());
+        return _shadow_map->is_lit(
+            project_to_buffer({light_point.x, light_point.y, light_point.z}, size, size),
+            1.0f / light_point.z);
+    }
 
-            for (int i = i0; i < i1; ++i)
-            {
-                values.push_back(d);
-                d += a;
-            }
-            
-            return values;
+    template<typename State>
+    static void write_pixel(Pixel& dst, Pixel src)
+    {
+        if constexpr (State::blend_mode == BlendMode::replace)
+        {
+            dst = src;
+        }
+        else if constexpr (State::blend_mode == BlendMode::alpha)
+        {
+            dst = blend_over(dst, src);
+        }
+        else
+        {
+            dst = blend_additive(dst, src);
         }
     }
 
-    static correspondingCoordinateLists interpolate_between_edges(int y0, float v0, int y1, float v1, int y2, float v2){
-        auto x01 = interpolate(y0, v0, y1, v1);
-        auto x12 = interpolate(y1, v1, y2, v2);
-        auto x02 = interpolate(y0, v0, y2, v2);
-
-        // x01.pop_back();
-        // x01.insert(x01.end(), x12.begin(), x12.end());
-        auto x012 = x01;
-        x012.pop_back();
-        x012.insert(x012.end(), x12.begin(), x12.end());
-
-        auto m = x02.size() / 2;
-        auto left = x012;//
-        auto right = x02;
-
-        if (left[m] > right[m])
+    template<typename State>
+    static void write_span(Pixel* dst, size_t count, Pixel src)
+    {
+        if constexpr (State::blend_mode == BlendMode::replace)
+        {
+            fill_span(dst, count, src);
+        }
+        else if constexpr (State::blend_mode == BlendMode::alpha)
+        {
+            blend_span_over(dst, count, src);
+        }
+        else
         {
-            std::swap(left, right);
+            blend_span_additive(dst, count, src);
         }
+    }
+
+    template<size_t... kernel_indexes>
+    static std::array<triangle_kernel, sizeof...(kernel_indexes)> make_triangle_kernels(std::index_sequence<kernel_indexes...>)
+    {
+        return {{ &Canvas::draw_triangle_2d<RasterState<kernel_indexes>>... }};
+    }
 
-        return {left, right};
+    static triangle_kernel select_triangle_kernel(const PipelineState& state)
+    {
+        static const auto kernels = make_triangle_kernels(std::make_index_sequence<raster_kernel_count>{});
+        return kernels[state.get_kernel_index()];
     }
 
     vec2i viewport_to_canvas(const vec2f& pt) const{
         return {
-            static_cast<int>((pt.x * static_cast<float>(_width)) / viewport_size),
-            static_cast<int>((pt.y * static_cast<float>(_height)) / viewport_size)};
+            static_cast<int>((pt.x * static_cast<float>(_target.width)) / viewport_size),
+            static_cast<int>((pt.y * static_cast<float>(_target.height)) / viewport_size)};
+    }
+
+    // Projects a camera space point straight to buffer coordinates of a width x height target
+    static vec2i project_to_buffer(const vec3f& v, int width, int height){
+        return {
+            width / 2 + static_cast<int>((v.x * projection_z) / v.z * static_cast<float>(width) / viewport_size),
+            height / 2 - static_cast<int>((v.y * projection_z) / v.z * static_cast<float>(height) / viewport_size)};
     }
     
+    vec2i canvas_to_buffer(const vec2i& pt) const{
+        return {
+            static_cast<int>(_width) / 2 + pt.x,
+            static_cast<int>(_height) / 2 - pt.y};
+    }
+
     vec2i project_vertex(const vec3f& v) const{
         return viewport_to_canvas({
             (v.x * projection_z) / v.z,
@@ -1,9 +1,18 @@
 #pragma once
 
 #include <SDL2/SDL.h>
+#include <algorithm>
+#include <memory>
 #include <stdexcept>
+#include <string>
+#include <vector>
 #include "Vec.h"
+#include "Rect.h"
 #include "Color.h"
+#include "Pixel.h"
+#include "PixelSpans.h"
+#include "RasterState.h"
+#include "FrameCapture.h"
 
 class CanvasBase
 {
@@ -36,6 +45,28 @@ public:
                 + SDL_GetError()
             );
         }
+
+        // Frames are drawn into _pixels and uploaded to this texture once per present()
+        _texture = SDL_CreateTexture(_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+            static_cast<int>(width), static_cast<int>(height));
+
+        if (_texture == nullptr)
+        {
+            throw std::runtime_error(
+                std::string("Could not create frame texture: ")
+                + SDL_GetError()
+            );
+        }
+
+        _pixels.resize(width * height, background);
+    }
+
+    // Draws without a window, or SDL at all, e.g. for a render server. present() then
+    // just finishes the frame, which get_pixels() returns.
+    CanvasBase(size_t width, size_t height)
+    : _width (width), _height( height)
+    {
+        _pixels.resize(width * height, background);
     }
 
     //delete copy / duplicate operators
@@ -48,34 +79,154 @@ public:
 
     virtual ~CanvasBase()
     {
+        if (_window == nullptr)
+        {
+            return;
+        }
+
+        SDL_DestroyTexture(_texture);
         SDL_DestroyRenderer(_renderer);
         SDL_DestroyWindow(_window);
     }
 
-    void put_pixel( const vec2i& pt,const Color& color) const
+    // Writes one pixel given in canvas coordinates, using the current blend mode.
+    // Points off the canvas are ignored.
+    void put_pixel( const vec2i& pt,const Color& color, uint8_t alpha = 255)
     {
-        SDL_SetRenderDrawColor(_renderer, color.r, color.g, color.b, 255);
-        SDL_RenderDrawPoint(_renderer, 
-            (static_cast<int>(_width)/2) + pt.x,
-            (static_cast<int>(_height)/2) - pt.y);
+        auto x = (static_cast<int>(_width)/2) + pt.x;
+        auto y = (static_cast<int>(_height)/2) - pt.y;
+        if (x < 0 || y < 0 || x >= static_cast<int>(_width) || y >= static_cast<int>(_height))
+        {
+            return;
+        }
+
+        auto& pixel = _pixels[static_cast<size_t>(y) * _width + static_cast<size_t>(x)];
+
+        switch( _blend_mode )
+        {
+            case BlendMode::replace:  pixel = color.to_pixel();                                break;
+            case BlendMode::alpha:    pixel = blend_over(pixel, color.to_pixel(alpha));       break;
+            case BlendMode::additive: pixel = blend_additive(pixel, color.to_pixel(alpha));   break;
+            // Needs the canvas' accumulation buffers; a lone pixel is just blended over
+            case BlendMode::weighted: pixel = blend_over(pixel, color.to_pixel(alpha));       break;
+        }
+    }
+
+    // Draws opaque points given in buffer coordinates, which must be on screen
+    void put_points( const SDL_Point* points, size_t count, const Color& color )
+    {
+        auto pixel = color.to_pixel();
+        for (size_t i = 0; i < count; ++i)
+        {
+            _pixels[static_cast<size_t>(points[i].y) * _width + static_cast<size_t>(points[i].x)] = pixel;
+        }
+    }
+
+    // Applies to every put_pixel until changed again
+    void set_blend_mode( BlendMode blend_mode )
+    {
+        _blend_mode = blend_mode;
     }
 
     virtual void clear()
     {
-        SDL_SetRenderDrawColor(_renderer, 0, 0, 0, 255);
-        SDL_RenderClear(_renderer);
+        fill_span(_pixels.data(), _pixels.size(), background);
     }
 
-    void present() const
+    // Clears only "region" (in buffer coordinates)
+    void clear_region( const Rect& region )
     {
-        SDL_RenderPresent( _renderer);
+        for (auto y = region.y0; y < region.y1; ++y)
+        {
+            fill_span(get_pixel_row(y) + region.x0, static_cast<size_t>(region.x1 - region.x0),
+                background);
+        }
+    }
+
+    virtual void present()
+    {
+        capture_frame();
+
+        if (_window == nullptr)
+        {
+            return;
+        }
+
+        SDL_UpdateTexture(_texture, nullptr, _pixels.data(), static_cast<int>(_width * sizeof(Pixel)));
+        SDL_RenderCopy(_renderer, _texture, nullptr, nullptr);
+        SDL_RenderPresent(_renderer);
+    }
+
+    // Saves every presented frame as "<path_prefix>NNNNNN.ppm" (or .raw) from a
+    // background thread. Frames are dropped, not waited for, if the disk falls behind.
+    void start_capture( const std::string& path_prefix,
+                        FrameCapture::Format format = FrameCapture::Format::ppm )
+    {
+        _capture = std::make_unique<FrameCapture>(path_prefix, _width, _height, format);
+    }
+
+    // Waits for the frames already captured to be written
+    void stop_capture()
+    {
+        _capture.reset();
+    }
+
+    const FrameCapture* get_capture() const
+    {
+        return _capture.get();
+    }
+
+    size_t get_width() const
+    {
+        return _width;
+    }
+
+    size_t get_height() const
+    {
+        return _height;
+    }
+
+    // The frame being drawn, row by row from the top. Pixels keep their values across
+    // present() until they are cleared or drawn over.
+    const Pixel* get_pixels() const
+    {
+        return _pixels.data();
     }
 
 protected:
     const size_t _width;
     const size_t _height;
 
+    // Row "y" of the frame, in buffer coordinates
+    Pixel* get_pixel_row( int y )
+    {
+        return _pixels.data() + static_cast<size_t>(y) * _width;
+    }
+
 private:
+    static constexpr Pixel background { 0, 0, 0 };
+
     SDL_Window* _window = nullptr;
     SDL_Renderer* _renderer = nullptr;
+    SDL_Texture* _texture = nullptr;
+    std::vector<Pixel> _pixels;
+    BlendMode _blend_mode = BlendMode::replace;
+    std::unique_ptr<FrameCapture> _capture;
+
+    void capture_frame()
+    {
+        if (_capture == nullptr)
+        {
+            return;
+        }
+
+        auto pixels = _capture->acquire();
+        if (pixels == nullptr)
+        {
+            return;
+        }
+
+        std::copy(_pixels.begin(), _pixels.end(), pixels);
+        _capture->submit();
+    }
 };
\ No newline at end of file
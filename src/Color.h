@@ -2,6 +2,8 @@
 
 #include <cstdint>
 
+#include "Pixel.h"
+
 // Found the list of 48 named colors at:
 //   https://simple.wikipedia.org/wiki/Template:Web_colors
 
@@ -57,15 +59,21 @@ public:
     static Color dim_gray ;
     static Color black ;
 
-    const uint8_t r ;
-    const uint8_t g ;
-    const uint8_t b ;
+    uint8_t r ;
+    uint8_t g ;
+    uint8_t b ;
 
     static Color custom( uint8_t r, uint8_t g, uint8_t b )
     {
         return { r, g, b } ;
     }
 
+    // The framebuffer representation of this color
+    constexpr Pixel to_pixel( uint8_t alpha = 255 ) const
+    {
+        return { r, g, b, alpha } ;
+    }
+
 private:
     Color( uint8_t r, uint8_t g, uint8_t b )
         : r( r ), g( g ), b( b )
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "Mat.h"
+#include "Vec.h"
+#include "Color.h"
+#include "Triangle.h"
+
+// Verticies and triangles stored in about half the memory of Model's plain vectors:
+//
+//   - positions as 16 bit fractions of the bounding box, 6 bytes instead of 12
+//   - verticies indexed with 16 bits when there are few enough of them
+//   - triangle colors as an 8 bit index into a palette, when there are at most 256
+//
+// Positions are decoded by the transform itself: the decode matrix maps the stored
+// integers back into model space, so it can be folded into the model's transform.
+// Triangles are decoded one at a time by for_each_triangle(), so clipping reads the
+// compact indices and colors rather than a full width copy of them.
+class CompactMesh
+{
+public:
+    CompactMesh()
+        : _decode_matrix( Mat::get_identity_matrix() )
+    {}
+
+    CompactMesh( const std::vector<vec3f>& verticies, const std::vector<Triangle>& triangles )
+        : _decode_matrix( Mat::get_identity_matrix() ),
+          _triangle_count( triangles.size() )
+    {
+        encode_positions( verticies ) ;
+        encode_triangles( verticies.size(), triangles ) ;
+    }
+
+    size_t get_vertex_count() const
+    {
+        return _positions.size() ;
+    }
+
+    size_t get_triangle_count() const
+    {
+        return _triangle_count ;
+    }
+
+    // From the stored positions to model space
+    const Mat& get_decode_matrix() const
+    {
+        return _decode_matrix ;
+    }
+
+    // Transforms every vertex into "output", which must hold get_vertex_count() points
+    void transform_verticies( const Mat& transform, vec3f* output ) const
+    {
+        ( transform * _decode_matrix ).transform_points( _positions.data(), output, _positions.size() ) ;
+    }
+
+    // Calls visit( triangle ) for each triangle in turn, decoding it on the fly
+    template<typename Visit>
+    void for_each_triangle( Visit visit ) const
+    {
+        if( _short_indexes.empty() )
+            for_each_triangle( _long_indexes.data(), visit ) ;
+        else
+            for_each_triangle( _short_indexes.data(), visit ) ;
+    }
+
+    // Decodes every triangle into "output"
+    void get_triangles( std::vector<Triangle>& output ) const
+    {
+        if( _short_indexes.empty() )
+            decode_triangles( _long_indexes.data(), output ) ;
+        else
+            decode_triangles( _short_indexes.data(), output ) ;
+    }
+
+    size_t get_bytes() const
+    {
+        return _positions.capacity() * sizeof( vec3u16 )
+            + _short_indexes.capacity() * sizeof( uint16_t )
+            + _long_indexes.capacity() * sizeof( uint32_t )
+            + _palette.capacity() * sizeof( Color )
+            + _color_indexes.capacity() * sizeof( uint8_t )
+            + _colors.capacity() * sizeof( Color ) ;
+    }
+
+private:
+    static constexpr size_t   max_palette_size = 256 ;
+    static constexpr float    max_position = 65535 ;
+
+    Mat                     _decode_matrix ;
+    size_t                  _triangle_count = 0 ;
+    std::vector<vec3u16>    _positions ;
+    std::vector<uint16_t>   _short_indexes ;    // Three per triangle, with at most 65536 verticies
+    std::vector<uint32_t>   _long_indexes ;     // Otherwise
+    std::vector<Color>      _palette ;
+    std::vector<uint8_t>    _color_indexes ;    // One per triangle, into _palette
+    std::vector<Color>      _colors ;           // One per triangle, when the palette would be too big
+
+    // Reads the members into locals first: the 8 bit color writes could alias them,
+    // which would reload every one of them for each triangle
+    template<typename Index>
+    void decode_triangles( const Index* indexes, std::vector<Triangle>& output ) const
+    {
+        auto count = _triangle_count ;
+        output.resize( count, Triangle { {}, Color::custom( 0, 0, 0 ) } ) ;
+
+        auto triangles = output.data() ;
+        auto colors = _colors.empty() ? nullptr : _colors.data() ;
+        auto palette = _palette.data() ;
+        auto color_indexes = _color_indexes.data() ;
+        for( size_t i = 0 ; i < count ; ++i, indexes += 3 )
+        {
+            triangles[ i ].vertex_indexes = { static_cast<int>( indexes[ 0 ] ), static_cast<int>( indexes[ 1 ] ), static_cast<int>( indexes[ 2 ] ) } ;
+            triangles[ i ].color = colors != nullptr ? colors[ i ] : palette[ color_indexes[ i ] ] ;
+        }
+    }
+
+    template<typename Index, typename Visit>
+    void for_each_triangle( const Index* indexes, Visit& visit ) const
+    {
+        auto count = _triangle_count ;
+        auto colors = _colors.empty() ? nullptr : _colors.data() ;
+        auto palette = _palette.data() ;
+        auto color_indexes = _color_indexes.data() ;
+        for( size_t i = 0 ; i < count ; ++i, indexes += 3 )
+        {
+            visit( Triangle { { static_cast<int>( indexes[ 0 ] ), static_cast<int>( indexes[ 1 ] ), static_cast<int>( indexes[ 2 ] ) },
+                              colors != nullptr ? colors[ i ] : palette[ color_indexes[ i ] ] } ) ;
+        }
+    }
+
+    void encode_positions( const std::vector<vec3f>& verticies )
+    {
+        if( verticies.empty() )
+            return ;
+
+        auto mins = verticies[ 0 ] ;
+        auto maxs = verticies[ 0 ] ;
+        for( auto& vertex : verticies )
+        {
+            mins = { std::min( mins.x, vertex.x ), std::min( mins.y, vertex.y ), std::min( mins.z, vertex.z ) } ;
+            maxs = { std::max( maxs.x, vertex.x ), std::max( maxs.y, vertex.y ), std::max( maxs.z, vertex.z ) } ;
+        }
+
+        vec3f steps { ( maxs.x - mins.x ) / max_position,
+                      ( maxs.y - mins.y ) / max_position,
+                      ( maxs.z - mins.z ) / max_position } ;
+
+        auto quantize = []( float value, float min, float step ) {
+            return static_cast<uint16_t>( step > 0 ? std::lround( std::min( ( value - min ) / step, max_position ) ) : 0 ) ; } ;
+
+        _positions.reserve( verticies.size() ) ;
+        for( auto& vertex : verticies )
+        {
+            _positions.push_back( { quantize( vertex.x, mins.x, steps.x ),
+                                    quantize( vertex.y, mins.y, steps.y ),
+                                    quantize( vertex.z, mins.z, steps.z ) } ) ;
+        }
+
+        _decode_matrix = Mat::get_translation_matrix( mins ) * Mat::get_scale_matrix( steps ) ;
+    }
+
+    void encode_triangles( size_t vertex_count, const std::vector<Triangle>& triangles )
+    {
+        auto short_indexes = vertex_count <= 65536 ;
+        if( short_indexes )
+            _short_indexes.reserve( 3 * triangles.size() ) ;
+        else
+            _long_indexes.reserve( 3 * triangles.size() ) ;
+
+        for( auto& triangle : triangles )
+        {
+            for( auto index : { triangle.vertex_indexes.x, triangle.vertex_indexes.y, triangle.vertex_indexes.z } )
+            {
+                if( short_indexes )
+                    _short_indexes.push_back( static_cast<uint16_t>( index ) ) ;
+                else
+                    _long_indexes.push_back( static_cast<uint32_t>( index ) ) ;
+            }
+        }
+
+        std::unordered_map<uint32_t, uint8_t> palette_indexes ;
+        _color_indexes.reserve( triangles.size() ) ;
+        for( auto& triangle : triangles )
+        {
+            auto key = static_cast<uint32_t>( triangle.color.to_pixel().argb ) ;
+            auto found = palette_indexes.find( key ) ;
+            if( found == palette_indexes.end() )
+            {
+                if( _palette.size() == max_palette_size )
+                {
+                    // Too many colors to be worth a palette
+                    _palette.clear() ;
+                    _color_indexes = {} ;
+                    _colors.reserve( triangles.size() ) ;
+                    for( auto& each : triangles )
+                        _colors.push_back( each.color ) ;
+                    return ;
+                }
+
+                found = palette_indexes.emplace( key, static_cast<uint8_t>( _palette.size() ) ).first ;
+                _palette.push_back( triangle.color ) ;
+            }
+
+            _color_indexes.push_back( found->second ) ;
+        }
+    }
+} ;
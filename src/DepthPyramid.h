@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "Rect.h"
+
+// Hierarchical depth buffer used for conservative occlusion tests.
+//
+// The canvas stores inverse z, so bigger values are closer to the camera and
+// zero means "nothing drawn". Each texel of the pyramid keeps the *smallest*
+// inverse z (the farthest occluder) found in the pixels it covers. Something
+// whose nearest point is farther away than that value cannot be visible
+// anywhere inside the texel.
+class DepthPyramid
+{
+    struct Level
+    {
+        int                width ;
+        int                height ;
+        std::vector<float> farthest ;
+    } ;
+
+    // Pick the level where a rectangle spans at most this many texels per side
+    static constexpr int max_texels_per_side = 4 ;
+
+public:
+    void build( const std::vector<float>& depth_buffer, size_t width, size_t height )
+    {
+        _levels.clear() ;
+
+        if( width == 0 || height == 0 )
+            return ;
+
+        // Level 0 is half the resolution of the depth buffer
+        _levels.push_back( reduce( depth_buffer,
+            static_cast<int>( width ), static_cast<int>( height ) ) ) ;
+
+        while( _levels.back().width > 1 || _levels.back().height > 1 )
+        {
+            const auto& finer = _levels.back() ;
+            _levels.push_back( reduce( finer.farthest, finer.width, finer.height ) ) ;
+        }
+    }
+
+    void invalidate()
+    {
+        _levels.clear() ;
+    }
+
+    bool is_valid() const
+    {
+        return ! _levels.empty() ;
+    }
+
+    // Returns true only if every pixel of "bounds" already holds something closer
+    // than "nearest_inverse_z". "bounds" must be in depth buffer coordinates.
+    bool is_occluded( const Rect& bounds, float nearest_inverse_z ) const
+    {
+        if( ! is_valid() || bounds.is_empty() )
+            return false ;
+
+        // Pick the finest level on which the rectangle covers only a few texels
+        size_t level_idx = 0 ;
+        auto span = std::max( bounds.x1 - bounds.x0, bounds.y1 - bounds.y0 ) ;
+        while( level_idx + 1 < _levels.size() && ( span >> ( level_idx + 1 ) ) > max_texels_per_side )
+            ++level_idx ;
+
+        const auto& level = _levels[ level_idx ] ;
+        auto shift = static_cast<int>( level_idx ) + 1 ;
+
+        auto tx0 = std::max( bounds.x0 >> shift, 0 ) ;
+        auto ty0 = std::max( bounds.y0 >> shift, 0 ) ;
+        auto tx1 = std::min( ( bounds.x1 - 1 ) >> shift, level.width  - 1 ) ;
+        auto ty1 = std::min( ( bounds.y1 - 1 ) >> shift, level.height - 1 ) ;
+
+        for( auto ty = ty0 ; ty <= ty1 ; ++ty )
+        for( auto tx = tx0 ; tx <= tx1 ; ++tx )
+        {
+            if( level.farthest[ ty * level.width + tx ] <= nearest_inverse_z )
+                return false ;
+        }
+
+        return true ;
+    }
+
+private:
+    std::vector<Level> _levels ;
+
+    // Builds the next coarser level by taking the farthest value of each 2x2 block.
+    // Blocks hanging over an odd edge only look at the texels that exist.
+    static Level reduce( const std::vector<float>& source, int width, int height )
+    {
+        Level output { ( width + 1 ) / 2, ( height + 1 ) / 2, {} } ;
+        output.farthest.resize( static_cast<size_t>( output.width * output.height ) ) ;
+
+        for( int y = 0 ; y < output.height ; ++y )
+        {
+            auto y0 = y * 2 ;
+            auto y1 = std::min( y0 + 1, height - 1 ) ;
+
+            for( int x = 0 ; x < output.width ; ++x )
+            {
+                auto x0 = x * 2 ;
+                auto x1 = std::min( x0 + 1, width - 1 ) ;
+
+                output.farthest[ y * output.width + x ] = std::min(
+                    std::min( source[ y0 * width + x0 ], source[ y0 * width + x1 ] ),
+                    std::min( source[ y1 * width + x0 ], source[ y1 * width + x1 ] ) ) ;
+            }
+        }
+
+        return output ;
+    }
+} ;
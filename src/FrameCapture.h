@@ -0,0 +1,197 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Pixel.h"
+#include "PixelSpans.h"
+
+// Writes presented frames to disk on a background thread.
+//
+// The render thread copies each frame into one of a fixed ring of preallocated
+// buffers and moves on; the writer thread encodes and saves them in order. When
+// the writer falls behind and every buffer is still queued, the frame is dropped
+// rather than making the render thread wait.
+class FrameCapture
+{
+public:
+    enum class Format
+    {
+        ppm,    // Binary PPM (P6), 8 bits per channel RGB
+        raw,    // The packed pixels exactly as captured
+    } ;
+
+    // Files are named "<path_prefix>000000.ppm", "<path_prefix>000001.ppm", ...
+    FrameCapture( std::string path_prefix, size_t width, size_t height,
+                  Format format = Format::ppm, size_t buffer_count = 4 )
+        : _path_prefix( std::move( path_prefix ) ),
+          _width( width ),
+          _height( height ),
+          _format( format ),
+          _slots( buffer_count )
+    {
+        if( buffer_count == 0 )
+            throw std::invalid_argument( "FrameCapture needs at least one buffer" ) ;
+
+        for( auto& slot : _slots )
+            slot.pixels.resize( width * height ) ;
+
+        _writer = std::thread( [ this ] { write_frames() ; } ) ;
+    }
+
+    FrameCapture( const FrameCapture& ) = delete ;
+    FrameCapture& operator=( const FrameCapture& ) = delete ;
+
+    // Finishes writing every frame that was already submitted
+    ~FrameCapture()
+    {
+        {
+            std::lock_guard<std::mutex> lock( _mutex ) ;
+            _stopping = true ;
+        }
+        _frame_ready.notify_one() ;
+        _writer.join() ;
+    }
+
+    // Render thread: returns a buffer of width * height pixels to fill for the next
+    // frame, or nullptr when the writer is behind and this frame must be skipped.
+    Pixel* acquire()
+    {
+        auto& slot = _slots[ _head ] ;
+        if( slot.state.load( std::memory_order_acquire ) != free_slot )
+        {
+            ++_dropped_frames ;
+            return nullptr ;
+        }
+
+        return slot.pixels.data() ;
+    }
+
+    // Render thread: queues the buffer returned by the last successful acquire()
+    void submit()
+    {
+        auto& slot = _slots[ _head ] ;
+        slot.frame_number = _next_frame_number++ ;
+        slot.state.store( queued_slot, std::memory_order_release ) ;
+        _head = ( _head + 1 ) % _slots.size() ;
+
+        // Taking the lock orders this with the writer's check, so the wakeup is not lost
+        {
+            std::lock_guard<std::mutex> lock( _mutex ) ;
+        }
+        _frame_ready.notify_one() ;
+    }
+
+    size_t get_width() const
+    {
+        return _width ;
+    }
+
+    size_t get_height() const
+    {
+        return _height ;
+    }
+
+    uint64_t get_dropped_frames() const
+    {
+        return _dropped_frames.load() ;
+    }
+
+    uint64_t get_written_frames() const
+    {
+        return _written_frames.load() ;
+    }
+
+    // Frames that could not be written, e.g. because the directory does not exist
+    uint64_t get_failed_frames() const
+    {
+        return _failed_frames.load() ;
+    }
+
+private:
+    static constexpr int free_slot   = 0 ;
+    static constexpr int queued_slot = 1 ;
+
+    struct Slot
+    {
+        std::vector<Pixel>    pixels ;
+        uint64_t              frame_number = 0 ;
+        std::atomic<int>      state { free_slot } ;
+    } ;
+
+    const std::string       _path_prefix ;
+    const size_t            _width ;
+    const size_t            _height ;
+    const Format            _format ;
+    std::vector<Slot>       _slots ;
+    size_t                  _head = 0 ;     // Next slot the render thread fills
+    size_t                  _tail = 0 ;     // Next slot the writer saves
+    uint64_t                _next_frame_number = 0 ;
+    std::atomic<uint64_t>   _dropped_frames { 0 } ;
+    std::atomic<uint64_t>   _written_frames { 0 } ;
+    std::atomic<uint64_t>   _failed_frames { 0 } ;
+    std::mutex              _mutex ;
+    std::condition_variable _frame_ready ;
+    bool                    _stopping = false ;
+    std::thread             _writer ;
+
+    void write_frames()
+    {
+        std::vector<uint8_t> encoded ;
+
+        for( ;; )
+        {
+            auto& slot = _slots[ _tail ] ;
+
+            {
+                std::unique_lock<std::mutex> lock( _mutex ) ;
+                _frame_ready.wait( lock, [ & ] {
+                    return _stopping || slot.state.load( std::memory_order_acquire ) == queued_slot ; } ) ;
+
+                if( slot.state.load( std::memory_order_acquire ) != queued_slot )
+                    return ;
+            }
+
+            if( write_frame( slot, encoded ) )
+                ++_written_frames ;
+            else
+                ++_failed_frames ;
+
+            slot.state.store( free_slot, std::memory_order_release ) ;
+            _tail = ( _tail + 1 ) % _slots.size() ;
+        }
+    }
+
+    bool write_frame( const Slot& slot, std::vector<uint8_t>& encoded ) const
+    {
+        char number[ 32 ] ;
+        std::snprintf( number, sizeof( number ), "%06llu",
+            static_cast<unsigned long long>( slot.frame_number ) ) ;
+
+        auto path = _path_prefix + number + ( _format == Format::ppm ? ".ppm" : ".raw" ) ;
+
+        std::unique_ptr<FILE, int ( * )( FILE* )> file( std::fopen( path.c_str(), "wb" ), &std::fclose ) ;
+        if( file == nullptr )
+            return false ;
+
+        if( _format == Format::raw )
+        {
+            return std::fwrite( slot.pixels.data(), sizeof( Pixel ), slot.pixels.size(), file.get() )
+                == slot.pixels.size() ;
+        }
+
+        encoded.resize( slot.pixels.size() * 3 ) ;
+        convert_span_to_rgb24( slot.pixels.data(), encoded.data(), slot.pixels.size() ) ;
+
+        return std::fprintf( file.get(), "P6\n%zu %zu\n255\n", _width, _height ) > 0
+            && std::fwrite( encoded.data(), 1, encoded.size(), file.get() ) == encoded.size() ;
+    }
+} ;
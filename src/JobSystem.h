@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A pool of threads that run batches of independent jobs, stealing from each other.
+//
+// run() splits a batch into chunks and deals them out to one queue per thread,
+// including the calling thread, which works on the batch too. Each thread takes
+// chunks from the back of its own queue and, once that is empty, steals from the
+// front of the others, so uneven jobs (big models next to small ones) still keep
+// every thread busy. The threads stay alive between batches.
+class JobSystem
+{
+public:
+    // "thread_count" includes the thread calling run(); 0 picks one per core
+    explicit JobSystem( size_t thread_count = 0 )
+    {
+        if( thread_count == 0 )
+            thread_count = std::max( 1u, std::thread::hardware_concurrency() ) ;
+
+        for( size_t i = 0 ; i < thread_count ; ++i )
+            _queues.push_back( std::make_unique<Queue>() ) ;
+
+        for( size_t i = 1 ; i < thread_count ; ++i )
+            _workers.emplace_back( [ this, i ] { work( i ) ; } ) ;
+    }
+
+    JobSystem( const JobSystem& ) = delete ;
+    JobSystem& operator=( const JobSystem& ) = delete ;
+
+    ~JobSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock( _mutex ) ;
+            _stopping = true ;
+        }
+        _batch_started.notify_all() ;
+
+        for( auto& worker : _workers )
+            worker.join() ;
+    }
+
+    size_t get_thread_count() const
+    {
+        return _queues.size() ;
+    }
+
+    // Runs job( index, thread ) for every index in [ 0, count ) and returns once all
+    // of them are done. "thread" is below get_thread_count(), and no two jobs run on
+    // the same one at once, so it can pick per thread scratch space. Not reentrant.
+    void run( size_t count, const std::function<void( size_t index, size_t thread )>& job )
+    {
+        if( count == 0 )
+            return ;
+
+        if( _workers.empty() || count == 1 )
+        {
+            for( size_t i = 0 ; i < count ; ++i )
+                job( i, 0 ) ;
+            return ;
+        }
+
+        // Several chunks per thread, so there is something left to steal
+        auto chunk = std::max<size_t>( 1, count / ( chunks_per_thread * _queues.size() ) ) ;
+        auto chunk_count = ( count + chunk - 1 ) / chunk ;
+
+        // Before dealing out the chunks: a worker still looking for work may take one at once
+        {
+            std::lock_guard<std::mutex> lock( _mutex ) ;
+            _job = &job ;
+            _pending_chunks = chunk_count ;
+            ++_batch ;
+        }
+
+        for( size_t i = 0 ; i < chunk_count ; ++i )
+        {
+            auto& queue = *_queues[ i % _queues.size() ] ;
+            std::lock_guard<std::mutex> lock( queue.mutex ) ;
+            queue.chunks.push_back( { i * chunk, std::min( ( i + 1 ) * chunk, count ) } ) ;
+        }
+        _batch_started.notify_all() ;
+
+        run_chunks( 0 ) ;
+
+        std::unique_lock<std::mutex> lock( _mutex ) ;
+        _batch_done.wait( lock, [ this ] { return _pending_chunks == 0 ; } ) ;
+        _job = nullptr ;
+    }
+
+private:
+    static constexpr size_t chunks_per_thread = 4 ;
+
+    struct Chunk
+    {
+        size_t begin ;
+        size_t end ;
+    } ;
+
+    struct Queue
+    {
+        std::mutex          mutex ;
+        std::deque<Chunk>   chunks ;
+    } ;
+
+    std::vector<std::unique_ptr<Queue>> _queues ;   // One per thread, the caller's first
+    std::vector<std::thread>            _workers ;
+
+    std::mutex                          _mutex ;
+    std::condition_variable             _batch_started ;
+    std::condition_variable             _batch_done ;
+    const std::function<void( size_t, size_t )>* _job = nullptr ;
+    size_t                              _pending_chunks = 0 ;
+    uint64_t                            _batch = 0 ;
+    bool                                _stopping = false ;
+
+    // Worker threads
+    void work( size_t thread )
+    {
+        uint64_t seen_batch = 0 ;
+        for( ;; )
+        {
+            {
+                std::unique_lock<std::mutex> lock( _mutex ) ;
+                _batch_started.wait( lock, [ & ] { return _stopping || _batch != seen_batch ; } ) ;
+
+                if( _stopping )
+                    return ;
+
+                seen_batch = _batch ;
+            }
+
+            run_chunks( thread ) ;
+        }
+    }
+
+    // Runs chunks until every queue is empty
+    void run_chunks( size_t thread )
+    {
+        Chunk chunk ;
+        while( take_chunk( thread, chunk ) )
+        {
+            // The batch can not finish, and _job change, while this chunk is pending
+            auto& job = *_job ;
+            for( auto i = chunk.begin ; i < chunk.end ; ++i )
+                job( i, thread ) ;
+
+            std::lock_guard<std::mutex> lock( _mutex ) ;
+            if( --_pending_chunks == 0 )
+                _batch_done.notify_all() ;
+        }
+    }
+
+    // Newest from the thread's own queue, else oldest from another's
+    bool take_chunk( size_t thread, Chunk& chunk )
+    {
+        {
+            auto& own = *_queues[ thread ] ;
+            std::lock_guard<std::mutex> lock( own.mutex ) ;
+            if( ! own.chunks.empty() )
+            {
+                chunk = own.chunks.back() ;
+                own.chunks.pop_back() ;
+                return true ;
+            }
+        }
+
+        for( size_t i = 1 ; i < _queues.size() ; ++i )
+        {
+            auto& other = *_queues[ ( thread + i ) % _queues.size() ] ;
+            std::lock_guard<std::mutex> lock( other.mutex ) ;
+            if( ! other.chunks.empty() )
+            {
+                chunk = other.chunks.front() ;
+                other.chunks.pop_front() ;
+                return true ;
+            }
+        }
+
+        return false ;
+    }
+} ;
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include <SDL2/SDL.h>
+
+#include "Vec.h"
+#include "Rect.h"
+#include "Color.h"
+
+// Collects 2D lines (in buffer coordinates), clips them to a rectangle as they are
+// added, and turns them into pixels with integer Bresenham when flushed. The
+// vectors are kept between flushes, so a steady state frame does not allocate.
+class LineBatch
+{
+    struct Line
+    {
+        vec2i from ;
+        vec2i to ;
+        Color color ;
+    } ;
+
+public:
+    // Adds the part of the line inside "clip"; nothing if it misses entirely
+    void add( vec2i from, vec2i to, const Color& color, const Rect& clip )
+    {
+        if( ! clip_line( from, to, clip ) )
+            return ;
+
+        _lines.push_back( { from, to, color } ) ;
+        _bounds = _bounds.unite( { std::min( from.x, to.x ), std::min( from.y, to.y ),
+                                   std::max( from.x, to.x ) + 1, std::max( from.y, to.y ) + 1 } ) ;
+    }
+
+    bool is_empty() const
+    {
+        return _lines.empty() ;
+    }
+
+    // Everything touched by the lines added since the last flush
+    const Rect& get_bounds() const
+    {
+        return _bounds ;
+    }
+
+    // Calls sink( points, count, color ) once per run of lines with the same color,
+    // then empties the batch
+    template<typename Sink>
+    void flush( Sink sink )
+    {
+        for( size_t i = 0 ; i < _lines.size() ; )
+        {
+            const auto& color = _lines[ i ].color ;
+            _points.clear() ;
+
+            for( ; i < _lines.size() && is_same_color( _lines[ i ].color, color ) ; ++i )
+                rasterize( _lines[ i ].from, _lines[ i ].to ) ;
+
+            sink( _points.data(), _points.size(), color ) ;
+        }
+
+        _lines.clear() ;
+        _bounds = { 0, 0, 0, 0 } ;
+    }
+
+private:
+    std::vector<Line>      _lines ;
+    std::vector<SDL_Point> _points ;
+    Rect                   _bounds { 0, 0, 0, 0 } ;
+
+    static bool is_same_color( const Color& a, const Color& b )
+    {
+        return a.r == b.r && a.g == b.g && a.b == b.b ;
+    }
+
+    void rasterize( vec2i from, vec2i to )
+    {
+        auto dx  =  std::abs( to.x - from.x ) ;
+        auto dy  = -std::abs( to.y - from.y ) ;
+        auto sx  = from.x < to.x ? 1 : -1 ;
+        auto sy  = from.y < to.y ? 1 : -1 ;
+        auto err = dx + dy ;
+
+        for( ;; )
+        {
+            _points.push_back( { from.x, from.y } ) ;
+
+            if( from.x == to.x && from.y == to.y )
+                break ;
+
+            auto err2 = 2 * err ;
+            if( err2 >= dy )
+            {
+                err += dy ;
+                from.x += sx ;
+            }
+            if( err2 <= dx )
+            {
+                err += dx ;
+                from.y += sy ;
+            }
+        }
+    }
+
+    // Cohen-Sutherland against the pixels of "clip", i.e. [ x0, x1 - 1 ] x [ y0, y1 - 1 ]
+    static constexpr int inside = 0, left = 1, right = 2, above = 4, below = 8 ;
+
+    static int get_outcode( const vec2i& pt, const Rect& clip )
+    {
+        return ( pt.x < clip.x0 ? left : pt.x >= clip.x1 ? right : inside )
+             | ( pt.y < clip.y0 ? above : pt.y >= clip.y1 ? below : inside ) ;
+    }
+
+    static bool clip_line( vec2i& from, vec2i& to, const Rect& clip )
+    {
+        if( clip.is_empty() )
+            return false ;
+
+        auto code_from = get_outcode( from, clip ) ;
+        auto code_to   = get_outcode( to, clip ) ;
+
+        for( ;; )
+        {
+            if( ( code_from | code_to ) == inside )
+                return true ;
+
+            if( ( code_from & code_to ) != inside )
+                return false ;
+
+            auto  code = code_from != inside ? code_from : code_to ;
+            auto& pt   = code_from != inside ? from : to ;
+
+            // Slide the outside end point along the line onto the violated edge
+            auto x0 = static_cast<double>( from.x ), y0 = static_cast<double>( from.y ) ;
+            auto x1 = static_cast<double>( to.x ),   y1 = static_cast<double>( to.y ) ;
+
+            if( code & above )
+                pt = { static_cast<int>( std::lround( x0 + ( x1 - x0 ) * ( clip.y0 - y0 ) / ( y1 - y0 ) ) ), clip.y0 } ;
+            else if( code & below )
+                pt = { static_cast<int>( std::lround( x0 + ( x1 - x0 ) * ( clip.y1 - 1 - y0 ) / ( y1 - y0 ) ) ), clip.y1 - 1 } ;
+            else if( code & left )
+                pt = { clip.x0, static_cast<int>( std::lround( y0 + ( y1 - y0 ) * ( clip.x0 - x0 ) / ( x1 - x0 ) ) ) } ;
+            else
+                pt = { clip.x1 - 1, static_cast<int>( std::lround( y0 + ( y1 - y0 ) * ( clip.x1 - 1 - x0 ) / ( x1 - x0 ) ) ) } ;
+
+            if( &pt == &from )
+                code_from = get_outcode( from, clip ) ;
+            else
+                code_to = get_outcode( to, clip ) ;
+        }
+    }
+} ;
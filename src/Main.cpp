@@ -1,30 +1,218 @@
 #include "Canvas.h"
 #include "Misc.h"
 #include "A3DBModel.h"
+#include "StreamingScene.h"
+#include "ModelRegistry.h"
+#include "RenderServer.h"
+#include <atomic>
+#include <csignal>
+#include <cstring>
 #include <iostream>
 
-int main(){
+// Streams the scene file "path" in while rendering it
+int run_scene(Canvas& Canvas, const char* path)
+{
+    StreamingScene scene(64 * 1024 * 1024);
+
+    if (!scene.open(path))
+    {
+        std::cout << "failed to open scene!" << std::endl;
+        return -1;
+    }
+
+    vec3f camera_pos {0, 1, -5};
+    Canvas.set_camera_pos(camera_pos);
+    Canvas.set_draw_sorting(true);
+
+    while (should_keep_rendering())
+    {
+        scene.update(camera_pos);
+
+        Canvas.clear();
+        scene.draw(Canvas);
+        Canvas.present();
+    }
+
+    if (scene.has_parse_error())
+    {
+        std::cout << "scene has errors!" << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+#if defined( __linux__ )
+static std::atomic<RenderServer*> running_server{nullptr};
+static_assert(std::atomic<RenderServer*>::is_always_lock_free, "the signal handler must be async signal safe");
+
+// Stops the server on SIGINT and SIGTERM for as long as it exists. The default
+// handlers are back before the server is forgotten, so a late signal never finds it gone.
+class StopServerOnSignal
+{
+public:
+    explicit StopServerOnSignal(RenderServer& server){
+        running_server = &server;
+        std::signal(SIGINT, stop_server);
+        std::signal(SIGTERM, stop_server);
+    }
+
+    ~StopServerOnSignal(){
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        running_server = nullptr;
+    }
+
+    StopServerOnSignal(const StopServerOnSignal&) = delete;
+    StopServerOnSignal& operator=(const StopServerOnSignal&) = delete;
+
+private:
+    static void stop_server(int){
+        if (auto server = running_server.load())
+        {
+            server->stop();
+        }
+    }
+};
+
+// Renders for clients on the socket "path" until interrupted, see RenderServer
+int run_server(const char* path)
+{
+    try
+    {
+        RenderServer server(path, 650, 650);
+        StopServerOnSignal stop_on_signal(server);
+        server.run();
+    }
+    catch (const std::exception& error)
+    {
+        std::cout << error.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+// Renders the cube demo without a window, and fails if a frame allocates after the
+// first few, which size the buffers. Geometry caching is off so that every frame runs
+// the whole pipeline, and it runs both with and without draw sorting. Needs a build
+// with "make ALLOCATION_STATS=1".
+int check_allocations()
+{
+    if (!AllocationStats::is_enabled())
+    {
+        std::cout << "built without RASTERIZER_ALLOCATION_STATS!" << std::endl;
+        return -1;
+    }
+
+    ModelRegistry models;
+    auto cube = models.load("Cube.a3db");
+
+    if (!cube)
+    {
+        std::cout << "failed to load model!" << std::endl;
+        return -1;
+    }
+
+    ModelInstance cube1{cube, {-1.5, 0, 7}, 0.75};
+    ModelInstance cube2{cube, {1.25, 2.5, 7.5}, 1, 195, {0, 1, 0}};
+    ModelInstance cube3{cube, {-1.5, 1, 0}};
+
+    Canvas Canvas(650, 650);
+    Canvas.set_camera_pos({-3, 1, 2});
+    Canvas.set_camera_orient(Mat::get_rotation_matrix(30, {0, 1, 0}));
+    Canvas.set_geometry_caching(false);
+
+    const int warm_up_frames = 3;
+    const int frame_count = 100;
+
+    // Queued and sorted draws first, then draws made at once
+    for (bool sorted : {true, false})
+    {
+        Canvas.set_draw_sorting(sorted);
+        const char* mode = sorted ? "sorted" : "unsorted";
+        double total_milliseconds = 0;
+
+        try
+        {
+            for (int frame = 0; frame < frame_count; ++frame)
+            {
+                Canvas.set_allocation_check(frame >= warm_up_frames);
+
+                Canvas.clear();
+                Canvas.draw_simple_model(cube1);
+                Canvas.draw_simple_model(cube2);
+                Canvas.draw_simple_model(cube3);
+                Canvas.present();
+
+                const auto& stats = Canvas.get_frame_stats();
+                if (frame < warm_up_frames)
+                {
+                    std::cout << mode << " warm up frame " << frame << ": " << stats.allocations.get_allocation_count()
+                              << " allocations, " << stats.peak_scratch_bytes << " bytes of scratch at most" << std::endl;
+                    continue;
+                }
+
+                total_milliseconds += stats.milliseconds;
+            }
+        }
+        catch (const std::exception& error)
+        {
+            std::cout << mode << ": " << error.what() << std::endl;
+            return -1;
+        }
+
+        std::cout << mode << ": " << (frame_count - warm_up_frames) << " frames without allocating, "
+                  << total_milliseconds / (frame_count - warm_up_frames) << " ms per frame" << std::endl;
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[]){
+#if defined( __linux__ )
+    if (argc > 2 && std::strcmp(argv[1], "--server") == 0)
+    {
+        return run_server(argv[2]);
+    }
+#endif
+
+    if (argc > 1 && std::strcmp(argv[1], "--check-allocations") == 0)
+    {
+        return check_allocations();
+    }
+
     Canvas Canvas("", 650, 650);
 
-    auto cube = A3DBModel::load("Cube.a3db");
+    if (argc > 1)
+    {
+        return run_scene(Canvas, argv[1]);
+    }
+
+    // Edits to Cube.a3db show up while running
+    ModelRegistry models;
+    auto cube = models.load("Cube.a3db");
 
-    if (cube == nullptr)
+    if (!cube)
     {
         std::cout << "failed to load model!" << std::endl;
         return -1;
     }
 
-    ModelInstance cube2{*cube, {1.25, 2.5, 7.5}, 1, 195, {0, 1, 0}};
+    ModelInstance cube2{cube, {1.25, 2.5, 7.5}, 1, 195, {0, 1, 0}};
 
-    ModelInstance cube1{*cube, {-1.5, 0, 7}, 0.75};
+    ModelInstance cube1{cube, {-1.5, 0, 7}, 0.75};
 
-    ModelInstance cube3{*cube, {-1.5, 1, 0}};
+    ModelInstance cube3{cube, {-1.5, 1, 0}};
 
     Canvas.set_camera_pos({-3, 1, 2});
     Canvas.set_camera_orient(Mat::get_rotation_matrix(30, {0, 1, 0}));
+    Canvas.set_draw_sorting(true);
 
     while (should_keep_rendering())
     {
+        models.update();
         Canvas.clear();
         
         Canvas.draw_simple_model(cube1);
@@ -4,14 +4,17 @@
 #include <cmath>
 
 #include "Misc.h"
+#include "Simd.h"
 #include "Vec.h"
 
+// Row major 4x4 matrix. The builders that do not need trigonometry are constexpr;
+// matrix products and batched transforms use SSE (and AVX when the target has it).
 class Mat
 {
 public:
-    std::array<float, 16> elements = { 0 } ;
+    alignas( 32 ) std::array<float, 16> elements = { 0 } ;
 
-    static Mat get_identity_matrix()
+    static constexpr Mat get_identity_matrix()
     {
         Mat output ;
         output.elements[  0 ] = 1 ;
@@ -21,7 +24,7 @@ public:
         return output ;
     }
 
-    static Mat get_scale_matrix( float scale )
+    static constexpr Mat get_scale_matrix( float scale )
     {
         Mat output ;
         output.elements[  0 ] = scale ;
@@ -31,6 +34,17 @@ public:
         return output ;
     }
 
+    // A different scale along each axis
+    static constexpr Mat get_scale_matrix( const vec3f& scales )
+    {
+        Mat output ;
+        output.elements[  0 ] = scales.x ;
+        output.elements[  5 ] = scales.y ;
+        output.elements[ 10 ] = scales.z ;
+        output.elements[ 15 ] = 1 ;
+        return output ;
+    }
+
     static Mat get_rotation_matrix( float degrees, const vec3f& around )
     {
         // Normalize "around" vector
@@ -54,14 +68,20 @@ public:
         return output ;
     }
 
-    static Mat get_translation_matrix( vec3f translation )
+    static constexpr Mat get_translation_matrix( vec3f translation )
+    {
+        return get_translation_scale_matrix( translation, 1 ) ;
+    }
+
+    // Same as get_translation_matrix( translation ) * get_scale_matrix( scale )
+    static constexpr Mat get_translation_scale_matrix( vec3f translation, float scale )
     {
         Mat output ;
-        output.elements[  0 ] = 1 ;
+        output.elements[  0 ] = scale ;
         output.elements[  3 ] = translation.x ;
-        output.elements[  5 ] = 1 ;
+        output.elements[  5 ] = scale ;
         output.elements[  7 ] = translation.y ;
-        output.elements[ 10 ] = 1 ;
+        output.elements[ 10 ] = scale ;
         output.elements[ 11 ] = translation.z ;
         output.elements[ 15 ] = 1 ;
         return output ;
@@ -70,19 +90,102 @@ public:
     Mat transpose() const
     {
         Mat output ;
+#if defined( RASTERIZER_SSE )
+        auto row0 = _mm_load_ps( &elements[  0 ] ) ;
+        auto row1 = _mm_load_ps( &elements[  4 ] ) ;
+        auto row2 = _mm_load_ps( &elements[  8 ] ) ;
+        auto row3 = _mm_load_ps( &elements[ 12 ] ) ;
+        _MM_TRANSPOSE4_PS( row0, row1, row2, row3 ) ;
+        _mm_store_ps( &output.elements[  0 ], row0 ) ;
+        _mm_store_ps( &output.elements[  4 ], row1 ) ;
+        _mm_store_ps( &output.elements[  8 ], row2 ) ;
+        _mm_store_ps( &output.elements[ 12 ], row3 ) ;
+#else
         for( size_t i = 0 ; i < 4 ; ++i )
         for( size_t j = 0 ; j < 4 ; ++j )
             output.elements[ i * 4 + j ] = elements[ j * 4 + i ] ;
+#endif
+        return output ;
+    }
+
+    // Inverse of a matrix whose last row is 0 0 0 1, such as any combination of
+    // translations, rotations and scales. Singular matrices give infinities.
+    Mat get_affine_inverse() const
+    {
+        const auto& m = elements ;
+
+        // Cofactors of the upper left 3x3 part, over its determinant
+        Mat output ;
+        output.elements[  0 ] = m[ 5 ] * m[ 10 ] - m[ 6 ] * m[ 9 ] ;
+        output.elements[  1 ] = m[ 2 ] * m[  9 ] - m[ 1 ] * m[ 10 ] ;
+        output.elements[  2 ] = m[ 1 ] * m[  6 ] - m[ 2 ] * m[ 5 ] ;
+        output.elements[  4 ] = m[ 6 ] * m[  8 ] - m[ 4 ] * m[ 10 ] ;
+        output.elements[  5 ] = m[ 0 ] * m[ 10 ] - m[ 2 ] * m[ 8 ] ;
+        output.elements[  6 ] = m[ 2 ] * m[  4 ] - m[ 0 ] * m[ 6 ] ;
+        output.elements[  8 ] = m[ 4 ] * m[  9 ] - m[ 5 ] * m[ 8 ] ;
+        output.elements[  9 ] = m[ 1 ] * m[  8 ] - m[ 0 ] * m[ 9 ] ;
+        output.elements[ 10 ] = m[ 0 ] * m[  5 ] - m[ 1 ] * m[ 4 ] ;
+
+        auto inverse_determinant = 1.0f / ( m[ 0 ] * output.elements[ 0 ]
+                                          + m[ 1 ] * output.elements[ 4 ]
+                                          + m[ 2 ] * output.elements[ 8 ] ) ;
+
+        for( size_t row = 0 ; row < 12 ; row += 4 )
+        {
+            output.elements[ row     ] *= inverse_determinant ;
+            output.elements[ row + 1 ] *= inverse_determinant ;
+            output.elements[ row + 2 ] *= inverse_determinant ;
+
+            // Undo the translation after the rest
+            output.elements[ row + 3 ] = -( output.elements[ row     ] * m[  3 ]
+                                          + output.elements[ row + 1 ] * m[  7 ]
+                                          + output.elements[ row + 2 ] * m[ 11 ] ) ;
+        }
+
+        output.elements[ 15 ] = 1 ;
         return output ;
     }
 
     Mat multiply( const Mat& other ) const
     {
         Mat output ;
+#if defined( RASTERIZER_AVX )
+        // Two output rows per iteration: each 128 bit lane works on its own row
+        auto other_row0 = _mm256_broadcast_ps( reinterpret_cast<const __m128*>( &other.elements[  0 ] ) ) ;
+        auto other_row1 = _mm256_broadcast_ps( reinterpret_cast<const __m128*>( &other.elements[  4 ] ) ) ;
+        auto other_row2 = _mm256_broadcast_ps( reinterpret_cast<const __m128*>( &other.elements[  8 ] ) ) ;
+        auto other_row3 = _mm256_broadcast_ps( reinterpret_cast<const __m128*>( &other.elements[ 12 ] ) ) ;
+
+        for( size_t i = 0 ; i < 16 ; i += 8 )
+        {
+            auto rows = _mm256_load_ps( &elements[ i ] ) ;
+            auto sum = _mm256_mul_ps( _mm256_shuffle_ps( rows, rows, _MM_SHUFFLE( 0, 0, 0, 0 ) ), other_row0 ) ;
+            sum = _mm256_add_ps( sum, _mm256_mul_ps( _mm256_shuffle_ps( rows, rows, _MM_SHUFFLE( 1, 1, 1, 1 ) ), other_row1 ) ) ;
+            sum = _mm256_add_ps( sum, _mm256_mul_ps( _mm256_shuffle_ps( rows, rows, _MM_SHUFFLE( 2, 2, 2, 2 ) ), other_row2 ) ) ;
+            sum = _mm256_add_ps( sum, _mm256_mul_ps( _mm256_shuffle_ps( rows, rows, _MM_SHUFFLE( 3, 3, 3, 3 ) ), other_row3 ) ) ;
+            _mm256_store_ps( &output.elements[ i ], sum ) ;
+        }
+#elif defined( RASTERIZER_SSE )
+        // Each output row is a combination of the other matrix's rows
+        auto other_row0 = _mm_load_ps( &other.elements[  0 ] ) ;
+        auto other_row1 = _mm_load_ps( &other.elements[  4 ] ) ;
+        auto other_row2 = _mm_load_ps( &other.elements[  8 ] ) ;
+        auto other_row3 = _mm_load_ps( &other.elements[ 12 ] ) ;
+
+        for( size_t i = 0 ; i < 16 ; i += 4 )
+        {
+            auto sum = _mm_mul_ps( _mm_set1_ps( elements[ i ] ), other_row0 ) ;
+            sum = _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( elements[ i + 1 ] ), other_row1 ) ) ;
+            sum = _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( elements[ i + 2 ] ), other_row2 ) ) ;
+            sum = _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( elements[ i + 3 ] ), other_row3 ) ) ;
+            _mm_store_ps( &output.elements[ i ], sum ) ;
+        }
+#else
         for( size_t i = 0 ; i < 4 ; ++i )
         for( size_t j = 0 ; j < 4 ; ++j )
         for( size_t k = 0 ; k < 4 ; ++k )
             output.elements[ i * 4 + j ] += elements[ i * 4 + k ] * other.elements[ k * 4 + j ] ;
+#endif
         return output ;
     }
 
@@ -130,6 +233,49 @@ public:
         return output ;
     }
 
+    // Transforms "count" points (w = 1) and keeps xyz of the results. Plain scalar code:
+    // swizzling packed xyz points into SIMD registers measured slower than this loop.
+    void transform_points( const vec3f* input, vec3f* output, size_t count ) const
+    {
+        for( size_t i = 0 ; i < count ; ++i )
+        {
+            auto transformed = multiply( input[ i ] ) ;
+            output[ i ] = { transformed.x, transformed.y, transformed.z } ;
+        }
+    }
+
+    // Same, for points stored as 16 bit integers, e.g. by CompactMesh. They are converted
+    // to float on the way, without a separate decoding pass.
+    void transform_points( const vec3u16* input, vec3f* output, size_t count ) const
+    {
+        size_t simd_count = 0 ;
+#if defined( RASTERIZER_SSE ) && defined( RASTERIZER_SSE2 )
+        static_assert( sizeof( vec3u16 ) == 3 * sizeof( uint16_t ), "vec3u16 must be tightly packed" ) ;
+
+        simd_count = count - count % 4 ;
+        for( size_t i = 0 ; i < simd_count ; i += 4 )
+        {
+            // x0 y0 z0 x1 y1 z1 x2 y2 | z2 x3 y3 z3, widened to 32 bits and then to float
+            auto in = reinterpret_cast<const __m128i*>( input + i ) ;
+            auto first = _mm_loadu_si128( in ) ;
+            auto last = _mm_loadl_epi64( reinterpret_cast<const __m128i*>( reinterpret_cast<const uint16_t*>( in ) + 8 ) ) ;
+            auto zero = _mm_setzero_si128() ;
+
+            transform_four_packed( _mm_cvtepi32_ps( _mm_unpacklo_epi16( first, zero ) ),
+                                   _mm_cvtepi32_ps( _mm_unpackhi_epi16( first, zero ) ),
+                                   _mm_cvtepi32_ps( _mm_unpacklo_epi16( last, zero ) ),
+                                   reinterpret_cast<float*>( output + i ) ) ;
+        }
+#endif
+        for( auto i = simd_count ; i < count ; ++i )
+        {
+            auto transformed = multiply( vec3f { static_cast<float>( input[ i ].x ),
+                                                 static_cast<float>( input[ i ].y ),
+                                                 static_cast<float>( input[ i ].z ) } ) ;
+            output[ i ] = { transformed.x, transformed.y, transformed.z } ;
+        }
+    }
+
     friend Mat operator*( const Mat& a, const Mat& b )
     {
         return a.multiply( b ) ;
@@ -150,4 +296,46 @@ public:
     {
         return m.multiply( v ) ;
     }
+
+private:
+#if defined( RASTERIZER_SSE )
+    // One output component for four points: row.x * xs + row.y * ys + row.z * zs + row.w
+    __m128 transform_row( size_t row, __m128 xs, __m128 ys, __m128 zs ) const
+    {
+        auto sum = _mm_mul_ps( _mm_set1_ps( elements[ row ] ), xs ) ;
+        sum = _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( elements[ row + 1 ] ), ys ) ) ;
+        sum = _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( elements[ row + 2 ] ), zs ) ) ;
+        return _mm_add_ps( sum, _mm_set1_ps( elements[ row + 3 ] ) ) ;
+    }
+
+    // Transforms four tightly packed points, loaded as x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3,
+    // and stores them the same way
+    void transform_four_packed( __m128 a, __m128 b, __m128 c, float* out ) const
+    {
+        auto x2x2x3x3 = _mm_shuffle_ps( b, c, _MM_SHUFFLE( 1, 1, 2, 2 ) ) ;
+        auto y0y0y1y1 = _mm_shuffle_ps( a, b, _MM_SHUFFLE( 0, 0, 1, 1 ) ) ;
+        auto y2y2y3y3 = _mm_shuffle_ps( b, c, _MM_SHUFFLE( 2, 2, 3, 3 ) ) ;
+        auto z0z0z1z1 = _mm_shuffle_ps( a, b, _MM_SHUFFLE( 1, 1, 2, 2 ) ) ;
+
+        auto xs = _mm_shuffle_ps( a, x2x2x3x3, _MM_SHUFFLE( 2, 0, 3, 0 ) ) ;
+        auto ys = _mm_shuffle_ps( y0y0y1y1, y2y2y3y3, _MM_SHUFFLE( 2, 0, 2, 0 ) ) ;
+        auto zs = _mm_shuffle_ps( z0z0z1z1, c, _MM_SHUFFLE( 3, 0, 2, 0 ) ) ;
+
+        auto out_x = transform_row( 0, xs, ys, zs ) ;
+        auto out_y = transform_row( 4, xs, ys, zs ) ;
+        auto out_z = transform_row( 8, xs, ys, zs ) ;
+
+        // Back to x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+        auto x0x0y0y0 = _mm_shuffle_ps( out_x, out_y, _MM_SHUFFLE( 0, 0, 0, 0 ) ) ;
+        auto x0x1z0z1 = _mm_shuffle_ps( out_x, out_z, _MM_SHUFFLE( 1, 0, 1, 0 ) ) ;
+        auto y1y1z1z1 = _mm_shuffle_ps( out_y, out_z, _MM_SHUFFLE( 1, 1, 1, 1 ) ) ;
+        auto x2x2y2y2 = _mm_shuffle_ps( out_x, out_y, _MM_SHUFFLE( 2, 2, 2, 2 ) ) ;
+        auto z2z2x3x3 = _mm_shuffle_ps( out_z, out_x, _MM_SHUFFLE( 3, 3, 2, 2 ) ) ;
+        auto y3y3z3z3 = _mm_shuffle_ps( out_y, out_z, _MM_SHUFFLE( 3, 3, 3, 3 ) ) ;
+
+        _mm_storeu_ps( out,     _mm_shuffle_ps( x0x0y0y0, x0x1z0z1, _MM_SHUFFLE( 1, 2, 2, 0 ) ) ) ;
+        _mm_storeu_ps( out + 4, _mm_shuffle_ps( y1y1z1z1, x2x2y2y2, _MM_SHUFFLE( 2, 0, 2, 0 ) ) ) ;
+        _mm_storeu_ps( out + 8, _mm_shuffle_ps( z2z2x3x3, y3y3z3z3, _MM_SHUFFLE( 2, 0, 2, 0 ) ) ) ;
+    }
+#endif
 } ;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cmath>
 #include <SDL2/SDL.h>
 #include "Vec.h"
 #include "Plane.h"
@@ -38,6 +39,57 @@ inline vec3f compute_cross_product( const vec3f& v0, const vec3f& v1 )
         v0.x * v1.y - v0.y * v1.x } ;
 }
 
+// The vec4f versions work on all four lanes, so pass w = 0 for directions
+
+inline float compute_dot_product( const vec4f& v1, const vec4f& v2 )
+{
+#if defined( RASTERIZER_SSE )
+    auto products = _mm_mul_ps( load( v1 ), load( v2 ) ) ;
+    auto sums     = _mm_add_ps( products, _mm_movehl_ps( products, products ) ) ;
+    sums          = _mm_add_ss( sums, _mm_shuffle_ps( sums, sums, _MM_SHUFFLE( 1, 1, 1, 1 ) ) ) ;
+    return _mm_cvtss_f32( sums ) ;
+#else
+    return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z + v1.w * v2.w ;
+#endif
+}
+
+// Cross product of the xyz parts; w of the result is 0
+inline vec4f compute_cross_product( const vec4f& v0, const vec4f& v1 )
+{
+#if defined( RASTERIZER_SSE )
+    auto a = load( v0 ) ;
+    auto b = load( v1 ) ;
+    auto a_yzx = _mm_shuffle_ps( a, a, _MM_SHUFFLE( 3, 0, 2, 1 ) ) ;
+    auto b_yzx = _mm_shuffle_ps( b, b, _MM_SHUFFLE( 3, 0, 2, 1 ) ) ;
+    auto c = _mm_sub_ps( _mm_mul_ps( a, b_yzx ), _mm_mul_ps( a_yzx, b ) ) ;
+    return store( _mm_shuffle_ps( c, c, _MM_SHUFFLE( 3, 0, 2, 1 ) ) ) ;
+#else
+    return {
+        v0.y * v1.z - v0.z * v1.y,
+        v0.z * v1.x - v0.x * v1.z,
+        v0.x * v1.y - v0.y * v1.x,
+        0 } ;
+#endif
+}
+
+inline vec4f compute_normalized( const vec4f& v )
+{
+#if defined( RASTERIZER_SSE )
+    auto value  = load( v ) ;
+    auto length = _mm_sqrt_ps( _mm_set1_ps( compute_dot_product( v, v ) ) ) ;
+    return store( _mm_div_ps( value, length ) ) ;
+#else
+    auto length = std::sqrt( compute_dot_product( v, v ) ) ;
+    return { v.x / length, v.y / length, v.z / length, v.w / length } ;
+#endif
+}
+
+inline vec3f compute_normalized( const vec3f& v )
+{
+    auto length = std::sqrt( compute_dot_product( v, v ) ) ;
+    return { v.x / length, v.y / length, v.z / length } ;
+}
+
 inline vec3f compute_triangle_normal( const vec3f& v0, const vec3f& v1, const vec3f& v2 )
 {
     auto v0_v1 = v1 - v0 ;
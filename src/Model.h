@@ -1,16 +1,26 @@
 #pragma once
 
 #include <cmath>
+#include <memory>
 #include <vector>
 
+#include "Mat.h"
 #include "Vec.h"
 #include "Sphere.h"
 #include "Triangle.h"
+#include "CompactMesh.h"
+#include "TriangleBVH.h"
+
+enum class ModelStorage
+{
+    full,       // Plain float positions and 32 bit indices, in Model::verticies and triangles
+    compact,    // CompactMesh: about half the size, positions rounded to 1 / 65535 of the bounds
+} ;
 
 class Model
 {
 private:
-    Sphere compute_bounding_sphere() const
+    static Sphere compute_bounding_sphere( const std::vector<vec3f>& verticies )
     {
         if( verticies.empty() )
             return { { 0, 0, 0 }, 0 } ;
@@ -64,12 +74,89 @@ private:
     }
 
 public:
-    const std::vector<vec3f>    verticies;
-    const std::vector<Triangle> triangles;
     const Sphere                bounding_sphere ;
+    const CompactMesh           compact_mesh;   // Empty unless the storage is compact
+    const std::vector<vec3f>    verticies;      // Empty when the storage is compact
+    const std::vector<Triangle> triangles;      // Empty when the storage is compact
+
+    Model(std::vector<vec3f> verticies, std::vector<Triangle> triangles,
+          ModelStorage storage = ModelStorage::full):
+        bounding_sphere(compute_bounding_sphere(verticies)),
+        compact_mesh(storage == ModelStorage::compact ? CompactMesh(verticies, triangles) : CompactMesh()),
+        verticies(storage == ModelStorage::full ? std::move(verticies) : std::vector<vec3f>()),
+        triangles(storage == ModelStorage::full ? std::move(triangles) : std::vector<Triangle>()){}
+
+    bool is_compact() const
+    {
+        return compact_mesh.get_vertex_count() != 0 ;
+    }
+
+    size_t get_vertex_count() const
+    {
+        return is_compact() ? compact_mesh.get_vertex_count() : verticies.size() ;
+    }
+
+    size_t get_triangle_count() const
+    {
+        return is_compact() ? compact_mesh.get_triangle_count() : triangles.size() ;
+    }
+
+    // Transforms every vertex into "output", which must hold get_vertex_count() points
+    void transform_verticies( const Mat& transform, vec3f* output ) const
+    {
+        if( is_compact() )
+            compact_mesh.transform_verticies( transform, output ) ;
+        else
+            transform.transform_points( verticies.data(), output, verticies.size() ) ;
+    }
 
-    Model(std::vector<vec3f> verticies, std::vector<Triangle> triangles):
-        verticies(std::move(verticies)),
-        triangles(std::move(triangles)),
-        bounding_sphere(compute_bounding_sphere()){}
+    // Calls visit( triangle ) for every triangle, without copying them out first
+    template<typename Visit>
+    void for_each_triangle( Visit visit ) const
+    {
+        if( is_compact() )
+            compact_mesh.for_each_triangle( visit ) ;
+        else
+        {
+            for( const auto& triangle : triangles )
+                visit( triangle ) ;
+        }
+    }
+
+    // Copies every triangle into "output"
+    void get_triangles( std::vector<Triangle>& output ) const
+    {
+        if( is_compact() )
+            compact_mesh.get_triangles( output ) ;
+        else
+            output.assign( triangles.begin(), triangles.end() ) ;
+    }
+
+    // Built on first use, by whichever thread gets there first, and kept with the model
+    const TriangleBVH& get_bvh() const
+    {
+        auto bvh = std::atomic_load( &_bvh ) ;
+        if( bvh == nullptr )
+        {
+            std::shared_ptr<const TriangleBVH> built ;
+            if( is_compact() )
+            {
+                std::vector<vec3f> model_verticies( get_vertex_count() ) ;
+                std::vector<Triangle> model_triangles ;
+                transform_verticies( Mat::get_identity_matrix(), model_verticies.data() ) ;
+                get_triangles( model_triangles ) ;
+                built = std::make_shared<const TriangleBVH>( model_verticies, model_triangles ) ;
+            }
+            else
+                built = std::make_shared<const TriangleBVH>( verticies, triangles ) ;
+
+            // Keep the other one if another thread was quicker
+            if( std::atomic_compare_exchange_strong( &_bvh, &bvh, built ) )
+                bvh = std::move( built ) ;
+        }
+        return *bvh ;
+    }
+
+private:
+    mutable std::shared_ptr<const TriangleBVH> _bvh ;
 };
\ No newline at end of file
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "Model.h"
+
+// Loaded models, keyed by an id chosen by the caller, within a memory budget.
+//
+// Models are kept in least recently used order. trim() drops the least recently used
+// ones until the cache fits its budget again, or has room for models about to be
+// loaded, except those used during the current frame, so a frame never loses a model
+// it is drawing.
+class ModelCache
+{
+public:
+    explicit ModelCache( size_t budget_bytes )
+        : _budget_bytes( budget_bytes )
+    {}
+
+    // Roughly what "model" takes in memory
+    static size_t get_model_bytes( const Model& model )
+    {
+        return sizeof( Model )
+            + model.verticies.capacity() * sizeof( vec3f )
+            + model.triangles.capacity() * sizeof( Triangle )
+            + model.compact_mesh.get_bytes() ;
+    }
+
+    // Returns nullptr when the model is not in the cache. Counts as a use.
+    const Model* find( size_t id, uint64_t frame )
+    {
+        auto found = _entries.find( id ) ;
+        if( found == _entries.end() )
+            return nullptr ;
+
+        touch( found->second, frame ) ;
+        return found->second.model.get() ;
+    }
+
+    bool contains( size_t id ) const
+    {
+        return _entries.count( id ) != 0 ;
+    }
+
+    // Adds a model that is not in the cache yet, as used during "frame"
+    const Model* insert( size_t id, std::unique_ptr<Model> model, uint64_t frame )
+    {
+        auto bytes = get_model_bytes( *model ) ;
+        _order.push_front( id ) ;
+
+        auto& entry = _entries[ id ] ;
+        entry.model = std::move( model ) ;
+        entry.bytes = bytes ;
+        entry.last_used_frame = frame ;
+        entry.position = _order.begin() ;
+
+        _used_bytes += bytes ;
+        return entry.model.get() ;
+    }
+
+    // Evicts least recently used models not used during "frame" until "reserve_bytes"
+    // more fit within budget, calling on_evict( id ) before each one is freed
+    template<typename OnEvict>
+    void trim( uint64_t frame, size_t reserve_bytes, OnEvict on_evict )
+    {
+        while( _used_bytes + reserve_bytes > _budget_bytes && ! _order.empty() )
+        {
+            auto id = _order.back() ;
+            auto found = _entries.find( id ) ;
+            if( found->second.last_used_frame == frame )
+                return ;
+
+            on_evict( id ) ;
+            _used_bytes -= found->second.bytes ;
+            _order.pop_back() ;
+            _entries.erase( found ) ;
+        }
+    }
+
+    size_t get_used_bytes() const
+    {
+        return _used_bytes ;
+    }
+
+    // Of the models in the cache, 0 when it is empty
+    size_t get_average_bytes() const
+    {
+        return _entries.empty() ? 0 : _used_bytes / _entries.size() ;
+    }
+
+    size_t get_budget_bytes() const
+    {
+        return _budget_bytes ;
+    }
+
+    size_t size() const
+    {
+        return _entries.size() ;
+    }
+
+private:
+    struct Entry
+    {
+        std::unique_ptr<Model>     model ;
+        size_t                     bytes = 0 ;
+        uint64_t                   last_used_frame = 0 ;
+        std::list<size_t>::iterator position ;  // In _order
+    } ;
+
+    const size_t                        _budget_bytes ;
+    size_t                              _used_bytes = 0 ;
+    std::list<size_t>                   _order ;    // Most recently used first
+    std::unordered_map<size_t, Entry>   _entries ;
+
+    void touch( Entry& entry, uint64_t frame )
+    {
+        entry.last_used_frame = frame ;
+        _order.splice( _order.begin(), _order, entry.position ) ;
+    }
+} ;
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "Model.h"
+
+// Shared, counted reference to a model loaded by a ModelRegistry.
+//
+// Copies refer to the same file and keep its model alive; it is freed once the last
+// handle is gone. When the file changes on disk, the registry swaps the reloaded
+// model in between frames and every handle to the file sees the new one.
+class ModelHandle
+{
+public:
+    ModelHandle() = default ;
+
+    // Null for an empty handle
+    const Model* get() const
+    {
+        return _file == nullptr ? nullptr : _file->model.get() ;
+    }
+
+    // These two need a handle that is not empty
+    const Model& operator*() const
+    {
+        return *_file->model ;
+    }
+
+    const Model* operator->() const
+    {
+        return _file->model.get() ;
+    }
+
+    explicit operator bool() const
+    {
+        return _file != nullptr ;
+    }
+
+    // Changes whenever a reloaded model is swapped in, see Revision.h
+    uint64_t get_revision() const
+    {
+        return _file == nullptr ? 0 : _file->revision ;
+    }
+
+    const std::string& get_path() const
+    {
+        static const std::string none ;
+        return _file == nullptr ? none : _file->path ;
+    }
+
+private:
+    friend class ModelRegistry ;
+
+    // One per file, shared by every handle to it
+    struct File
+    {
+        std::string                     path ;      // Canonical
+        std::shared_ptr<const Model>    model ;     // Shared by files with the same contents
+        uint64_t                        revision ;
+    } ;
+
+    std::shared_ptr<File> _file ;
+
+    explicit ModelHandle( std::shared_ptr<File> file )
+        : _file( std::move( file ) )
+    {}
+} ;
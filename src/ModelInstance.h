@@ -1,30 +1,47 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
 #include "Mat.h"
 #include "Vec.h"
 #include "Model.h"
+#include "Revision.h"
+#include "ModelHandle.h"
 
 class ModelInstance{
+    const Model* _model;
+    ModelHandle _handle;    // Set when the instance shares a registry's model
     vec3f _translation;
     float _scale;
     float _rotation_angle;
     vec3f _rotation_axis;
     Mat   _transform;
+    uint64_t _revision;
+
     void compute_transform(){
-        _transform = Mat::get_translation_matrix(_translation)
-                     * Mat::get_scale_matrix(_scale)
+        _transform = Mat::get_translation_scale_matrix(_translation, _scale)
                      * Mat::get_rotation_matrix(_rotation_angle, _rotation_axis);
+        _revision = next_revision();
+    }
+
+    static const Model& get_loaded_model(const ModelHandle& handle){
+        if (!handle)
+        {
+            throw std::invalid_argument("ModelInstance needs a loaded model, not an empty handle");
+        }
+        return *handle;
     }
 
 public:
-    const Model& model;
-    
+    // The model must outlive the instance
     explicit ModelInstance(const Model& model,
                            const vec3f& translation     = {0, 0, 0},
                            float scale                  = 1,
                            float rotation_angle         = 0,
                            const vec3f& rotation_axis   = {1, 0, 0})
-                    : model(model),
+                    : _model(&model),
                     _translation(translation),
                     _scale(scale),
                     _rotation_angle(rotation_angle),
@@ -33,10 +50,31 @@ public:
         compute_transform();
     }
 
+    // Keeps the handle's model alive, and follows it when it is reloaded. Throws
+    // std::invalid_argument for an empty handle, which is what a failed load returns.
+    explicit ModelInstance(ModelHandle model,
+                           const vec3f& translation     = {0, 0, 0},
+                           float scale                  = 1,
+                           float rotation_angle         = 0,
+                           const vec3f& rotation_axis   = {1, 0, 0})
+                    : ModelInstance(get_loaded_model(model), translation, scale, rotation_angle, rotation_axis){
+        _handle = std::move(model);
+    }
+
+    const Model& get_model() const{
+        return _handle ? *_handle : *_model;
+    }
+
     const Mat& get_transformation() const{
         return _transform;
     }
 
+    // Changes whenever the transformation or the model does; used to reuse work across
+    // frames. Revisions only grow, so the larger of the two changes when either does.
+    uint64_t get_revision() const{
+        return std::max(_revision, _handle.get_revision());
+    }
+
     const vec3f& get_translation() const{
         return _translation;
     }
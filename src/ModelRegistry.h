@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined( __linux__ )
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "Model.h"
+#include "Revision.h"
+#include "A3DBModel.h"
+#include "ModelHandle.h"
+
+// Loads .a3db models once and shares them.
+//
+// Loading a file that is already loaded returns another handle to it, and files with
+// identical contents share one Model. On Linux a background thread watches the loaded
+// files with inotify and reloads those that change; update() then swaps the new models
+// in, so a frame never sees a model change part way through. Files that fail to
+// reload, e.g. because they are only half written, keep their previous model.
+class ModelRegistry
+{
+    // How often the watcher thread checks whether it should stop
+    static constexpr int watch_poll_ms = 100 ;
+
+public:
+    ModelRegistry()
+    {
+#if defined( __linux__ )
+        _inotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC ) ;
+        if( _inotify >= 0 )
+            _watcher = std::thread( [ this ] { watch_files() ; } ) ;
+#endif
+    }
+
+    ModelRegistry( const ModelRegistry& ) = delete ;
+    ModelRegistry& operator=( const ModelRegistry& ) = delete ;
+
+    // Handles stay valid; their models just stop being reloaded
+    ~ModelRegistry()
+    {
+        _stopping = true ;
+        if( _watcher.joinable() )
+            _watcher.join() ;
+
+#if defined( __linux__ )
+        if( _inotify >= 0 )
+            close( _inotify ) ;
+#endif
+    }
+
+    // Returns an empty handle when the file can not be read or is not a valid model
+    ModelHandle load( const std::string& path )
+    {
+        auto canonical = get_canonical_path( path ) ;
+        if( canonical.empty() )
+            return {} ;
+
+        {
+            std::lock_guard<std::mutex> lock( _mutex ) ;
+            auto found = _files.find( canonical ) ;
+            if( found != _files.end() )
+            {
+                if( auto file = found->second.lock() )
+                    return ModelHandle( std::move( file ) ) ;
+            }
+        }
+
+        auto model = read_model( canonical ) ;
+        if( model == nullptr )
+            return {} ;
+
+        auto file = std::make_shared<ModelHandle::File>(
+            ModelHandle::File { canonical, std::move( model ), next_revision() } ) ;
+
+        std::lock_guard<std::mutex> lock( _mutex ) ;
+        auto& entry = _files[ canonical ] ;
+        if( auto existing = entry.lock() )
+            return ModelHandle( std::move( existing ) ) ;
+
+        entry = file ;
+        forget_unused() ;
+        watch( canonical ) ;
+        return ModelHandle( std::move( file ) ) ;
+    }
+
+    // Swaps in the models reloaded since the last call and returns how many files
+    // changed. Call between frames, outside clear() ... present().
+    size_t update()
+    {
+        std::vector<Reload> reloads ;
+        {
+            std::lock_guard<std::mutex> lock( _mutex ) ;
+            reloads.swap( _reloads ) ;
+        }
+
+        size_t changed = 0 ;
+        for( auto& reload : reloads )
+        {
+            auto file = reload.file.lock() ;
+            if( file == nullptr || file->model == reload.model )
+                continue ;
+
+            file->model = std::move( reload.model ) ;
+            file->revision = next_revision() ;
+            ++changed ;
+        }
+
+        if( changed != 0 )
+        {
+            std::lock_guard<std::mutex> lock( _mutex ) ;
+            forget_unused() ;
+        }
+
+        return changed ;
+    }
+
+    // False where files can not be watched; models are then never reloaded
+    bool is_watching() const
+    {
+        return _inotify >= 0 ;
+    }
+
+    // Files with at least one handle
+    size_t get_file_count() const
+    {
+        std::lock_guard<std::mutex> lock( _mutex ) ;
+        return static_cast<size_t>( std::count_if( _files.begin(), _files.end(),
+            []( const auto& entry ) { return ! entry.second.expired() ; } ) ) ;
+    }
+
+    // Distinct models kept alive by those files
+    size_t get_model_count() const
+    {
+        std::lock_guard<std::mutex> lock( _mutex ) ;
+        return static_cast<size_t>( std::count_if( _models_by_hash.begin(), _models_by_hash.end(),
+            []( const auto& entry ) { return ! entry.second.model.expired() ; } ) ) ;
+    }
+
+private:
+    // The file contents are kept with the model, and compared when the hashes match,
+    // so that a hash collision can not share one file's model with another
+    struct SharedModel
+    {
+        std::string                         contents ;
+        std::weak_ptr<const Model>          model ;
+    } ;
+
+    struct Reload
+    {
+        std::weak_ptr<ModelHandle::File>    file ;
+        std::shared_ptr<const Model>        model ;
+    } ;
+
+    int                     _inotify = -1 ;
+    std::atomic<bool>       _stopping { false } ;
+    std::thread             _watcher ;
+
+    // Shared with the watcher thread
+    mutable std::mutex                                                  _mutex ;
+    std::unordered_map<std::string, std::weak_ptr<ModelHandle::File>>   _files ;            // By canonical path
+    std::unordered_multimap<uint64_t, SharedModel>                      _models_by_hash ;   // By hash of the contents
+    std::unordered_map<int, std::string>                                _watched_directories ;
+    std::vector<Reload>                                                 _reloads ;
+
+    static std::string get_canonical_path( const std::string& path )
+    {
+#if defined( __linux__ )
+        std::unique_ptr<char, void ( * )( void* )> resolved( realpath( path.c_str(), nullptr ), &std::free ) ;
+        return resolved == nullptr ? std::string() : std::string( resolved.get() ) ;
+#else
+        return std::ifstream( path ).good() ? path : std::string() ;
+#endif
+    }
+
+    // FNV-1a
+    static uint64_t compute_hash( const std::string& contents )
+    {
+        uint64_t hash = 14695981039346656037ull ;
+        for( auto c : contents )
+        {
+            hash ^= static_cast<uint8_t>( c ) ;
+            hash *= 1099511628211ull ;
+        }
+        return hash ;
+    }
+
+    // Reads and parses "path", or shares the model of a file with the same contents.
+    // Null when the file can not be read or parsed.
+    std::shared_ptr<const Model> read_model( const std::string& path )
+    {
+        std::ifstream in_file( path, std::ios::binary ) ;
+        if( ! in_file.good() )
+            return nullptr ;
+
+        std::string contents { std::istreambuf_iterator<char>( in_file ), std::istreambuf_iterator<char>() } ;
+        auto hash = compute_hash( contents ) ;
+
+        {
+            std::lock_guard<std::mutex> lock( _mutex ) ;
+            if( auto model = find_model( hash, contents ) )
+                return model ;
+        }
+
+        std::istringstream stream( contents ) ;
+        std::shared_ptr<const Model> model = A3DBModel::load( stream ) ;
+        if( model == nullptr )
+            return nullptr ;
+
+        std::lock_guard<std::mutex> lock( _mutex ) ;
+        if( auto existing = find_model( hash, contents ) )
+            return existing ;
+
+        _models_by_hash.emplace( hash, SharedModel { std::move( contents ), model } ) ;
+        return model ;
+    }
+
+    // A live model read from exactly "contents". Called with _mutex held.
+    std::shared_ptr<const Model> find_model( uint64_t hash, const std::string& contents ) const
+    {
+        auto range = _models_by_hash.equal_range( hash ) ;
+        for( auto it = range.first ; it != range.second ; ++it )
+        {
+            if( it->second.contents != contents )
+                continue ;
+
+            if( auto model = it->second.model.lock() )
+                return model ;
+        }
+        return nullptr ;
+    }
+
+    // Watches the directory rather than the file, since editors often save by
+    // replacing the file. Called with _mutex held.
+    void watch( const std::string& path )
+    {
+#if defined( __linux__ )
+        if( _inotify < 0 )
+            return ;
+
+        auto directory = path.substr( 0, std::max<size_t>( path.find_last_of( '/' ), 1 ) ) ;
+        auto descriptor = inotify_add_watch( _inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO ) ;
+        if( descriptor >= 0 )
+            _watched_directories[ descriptor ] = directory ;
+#else
+        ( void ) path ;
+#endif
+    }
+
+    // Watcher thread
+    void watch_files()
+    {
+#if defined( __linux__ )
+        alignas( inotify_event ) char buffer[ 4096 ] ;
+        pollfd descriptor { _inotify, POLLIN, 0 } ;
+        std::vector<std::string> changed ;
+
+        while( ! _stopping )
+        {
+            if( poll( &descriptor, 1, watch_poll_ms ) <= 0 )
+                continue ;
+
+            auto length = read( _inotify, buffer, sizeof( buffer ) ) ;
+            if( length <= 0 )
+                continue ;
+
+            changed.clear() ;
+            {
+                std::lock_guard<std::mutex> lock( _mutex ) ;
+                for( auto at = buffer ; at < buffer + length ; )
+                {
+                    auto event = reinterpret_cast<const inotify_event*>( at ) ;
+                    at += sizeof( inotify_event ) + event->len ;
+
+                    auto directory = _watched_directories.find( event->wd ) ;
+                    if( event->len == 0 || directory == _watched_directories.end() )
+                        continue ;
+
+                    auto path = ( directory->second == "/" ? "" : directory->second ) + '/' + event->name ;
+                    if( _files.count( path ) != 0 )
+                        changed.push_back( std::move( path ) ) ;
+                }
+            }
+
+            std::sort( changed.begin(), changed.end() ) ;
+            changed.erase( std::unique( changed.begin(), changed.end() ), changed.end() ) ;
+
+            for( auto& path : changed )
+                reload( path ) ;
+        }
+#endif
+    }
+
+    void reload( const std::string& path )
+    {
+        std::weak_ptr<ModelHandle::File> file ;
+        {
+            std::lock_guard<std::mutex> lock( _mutex ) ;
+            auto found = _files.find( path ) ;
+            if( found == _files.end() || found->second.expired() )
+                return ;
+
+            file = found->second ;
+        }
+
+        auto model = read_model( path ) ;
+        if( model == nullptr )
+            return ;
+
+        std::lock_guard<std::mutex> lock( _mutex ) ;
+        _reloads.push_back( { std::move( file ), std::move( model ) } ) ;
+    }
+
+    // Drops the files and models no handle uses any more. Called with _mutex held.
+    void forget_unused()
+    {
+        for( auto it = _files.begin() ; it != _files.end() ; )
+            it = it->second.expired() ? _files.erase( it ) : std::next( it ) ;
+
+        for( auto it = _models_by_hash.begin() ; it != _models_by_hash.end() ; )
+            it = it->second.model.expired() ? _models_by_hash.erase( it ) : std::next( it ) ;
+    }
+} ;
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+
+// One framebuffer pixel, packed as 0xAARRGGBB in a 32 bit word. That is the layout of
+// SDL_PIXELFORMAT_ARGB8888, so a frame of these goes to SDL without conversion.
+class Pixel
+{
+public:
+    uint32_t argb = 0 ;
+
+    constexpr Pixel() = default ;
+
+    constexpr explicit Pixel( uint32_t argb )
+        : argb( argb )
+    {}
+
+    constexpr Pixel( uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255 )
+        : argb( static_cast<uint32_t>( a ) << 24 | static_cast<uint32_t>( r ) << 16
+              | static_cast<uint32_t>( g ) << 8  | static_cast<uint32_t>( b ) )
+    {}
+
+    constexpr uint8_t get_alpha() const { return static_cast<uint8_t>( argb >> 24 ) ; }
+    constexpr uint8_t get_red()   const { return static_cast<uint8_t>( argb >> 16 ) ; }
+    constexpr uint8_t get_green() const { return static_cast<uint8_t>( argb >> 8 ) ; }
+    constexpr uint8_t get_blue()  const { return static_cast<uint8_t>( argb ) ; }
+
+    constexpr Pixel with_alpha( uint8_t alpha ) const
+    {
+        return Pixel( ( argb & 0x00ffffffu ) | static_cast<uint32_t>( alpha ) << 24 ) ;
+    }
+
+    friend constexpr bool operator==( const Pixel& a, const Pixel& b )
+    {
+        return a.argb == b.argb ;
+    }
+
+    friend constexpr bool operator!=( const Pixel& a, const Pixel& b )
+    {
+        return a.argb != b.argb ;
+    }
+} ;
+
+static_assert( sizeof( Pixel ) == sizeof( uint32_t ), "Pixel must stay a bare 32 bit word" ) ;
+
+// x / 255 rounded to nearest, exact for x <= 255 * 255. The SIMD kernels use the same
+// formula so that both paths give identical results.
+constexpr uint32_t divide_by_255( uint32_t x )
+{
+    return ( x + 128 + ( ( x + 128 ) >> 8 ) ) >> 8 ;
+}
+
+// Blends "src" over "dst" using src's alpha: dst = src * a + dst * ( 1 - a ).
+// The alpha channel is treated as if src were 255 there, so an opaque target stays opaque.
+constexpr Pixel blend_over( Pixel dst, Pixel src )
+{
+    auto a = src.get_alpha() ;
+    auto inverse_a = 255u - a ;
+    return { static_cast<uint8_t>( divide_by_255( src.get_red()   * a + dst.get_red()   * inverse_a ) ),
+             static_cast<uint8_t>( divide_by_255( src.get_green() * a + dst.get_green() * inverse_a ) ),
+             static_cast<uint8_t>( divide_by_255( src.get_blue()  * a + dst.get_blue()  * inverse_a ) ),
+             static_cast<uint8_t>( divide_by_255( 255u            * a + dst.get_alpha() * inverse_a ) ) } ;
+}
+
+// Adds "src" scaled by its alpha to "dst", saturating; dst's alpha is kept
+constexpr Pixel blend_additive( Pixel dst, Pixel src )
+{
+    auto a = src.get_alpha() ;
+    auto add = []( uint32_t d, uint32_t s ) {
+        return static_cast<uint8_t>( d + s > 255 ? 255 : d + s ) ; } ;
+
+    return { add( dst.get_red(),   divide_by_255( src.get_red()   * a ) ),
+             add( dst.get_green(), divide_by_255( src.get_green() * a ) ),
+             add( dst.get_blue(),  divide_by_255( src.get_blue()  * a ) ),
+             dst.get_alpha() } ;
+}
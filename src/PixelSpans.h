@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Simd.h"
+#include "Pixel.h"
+
+// Operations on runs of consecutive pixels, four at a time with SSE2 where available.
+// Every kernel gives exactly the same result as the per pixel functions in Pixel.h.
+
+#if defined( RASTERIZER_SSE2 )
+namespace pixel_spans_detail
+{
+    // ( t + ( t >> 8 ) ) >> 8 on 16 bit lanes, where t already includes the + 128
+    inline __m128i divide_biased_by_255( __m128i t )
+    {
+        return _mm_srli_epi16( _mm_add_epi16( t, _mm_srli_epi16( t, 8 ) ), 8 ) ;
+    }
+
+    inline __m128i load( const Pixel* pixels )
+    {
+        return _mm_loadu_si128( reinterpret_cast<const __m128i*>( pixels ) ) ;
+    }
+
+    inline void store( Pixel* pixels, __m128i value )
+    {
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( pixels ), value ) ;
+    }
+}
+#endif
+
+inline void fill_span( Pixel* dst, size_t count, Pixel color )
+{
+    size_t i = 0 ;
+
+#if defined( RASTERIZER_SSE2 )
+    auto value = _mm_set1_epi32( static_cast<int>( color.argb ) ) ;
+    for( ; i + 4 <= count ; i += 4 )
+        pixel_spans_detail::store( dst + i, value ) ;
+#endif
+
+    for( ; i < count ; ++i )
+        dst[ i ] = color ;
+}
+
+// blend_over with the same source color for every pixel
+inline void blend_span_over( Pixel* dst, size_t count, Pixel src )
+{
+    size_t i = 0 ;
+
+#if defined( RASTERIZER_SSE2 )
+    using namespace pixel_spans_detail ;
+
+    // Lanes are b, g, r, a for two pixels; the source term is the same for every pixel
+    auto a = static_cast<short>( src.get_alpha() ) ;
+    auto b_term = static_cast<short>( src.get_blue()  * a + 128 ) ;
+    auto g_term = static_cast<short>( src.get_green() * a + 128 ) ;
+    auto r_term = static_cast<short>( src.get_red()   * a + 128 ) ;
+    auto a_term = static_cast<short>( 255 * a + 128 ) ;
+    auto src_term  = _mm_set_epi16( a_term, r_term, g_term, b_term, a_term, r_term, g_term, b_term ) ;
+    auto inverse_a = _mm_set1_epi16( static_cast<short>( 255 - a ) ) ;
+    auto zero      = _mm_setzero_si128() ;
+
+    for( ; i + 4 <= count ; i += 4 )
+    {
+        auto pixels = load( dst + i ) ;
+        auto low  = _mm_add_epi16( _mm_mullo_epi16( _mm_unpacklo_epi8( pixels, zero ), inverse_a ), src_term ) ;
+        auto high = _mm_add_epi16( _mm_mullo_epi16( _mm_unpackhi_epi8( pixels, zero ), inverse_a ), src_term ) ;
+        store( dst + i, _mm_packus_epi16( divide_biased_by_255( low ), divide_biased_by_255( high ) ) ) ;
+    }
+#endif
+
+    for( ; i < count ; ++i )
+        dst[ i ] = blend_over( dst[ i ], src ) ;
+}
+
+// blend_over with a source pixel per destination pixel
+inline void blend_span_over( Pixel* dst, const Pixel* src, size_t count )
+{
+    size_t i = 0 ;
+
+#if defined( RASTERIZER_SSE2 )
+    using namespace pixel_spans_detail ;
+
+    auto zero        = _mm_setzero_si128() ;
+    auto bias        = _mm_set1_epi16( 128 ) ;
+    auto all_255     = _mm_set1_epi16( 255 ) ;
+    auto alpha_lanes = _mm_set_epi16( 255, 0, 0, 0, 255, 0, 0, 0 ) ;
+
+    auto blend_half = [ & ]( __m128i d, __m128i s )
+    {
+        auto a = _mm_shufflehi_epi16( _mm_shufflelo_epi16( s, _MM_SHUFFLE( 3, 3, 3, 3 ) ), _MM_SHUFFLE( 3, 3, 3, 3 ) ) ;
+        s = _mm_or_si128( s, alpha_lanes ) ;
+        auto t = _mm_add_epi16( _mm_mullo_epi16( s, a ), _mm_mullo_epi16( d, _mm_sub_epi16( all_255, a ) ) ) ;
+        return divide_biased_by_255( _mm_add_epi16( t, bias ) ) ;
+    } ;
+
+    for( ; i + 4 <= count ; i += 4 )
+    {
+        auto d = load( dst + i ) ;
+        auto s = load( src + i ) ;
+        auto low  = blend_half( _mm_unpacklo_epi8( d, zero ), _mm_unpacklo_epi8( s, zero ) ) ;
+        auto high = blend_half( _mm_unpackhi_epi8( d, zero ), _mm_unpackhi_epi8( s, zero ) ) ;
+        store( dst + i, _mm_packus_epi16( low, high ) ) ;
+    }
+#endif
+
+    for( ; i < count ; ++i )
+        dst[ i ] = blend_over( dst[ i ], src[ i ] ) ;
+}
+
+// blend_additive with the same source color for every pixel
+inline void blend_span_additive( Pixel* dst, size_t count, Pixel src )
+{
+    auto a = src.get_alpha() ;
+    Pixel addend { static_cast<uint8_t>( divide_by_255( src.get_red()   * a ) ),
+                   static_cast<uint8_t>( divide_by_255( src.get_green() * a ) ),
+                   static_cast<uint8_t>( divide_by_255( src.get_blue()  * a ) ), 0 } ;
+
+    size_t i = 0 ;
+
+#if defined( RASTERIZER_SSE2 )
+    auto value = _mm_set1_epi32( static_cast<int>( addend.argb ) ) ;
+    for( ; i + 4 <= count ; i += 4 )
+        pixel_spans_detail::store( dst + i, _mm_adds_epu8( pixel_spans_detail::load( dst + i ), value ) ) ;
+#endif
+
+    for( ; i < count ; ++i )
+        dst[ i ] = blend_additive( dst[ i ], src ) ;
+}
+
+// Packs pixels as 8 bit R, G, B triples, e.g. for PPM files
+inline void convert_span_to_rgb24( const Pixel* src, uint8_t* dst, size_t count )
+{
+    size_t i = 0 ;
+
+#if defined( RASTERIZER_SSSE3 )
+    // Bytes of four pixels are b g r a; pick r g b of each and leave the last 4 bytes zero
+    auto order = _mm_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 ) ;
+
+    // Each 16 byte store spills 4 bytes into the next pixels' slots, which get written
+    // afterwards, so stop while two more pixels remain to be converted
+    for( ; i + 6 <= count ; i += 4 )
+    {
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( dst + i * 3 ),
+            _mm_shuffle_epi8( pixel_spans_detail::load( src + i ), order ) ) ;
+    }
+#endif
+
+    for( ; i < count ; ++i )
+    {
+        dst[ i * 3     ] = src[ i ].get_red() ;
+        dst[ i * 3 + 1 ] = src[ i ].get_green() ;
+        dst[ i * 3 + 2 ] = src[ i ].get_blue() ;
+    }
+}
+
+// Swaps red and blue: 0xAARRGGBB becomes 0xAABBGGRR, which is R, G, B, A byte order
+// in memory on little endian machines (SDL_PIXELFORMAT_ABGR8888)
+inline void convert_span_to_abgr( const Pixel* src, uint32_t* dst, size_t count )
+{
+    size_t i = 0 ;
+
+#if defined( RASTERIZER_SSE2 )
+    auto alpha_green = _mm_set1_epi32( static_cast<int>( 0xff00ff00u ) ) ;
+    auto low_byte    = _mm_set1_epi32( 0xff ) ;
+
+    for( ; i + 4 <= count ; i += 4 )
+    {
+        auto pixels = pixel_spans_detail::load( src + i ) ;
+        auto red    = _mm_and_si128( _mm_srli_epi32( pixels, 16 ), low_byte ) ;
+        auto blue   = _mm_slli_epi32( _mm_and_si128( pixels, low_byte ), 16 ) ;
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( dst + i ),
+            _mm_or_si128( _mm_and_si128( pixels, alpha_green ), _mm_or_si128( red, blue ) ) ) ;
+    }
+#endif
+
+    for( ; i < count ; ++i )
+    {
+        auto argb = src[ i ].argb ;
+        dst[ i ] = ( argb & 0xff00ff00u ) | ( argb >> 16 & 0xffu ) | ( argb & 0xffu ) << 16 ;
+    }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "Vec.h"
+#include "Color.h"
+#include "Pixel.h"
+#include "Sphere.h"
+
+// Colored points, such as a LiDAR scan, for Canvas::draw_point_cloud().
+//
+// Coordinates are kept one array per axis, padded to a multiple of four points, so
+// they load straight into SIMD registers. Runs of block_size consecutive points form
+// blocks with their own bounding sphere, and blocks out of view are skipped whole,
+// which pays off when points that are near in the input are near in space too, as in
+// scans and most exported clouds.
+class PointCloud
+{
+public:
+    static constexpr size_t block_size = 4096 ;
+
+    // "colors" has one color per position
+    PointCloud( const std::vector<vec3f>& positions, const std::vector<Color>& colors )
+        : _size( positions.size() )
+    {
+        // Padding is NaN, which every visibility test rejects
+        auto padded = ( _size + 3 ) / 4 * 4 ;
+        _x.assign( padded, std::numeric_limits<float>::quiet_NaN() ) ;
+        _y.assign( padded, std::numeric_limits<float>::quiet_NaN() ) ;
+        _z.assign( padded, std::numeric_limits<float>::quiet_NaN() ) ;
+        _colors.resize( padded ) ;
+
+        for( size_t i = 0 ; i < _size ; ++i )
+        {
+            _x[ i ] = positions[ i ].x ;
+            _y[ i ] = positions[ i ].y ;
+            _z[ i ] = positions[ i ].z ;
+            _colors[ i ] = colors[ i ].to_pixel() ;
+        }
+
+        for( size_t begin = 0 ; begin < _size ; begin += block_size )
+            _block_bounds.push_back( compute_bounds( positions, begin, std::min( begin + block_size, _size ) ) ) ;
+    }
+
+    size_t size() const
+    {
+        return _size ;
+    }
+
+    size_t get_block_count() const
+    {
+        return _block_bounds.size() ;
+    }
+
+    const Sphere& get_block_bounds( size_t block ) const
+    {
+        return _block_bounds[ block ] ;
+    }
+
+    // The block's points are [ block * block_size, get_block_end( block ) ), which is a
+    // multiple of four, taking in the padding after the last point
+    size_t get_block_end( size_t block ) const
+    {
+        return std::min( ( block + 1 ) * block_size, _x.size() ) ;
+    }
+
+    const float* get_x() const
+    {
+        return _x.data() ;
+    }
+
+    const float* get_y() const
+    {
+        return _y.data() ;
+    }
+
+    const float* get_z() const
+    {
+        return _z.data() ;
+    }
+
+    const Pixel* get_colors() const
+    {
+        return _colors.data() ;
+    }
+
+private:
+    size_t              _size ;
+    std::vector<float>  _x ;
+    std::vector<float>  _y ;
+    std::vector<float>  _z ;
+    std::vector<Pixel>  _colors ;
+    std::vector<Sphere> _block_bounds ;
+
+    // Around the center of the points' box
+    static Sphere compute_bounds( const std::vector<vec3f>& positions, size_t begin, size_t end )
+    {
+        auto min = positions[ begin ] ;
+        auto max = positions[ begin ] ;
+        for( auto i = begin + 1 ; i < end ; ++i )
+        {
+            min = { std::min( min.x, positions[ i ].x ), std::min( min.y, positions[ i ].y ), std::min( min.z, positions[ i ].z ) } ;
+            max = { std::max( max.x, positions[ i ].x ), std::max( max.y, positions[ i ].y ), std::max( max.z, positions[ i ].z ) } ;
+        }
+
+        auto half_size = 0.5f * ( max - min ) ;
+        return { min + half_size, std::sqrt( half_size.x * half_size.x + half_size.y * half_size.y + half_size.z * half_size.z ) } ;
+    }
+} ;
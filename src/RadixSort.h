@@ -0,0 +1,51 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Sorts "items" by their 64 bit "key" member, least significant byte first. The sort
+// is stable, so items with equal keys keep their order. Bytes that are the same in
+// every key are skipped. "scratch" is working space, kept by the caller so repeated
+// sorts do not allocate.
+template<typename T>
+void radix_sort( std::vector<T>& items, std::vector<T>& scratch )
+{
+    constexpr size_t digit_count = sizeof( uint64_t ) ;
+
+    if( items.size() < 2 )
+        return ;
+
+    std::array<std::array<size_t, 256>, digit_count> counts {} ;
+    for( auto& item : items )
+    {
+        for( size_t digit = 0 ; digit < digit_count ; ++digit )
+            ++counts[ digit ][ ( item.key >> ( digit * 8 ) ) & 0xff ] ;
+    }
+
+    scratch.resize( items.size() ) ;
+    for( size_t digit = 0 ; digit < digit_count ; ++digit )
+    {
+        auto& count = counts[ digit ] ;
+        auto shift = digit * 8 ;
+
+        if( count[ ( items.front().key >> shift ) & 0xff ] == items.size() )
+            continue ;
+
+        // Counts become the offset of each byte value's first item
+        size_t offset = 0 ;
+        for( auto& value : count )
+        {
+            auto next = offset + value ;
+            value = offset ;
+            offset = next ;
+        }
+
+        for( auto& item : items )
+            scratch[ count[ ( item.key >> shift ) & 0xff ]++ ] = item ;
+
+        std::swap( items, scratch ) ;
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Everything that changes what the raster inner loop does per pixel. Each
+// combination gets its own fully specialized kernel (see RasterState below), and
+// the canvas picks one of them once per draw instead of branching per pixel.
+
+enum class DepthTest : uint8_t
+{
+    off,                // Every covered pixel passes
+    nearer,             // Pass when closer than what is in the depth buffer
+    nearer_or_equal,    // Also pass at equal depth, e.g. after a depth only prepass
+} ;
+
+enum class ColorSource : uint8_t
+{
+    none,       // Depth only, nothing is written to the color buffer
+    flat,       // The triangle's color
+    shadowed,   // The triangle's color, darkened where the canvas' shadow map is occluded
+} ;
+
+enum class BlendMode : uint8_t
+{
+    replace,    // Overwrite the destination
+    alpha,      // Source over, using PipelineState::opacity
+    additive,   // Add the source, scaled by PipelineState::opacity
+    weighted,   // Order independent transparency: accumulated, then composited in present()
+} ;
+
+constexpr size_t depth_test_count   = 3 ;
+constexpr size_t color_source_count = 3 ;
+constexpr size_t blend_mode_count   = 4 ;
+
+constexpr size_t raster_kernel_count = depth_test_count * 2 * color_source_count * blend_mode_count ;
+
+// Runtime description of the pipeline, set on the canvas between draws
+class PipelineState
+{
+public:
+    DepthTest   depth_test   = DepthTest::nearer ;
+    bool        depth_write  = true ;
+    ColorSource color_source = ColorSource::flat ;
+    BlendMode   blend_mode   = BlendMode::replace ;
+    uint8_t     opacity      = 255 ; // Only used by the blended modes
+
+    constexpr size_t get_kernel_index() const
+    {
+        return ( ( static_cast<size_t>( depth_test ) * 2
+                   + ( depth_write ? 1 : 0 ) ) * color_source_count
+                   + static_cast<size_t>( color_source ) ) * blend_mode_count
+                   + static_cast<size_t>( blend_mode ) ;
+    }
+} ;
+
+// Compile time view of the same state, decoded from a kernel index
+template<size_t kernel_index>
+class RasterState
+{
+public:
+    static constexpr BlendMode   blend_mode   = static_cast<BlendMode>( kernel_index % blend_mode_count ) ;
+    static constexpr ColorSource color_source = static_cast<ColorSource>(
+        kernel_index / blend_mode_count % color_source_count ) ;
+    static constexpr bool        depth_write  =
+        kernel_index / ( blend_mode_count * color_source_count ) % 2 == 1 ;
+    static constexpr DepthTest   depth_test   = static_cast<DepthTest>(
+        kernel_index / ( blend_mode_count * color_source_count * 2 ) % depth_test_count ) ;
+
+    static constexpr bool writes_color = color_source != ColorSource::none ;
+    static constexpr bool accumulates  = writes_color && blend_mode == BlendMode::weighted ;
+    static constexpr bool shadowed     = color_source == ColorSource::shadowed ;
+    static constexpr bool needs_depth  = depth_test != DepthTest::off || depth_write || accumulates || shadowed ;
+
+    // Every covered pixel gets the same color, so rows can be written as whole spans
+    static constexpr bool writes_spans = writes_color && depth_test == DepthTest::off && ! accumulates && ! shadowed ;
+
+    static_assert( kernel_index < raster_kernel_count, "kernel index out of range" ) ;
+} ;
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+
+#include "Vec.h"
+
+// The points origin + t * direction for t in [ 0, max_distance ). Distances along the
+// ray are in multiples of "direction", so they are lengths when it is normalized.
+class Ray
+{
+public:
+    vec3f origin ;
+    vec3f direction ;
+    float max_distance = std::numeric_limits<float>::infinity() ;
+} ;
+
+// Where a ray first meets a model's triangles
+class RayHit
+{
+public:
+    float    distance ;     // Along the ray
+    uint32_t triangle ;     // Index into the model's triangles
+} ;
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Mat.h"
+#include "Ray.h"
+#include "Misc.h"
+#include "Vec.h"
+#include "ModelInstance.h"
+
+// Ray queries against a set of instances, such as picking what is under the mouse with
+// Canvas::get_pick_ray() or checking line of sight.
+//
+// Each ray is tested against the instances' bounding spheres first, then moved into the
+// local space of those it meets and traced through their model's TriangleBVH, nearest
+// sphere first. The BVHs are built the first time a model is queried. The instances are
+// not copied and must stay alive and unchanged while the query is used. A query keeps
+// no state between rays, so several threads may use the same one at once.
+class RayQuery
+{
+public:
+    class Hit
+    {
+    public:
+        const ModelInstance* instance ;
+        uint32_t             triangle ;     // Index into the instance's model's triangles
+        float                distance ;     // Along the ray
+        vec3f                point ;        // In world space
+    } ;
+
+    explicit RayQuery( std::vector<const ModelInstance*> instances )
+        : _instances( std::move( instances ) )
+    {}
+
+    // The nearest triangle the ray meets, from either side, before ray.max_distance
+    bool find_nearest( const Ray& ray, Hit& hit ) const
+    {
+        auto candidates = get_candidates( ray ) ;
+        std::sort( candidates.begin(), candidates.end(), []( const Candidate& a, const Candidate& b ) {
+            return a.enter < b.enter ; } ) ;
+
+        RayHit nearest { ray.max_distance, 0 } ;
+        const ModelInstance* nearest_instance = nullptr ;
+        for( const auto& candidate : candidates )
+        {
+            // Everything left starts beyond the nearest hit so far
+            if( candidate.enter >= nearest.distance )
+                break ;
+
+            auto local_ray = to_local( ray, *candidate.instance ) ;
+            local_ray.max_distance = nearest.distance ;
+
+            RayHit local_hit ;
+            if( candidate.instance->get_model().get_bvh().find_nearest( local_ray, local_hit ) )
+            {
+                nearest = local_hit ;
+                nearest_instance = candidate.instance ;
+            }
+        }
+
+        if( nearest_instance == nullptr )
+            return false ;
+
+        hit = { nearest_instance, nearest.triangle, nearest.distance, ray.origin + nearest.distance * ray.direction } ;
+        return true ;
+    }
+
+    // Whether any triangle is before ray.max_distance
+    bool is_blocked( const Ray& ray ) const
+    {
+        for( const auto& candidate : get_candidates( ray ) )
+        {
+            if( candidate.instance->get_model().get_bvh().is_blocked( to_local( ray, *candidate.instance ) ) )
+                return true ;
+        }
+        return false ;
+    }
+
+    // Whether nothing is between the two points
+    bool is_visible( const vec3f& from, const vec3f& to ) const
+    {
+        return ! is_blocked( { from, to - from, 1.0f } ) ;
+    }
+
+private:
+    struct Candidate
+    {
+        float                enter ;    // Where the ray enters the bounding sphere
+        const ModelInstance* instance ;
+    } ;
+
+    std::vector<const ModelInstance*> _instances ;
+
+    // Instances whose bounding sphere the ray meets before ray.max_distance
+    std::vector<Candidate> get_candidates( const Ray& ray ) const
+    {
+        std::vector<Candidate> candidates ;
+
+        auto length_squared = compute_dot_product( ray.direction, ray.direction ) ;
+        if( ! ( length_squared > 0 ) )
+            return candidates ;
+
+        for( auto instance : _instances )
+        {
+            const auto& sphere = instance->get_model().bounding_sphere ;
+            auto center = instance->get_transformation() * sphere.center ;
+            auto radius = instance->get_scale() * sphere.radius ;
+
+            // Solves |origin + t * direction - center| = radius for t
+            auto offset = ray.origin - vec3f { center.x, center.y, center.z } ;
+            auto half_b = compute_dot_product( offset, ray.direction ) / length_squared ;
+            auto c = ( compute_dot_product( offset, offset ) - radius * radius ) / length_squared ;
+            auto discriminant = half_b * half_b - c ;
+            if( discriminant < 0 )
+                continue ;
+
+            auto root = std::sqrt( discriminant ) ;
+            auto enter = std::max( -half_b - root, 0.0f ) ;
+            auto leave = -half_b + root ;
+            if( leave >= 0 && enter < ray.max_distance )
+                candidates.push_back( { enter, instance } ) ;
+        }
+        return candidates ;
+    }
+
+    // The direction is transformed without normalizing it, so distances along the local
+    // ray are the same as along the world one
+    static Ray to_local( const Ray& ray, const ModelInstance& instance )
+    {
+        auto to_model = instance.get_transformation().get_affine_inverse() ;
+        auto origin = to_model * ray.origin ;
+        auto direction = to_model * vec4f { ray.direction.x, ray.direction.y, ray.direction.z, 0 } ;
+        return { { origin.x, origin.y, origin.z }, { direction.x, direction.y, direction.z }, ray.max_distance } ;
+    }
+} ;
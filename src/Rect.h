@@ -0,0 +1,43 @@
+#pragma once
+
+#include <algorithm>
+
+// Axis aligned rectangle in buffer coordinates (origin top left, y down).
+// The rectangle is half open: it covers [ x0, x1 ) x [ y0, y1 ).
+class Rect
+{
+public:
+    int x0 ;
+    int y0 ;
+    int x1 ;
+    int y1 ;
+
+    bool is_empty() const
+    {
+        return x1 <= x0 || y1 <= y0 ;
+    }
+
+    bool intersects( const Rect& other ) const
+    {
+        return x0 < other.x1 && other.x0 < x1
+            && y0 < other.y1 && other.y0 < y1 ;
+    }
+
+    Rect intersect( const Rect& other ) const
+    {
+        return { std::max( x0, other.x0 ), std::max( y0, other.y0 ),
+                 std::min( x1, other.x1 ), std::min( y1, other.y1 ) } ;
+    }
+
+    Rect unite( const Rect& other ) const
+    {
+        if( is_empty() )
+            return other ;
+
+        if( other.is_empty() )
+            return *this ;
+
+        return { std::min( x0, other.x0 ), std::min( y0, other.y0 ),
+                 std::max( x1, other.x1 ), std::max( y1, other.y1 ) } ;
+    }
+} ;
@@ -0,0 +1,222 @@
+#pragma once
+
+#if defined( __linux__ )
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Pixel.h"
+#include "RenderProtocol.h"
+
+// Talks to a RenderServer, see RenderProtocol.h.
+//
+// Commands are queued and sent together by submit(), which then waits for all their
+// replies, so a whole frame's worth of changes costs one round trip:
+//
+//   client.set_camera( camera ) ;
+//   client.render() ;
+//   auto replies = client.submit() ;
+//   auto pixels = client.get_frame( replies[ 1 ].value ) ;
+class RenderClient
+{
+public:
+    // Throws when the server can not be reached
+    explicit RenderClient( const std::string& socket_path )
+    {
+        sockaddr_un address {} ;
+        address.sun_family = AF_UNIX ;
+        if( socket_path.size() >= sizeof( address.sun_path ) )
+            throw std::invalid_argument( "socket path too long: " + socket_path ) ;
+
+        std::memcpy( address.sun_path, socket_path.c_str(), socket_path.size() + 1 ) ;
+
+        _socket = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ;
+        try
+        {
+            if( _socket < 0 || connect( _socket, reinterpret_cast<const sockaddr*>( &address ), sizeof( address ) ) < 0 )
+                fail( "could not connect to " + socket_path ) ;
+
+            auto memory = receive_hello() ;
+            _frames_bytes = _hello.frame_count * _hello.frame_bytes ;
+            _frames = mmap( nullptr, _frames_bytes, PROT_READ, MAP_SHARED, memory, 0 ) ;
+            close( memory ) ;
+
+            if( _frames == MAP_FAILED )
+                fail( "could not map frames" ) ;
+        }
+        catch( ... )
+        {
+            if( _socket >= 0 )
+                close( _socket ) ;
+            throw ;
+        }
+    }
+
+    RenderClient( const RenderClient& ) = delete ;
+    RenderClient& operator=( const RenderClient& ) = delete ;
+
+    ~RenderClient()
+    {
+        if( _frames != MAP_FAILED )
+            munmap( _frames, _frames_bytes ) ;
+        if( _socket >= 0 )
+            close( _socket ) ;
+    }
+
+    uint32_t get_width() const
+    {
+        return _hello.width ;
+    }
+
+    uint32_t get_height() const
+    {
+        return _hello.height ;
+    }
+
+    void load_model( const std::string& path )
+    {
+        queue( RenderProtocol::Command::load_model, path.data(), path.size() ) ;
+    }
+
+    void set_camera( const RenderProtocol::Camera& camera )
+    {
+        queue( RenderProtocol::Command::set_camera, &camera, sizeof( camera ) ) ;
+    }
+
+    void set_instances( const std::vector<RenderProtocol::Instance>& instances )
+    {
+        queue( RenderProtocol::Command::set_instances, instances.data(),
+               instances.size() * sizeof( RenderProtocol::Instance ) ) ;
+    }
+
+    void render()
+    {
+        queue( RenderProtocol::Command::render, nullptr, 0 ) ;
+    }
+
+    // Sends the queued commands and returns their replies, in the same order. Throws
+    // when the server is gone. Replies are only read once everything is sent, so keep
+    // batches to some thousands of commands, or this client and the server's queue for
+    // it can fill up and wait for each other. Other clients are not held up.
+    std::vector<RenderProtocol::Reply> submit()
+    {
+        if( ! send_all( _output.data(), _output.size() ) )
+            fail( "could not send commands" ) ;
+
+        std::vector<RenderProtocol::Reply> replies( _queued_count ) ;
+        if( ! receive_all( replies.data(), replies.size() * sizeof( RenderProtocol::Reply ) ) )
+            fail( "could not receive replies" ) ;
+
+        _output.clear() ;
+        _queued_count = 0 ;
+        return replies ;
+    }
+
+    // A rendered frame, width * height pixels row by row from the top, read straight
+    // from the server's shared memory
+    const Pixel* get_frame( uint32_t slot ) const
+    {
+        return reinterpret_cast<const Pixel*>( static_cast<const uint8_t*>( _frames ) + slot * _hello.frame_bytes ) ;
+    }
+
+private:
+    int                     _socket = -1 ;
+    RenderProtocol::Hello   _hello {} ;
+    void*                   _frames = MAP_FAILED ;
+    size_t                  _frames_bytes = 0 ;
+    std::vector<uint8_t>    _output ;           // Queued commands
+    size_t                  _queued_count = 0 ;
+
+    [[noreturn]] void fail( const std::string& message )
+    {
+        throw std::runtime_error( message + ": " + std::strerror( errno ) ) ;
+    }
+
+    void queue( RenderProtocol::Command command, const void* payload, size_t size )
+    {
+        RenderProtocol::CommandHeader header { command, static_cast<uint32_t>( size ) } ;
+        auto header_bytes = reinterpret_cast<const uint8_t*>( &header ) ;
+        _output.insert( _output.end(), header_bytes, header_bytes + sizeof( header ) ) ;
+
+        auto payload_bytes = static_cast<const uint8_t*>( payload ) ;
+        _output.insert( _output.end(), payload_bytes, payload_bytes + size ) ;
+        ++_queued_count ;
+    }
+
+    // Returns the shared memory's file descriptor
+    int receive_hello()
+    {
+        iovec data { &_hello, sizeof( _hello ) } ;
+
+        alignas( cmsghdr ) char control[ CMSG_SPACE( sizeof( int ) ) ] {} ;
+        msghdr message {} ;
+        message.msg_iov = &data ;
+        message.msg_iovlen = 1 ;
+        message.msg_control = control ;
+        message.msg_controllen = sizeof( control ) ;
+
+        if( recvmsg( _socket, &message, MSG_CMSG_CLOEXEC ) != static_cast<ssize_t>( sizeof( _hello ) ) )
+            fail( "no greeting from the server" ) ;
+
+        auto header = CMSG_FIRSTHDR( &message ) ;
+        if( header == nullptr || header->cmsg_type != SCM_RIGHTS )
+            fail( "no frame memory from the server" ) ;
+
+        int memory ;
+        std::memcpy( &memory, CMSG_DATA( header ), sizeof( int ) ) ;
+
+        if( _hello.version != RenderProtocol::version )
+        {
+            close( memory ) ;
+            errno = EPROTO ;
+            fail( "unsupported server version" ) ;
+        }
+
+        return memory ;
+    }
+
+    bool send_all( const void* data, size_t size )
+    {
+        auto bytes = static_cast<const uint8_t*>( data ) ;
+        while( size > 0 )
+        {
+            auto sent = send( _socket, bytes, size, MSG_NOSIGNAL ) ;
+            if( sent < 0 && errno == EINTR )
+                continue ;
+            if( sent <= 0 )
+                return false ;
+
+            bytes += sent ;
+            size -= static_cast<size_t>( sent ) ;
+        }
+        return true ;
+    }
+
+    bool receive_all( void* data, size_t size )
+    {
+        auto bytes = static_cast<uint8_t*>( data ) ;
+        while( size > 0 )
+        {
+            auto received = recv( _socket, bytes, size, 0 ) ;
+            if( received < 0 && errno == EINTR )
+                continue ;
+            if( received <= 0 )
+                return false ;
+
+            bytes += received ;
+            size -= static_cast<size_t>( received ) ;
+        }
+        return true ;
+    }
+} ;
+
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+
+// Wire format between RenderServer and RenderClient, in the byte order of the host they
+// share.
+//
+// On connecting, the server sends a Hello along with a file descriptor, passed with
+// SCM_RIGHTS, of shared memory holding "frame_count" frames of "frame_bytes" each. The
+// client then sends commands, each a CommandHeader followed by "size" bytes of payload,
+// and the server answers every command with one Reply, in order. A client may send a
+// whole batch of commands before reading any of the replies.
+//
+// Rendered frames are written to the shared memory, never sent over the socket: the
+// Reply to a render command gives the slot, a frame of width * height ARGB8888 pixels,
+// row by row from the top, at "slot * frame_bytes". Slots are used in turn, so a frame
+// stays valid until frame_count more renders are requested.
+struct RenderProtocol
+{
+    static constexpr uint32_t version = 1 ;
+
+    // Bigger payloads close the connection
+    static constexpr uint32_t max_payload_bytes = 64 * 1024 * 1024 ;
+
+    enum class Command : uint32_t
+    {
+        load_model      = 1,    // Payload: the .a3db path, not terminated. Reply value: model id
+        set_camera      = 2,    // Payload: a Camera
+        set_instances   = 3,    // Payload: any number of Instances, replacing the previous ones
+        render          = 4,    // No payload. Reply value: the frame's slot
+    } ;
+
+    enum class Status : uint32_t
+    {
+        ok              = 0,
+        unknown_command = 1,
+        bad_payload     = 2,    // Wrong size for the command
+        bad_model       = 3,    // A file that can not be loaded, or an unknown model id
+    } ;
+
+    struct Hello
+    {
+        uint32_t    version ;
+        uint32_t    width ;
+        uint32_t    height ;
+        uint32_t    frame_count ;
+        uint64_t    frame_bytes ;
+    } ;
+
+    struct CommandHeader
+    {
+        Command     command ;
+        uint32_t    size ;
+    } ;
+
+    struct Reply
+    {
+        Status      status ;
+        uint32_t    value ;
+    } ;
+
+    // Positioned and rotated like a ModelInstance
+    struct Camera
+    {
+        float       position[ 3 ] ;
+        float       degrees ;
+        float       axis[ 3 ] ;
+    } ;
+
+    struct Instance
+    {
+        uint32_t    model ;         // As returned by load_model, valid for any client
+        float       position[ 3 ] ;
+        float       scale ;
+        float       degrees ;
+        float       axis[ 3 ] ;
+    } ;
+} ;
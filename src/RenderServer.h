@@ -0,0 +1,394 @@
+#pragma once
+
+#if defined( __linux__ )
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Canvas.h"
+#include "ModelHandle.h"
+#include "ModelInstance.h"
+#include "ModelRegistry.h"
+#include "RenderProtocol.h"
+
+// Renders for other processes, see RenderProtocol.h.
+//
+// Listens on a Unix domain socket and serves any number of clients from one thread, one
+// command at a time, on a single headless canvas. Models stay loaded for as long as the
+// server runs, shared by every client, so a client pays for loading a model only the
+// first time any client asks for it; edited model files are reloaded as usual. Each
+// client has its own camera, instances and shared memory for frames.
+//
+// Client sockets are non-blocking. Replies are queued per client and sent as the
+// client makes room for them, so one that does not read its replies holds up only
+// itself: once its queue is full, its further commands wait until it reads.
+class RenderServer
+{
+    // How often run() checks whether it should stop
+    static constexpr int poll_ms = 100 ;
+
+    // Frames in each client's shared memory
+    static constexpr uint32_t frame_count = 2 ;
+
+    // Past this many bytes of unsent replies, a client's commands are not read
+    static constexpr size_t max_queued_reply_bytes = 64 * 1024 ;
+
+public:
+    // Throws when the socket can not be created
+    RenderServer( const std::string& socket_path, size_t width, size_t height )
+        : _socket_path( socket_path ),
+          _canvas( width, height )
+    {
+        sockaddr_un address {} ;
+        address.sun_family = AF_UNIX ;
+        if( socket_path.size() >= sizeof( address.sun_path ) )
+            throw std::invalid_argument( "socket path too long: " + socket_path ) ;
+
+        std::memcpy( address.sun_path, socket_path.c_str(), socket_path.size() + 1 ) ;
+
+        _listener = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ;
+        if( _listener < 0 )
+            throw std::runtime_error( std::string( "could not create socket: " ) + std::strerror( errno ) ) ;
+
+        // Left behind by a server that did not shut down cleanly
+        unlink( socket_path.c_str() ) ;
+
+        if( bind( _listener, reinterpret_cast<const sockaddr*>( &address ), sizeof( address ) ) < 0
+            || listen( _listener, SOMAXCONN ) < 0 )
+        {
+            auto error = std::string( "could not listen on " ) + socket_path + ": " + std::strerror( errno ) ;
+            close( _listener ) ;
+            throw std::runtime_error( error ) ;
+        }
+
+        _canvas.set_draw_sorting( true ) ;
+    }
+
+    RenderServer( const RenderServer& ) = delete ;
+    RenderServer& operator=( const RenderServer& ) = delete ;
+
+    ~RenderServer()
+    {
+        _clients.clear() ;
+        close( _listener ) ;
+        unlink( _socket_path.c_str() ) ;
+    }
+
+    // Serves clients until stop() is called
+    void run()
+    {
+        std::vector<pollfd> descriptors ;
+        while( ! _stopping )
+        {
+            descriptors.clear() ;
+            descriptors.push_back( { _listener, POLLIN, 0 } ) ;
+            for( auto& client : _clients )
+            {
+                short events = client->output.size() < max_queued_reply_bytes ? POLLIN : 0 ;
+                events |= client->output.empty() ? 0 : POLLOUT ;
+                descriptors.push_back( { client->socket, events, 0 } ) ;
+            }
+
+            if( poll( descriptors.data(), descriptors.size(), poll_ms ) <= 0 )
+                continue ;
+
+            // Clients accepted now have no entry in "descriptors" yet
+            auto polled_count = _clients.size() ;
+            if( descriptors[ 0 ].revents & POLLIN )
+                accept_client() ;
+
+            for( size_t i = polled_count ; i-- > 0 ; )
+            {
+                auto events = descriptors[ i + 1 ].revents ;
+                if( events != 0 && ! serve( *_clients[ i ], events ) )
+                    _clients.erase( _clients.begin() + static_cast<std::ptrdiff_t>( i ) ) ;
+            }
+        }
+    }
+
+    // Makes run() return within poll_ms; safe to call from a signal handler
+    void stop()
+    {
+        _stopping = true ;
+    }
+
+    size_t get_client_count() const
+    {
+        return _clients.size() ;
+    }
+
+private:
+    struct Client
+    {
+        int                         socket = -1 ;
+        void*                       frames = MAP_FAILED ;
+        size_t                      frames_bytes = 0 ;
+        uint32_t                    next_slot = 0 ;
+        std::vector<uint8_t>        input ;         // Received, not yet executed
+        std::vector<uint8_t>        output ;        // Replies not yet sent
+        vec3f                       camera_pos { 0, 0, 0 } ;
+        Mat                         camera_orient = Mat::get_identity_matrix() ;
+        std::vector<ModelInstance>  instances ;
+
+        ~Client()
+        {
+            if( frames != MAP_FAILED )
+                munmap( frames, frames_bytes ) ;
+            if( socket >= 0 )
+                close( socket ) ;
+        }
+    } ;
+
+    static_assert( std::atomic<bool>::is_always_lock_free, "stop() must be async signal safe" ) ;
+
+    const std::string                       _socket_path ;
+    int                                     _listener = -1 ;
+    std::atomic<bool>                       _stopping { false } ;
+    Canvas                                  _canvas ;
+    ModelRegistry                           _registry ;
+    std::vector<ModelHandle>                _models ;       // By id
+    std::unordered_map<std::string, uint32_t> _model_ids ;  // By path as the clients give it
+    std::vector<std::unique_ptr<Client>>    _clients ;
+
+    size_t get_frame_bytes() const
+    {
+        return _canvas.get_width() * _canvas.get_height() * sizeof( Pixel ) ;
+    }
+
+    void accept_client()
+    {
+        auto client = std::make_unique<Client>() ;
+        client->socket = accept4( _listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK ) ;
+        if( client->socket < 0 )
+            return ;
+
+        // The shared memory exists only in this process and the client's mappings
+        auto memory = memfd_create( "rasterizer-frames", MFD_CLOEXEC ) ;
+        if( memory < 0 )
+            return ;
+
+        client->frames_bytes = frame_count * get_frame_bytes() ;
+        if( ftruncate( memory, static_cast<off_t>( client->frames_bytes ) ) == 0 )
+            client->frames = mmap( nullptr, client->frames_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0 ) ;
+
+        RenderProtocol::Hello hello { RenderProtocol::version,
+                                      static_cast<uint32_t>( _canvas.get_width() ),
+                                      static_cast<uint32_t>( _canvas.get_height() ),
+                                      frame_count, get_frame_bytes() } ;
+
+        auto sent = client->frames != MAP_FAILED && send_hello( client->socket, hello, memory ) ;
+        close( memory ) ;
+
+        if( sent )
+            _clients.push_back( std::move( client ) ) ;
+    }
+
+    static bool send_hello( int socket, const RenderProtocol::Hello& hello, int memory )
+    {
+        iovec data { const_cast<RenderProtocol::Hello*>( &hello ), sizeof( hello ) } ;
+
+        alignas( cmsghdr ) char control[ CMSG_SPACE( sizeof( int ) ) ] {} ;
+        msghdr message {} ;
+        message.msg_iov = &data ;
+        message.msg_iovlen = 1 ;
+        message.msg_control = control ;
+        message.msg_controllen = sizeof( control ) ;
+
+        auto header = CMSG_FIRSTHDR( &message ) ;
+        header->cmsg_level = SOL_SOCKET ;
+        header->cmsg_type = SCM_RIGHTS ;
+        header->cmsg_len = CMSG_LEN( sizeof( int ) ) ;
+        std::memcpy( CMSG_DATA( header ), &memory, sizeof( int ) ) ;
+
+        return sendmsg( socket, &message, MSG_NOSIGNAL ) == static_cast<ssize_t>( sizeof( hello ) ) ;
+    }
+
+    // Sends queued replies, reads what the client sent, and executes the complete
+    // commands while its reply queue has room. False when the client is gone or broke
+    // the protocol.
+    bool serve( Client& client, short events )
+    {
+        if( ( events & POLLOUT ) && ! send_replies( client ) )
+            return false ;
+
+        if( events & ( POLLIN | POLLHUP | POLLERR ) )
+        {
+            uint8_t buffer[ 64 * 1024 ] ;
+            auto length = recv( client.socket, buffer, sizeof( buffer ), 0 ) ;
+            if( length == 0 )
+                return false ;
+            if( length < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK )
+                return false ;
+            if( length > 0 )
+                client.input.insert( client.input.end(), buffer, buffer + length ) ;
+        }
+
+        return execute_commands( client ) && send_replies( client ) ;
+    }
+
+    // Executes the complete commands received, queueing their replies, until the queue
+    // is full. False when the client broke the protocol.
+    bool execute_commands( Client& client )
+    {
+        size_t offset = 0 ;
+        RenderProtocol::CommandHeader header ;
+        while( client.input.size() - offset >= sizeof( header ) && client.output.size() < max_queued_reply_bytes )
+        {
+            std::memcpy( &header, client.input.data() + offset, sizeof( header ) ) ;
+            if( header.size > RenderProtocol::max_payload_bytes )
+                return false ;
+
+            if( client.input.size() - offset - sizeof( header ) < header.size )
+                break ;
+
+            auto payload = client.input.data() + offset + sizeof( header ) ;
+            offset += sizeof( header ) + header.size ;
+
+            auto reply = execute( client, header, payload ) ;
+            auto bytes = reinterpret_cast<const uint8_t*>( &reply ) ;
+            client.output.insert( client.output.end(), bytes, bytes + sizeof( reply ) ) ;
+        }
+
+        client.input.erase( client.input.begin(), client.input.begin() + static_cast<std::ptrdiff_t>( offset ) ) ;
+        return true ;
+    }
+
+    // Sends as much of the queued replies as the client has room for, without waiting
+    static bool send_replies( Client& client )
+    {
+        if( client.output.empty() )
+            return true ;
+
+        auto sent = send( client.socket, client.output.data(), client.output.size(), MSG_NOSIGNAL ) ;
+        if( sent < 0 )
+            return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ;
+
+        client.output.erase( client.output.begin(), client.output.begin() + sent ) ;
+        return true ;
+    }
+
+    RenderProtocol::Reply execute( Client& client, const RenderProtocol::CommandHeader& header, const uint8_t* payload )
+    {
+        using Command = RenderProtocol::Command ;
+        using Status  = RenderProtocol::Status ;
+
+        switch( header.command )
+        {
+            case Command::load_model:
+                return load_model( std::string( reinterpret_cast<const char*>( payload ), header.size ) ) ;
+
+            case Command::set_camera:
+            {
+                RenderProtocol::Camera camera ;
+                if( header.size != sizeof( camera ) )
+                    return { Status::bad_payload, 0 } ;
+
+                std::memcpy( &camera, payload, sizeof( camera ) ) ;
+                client.camera_pos = to_vec3f( camera.position ) ;
+                client.camera_orient = Mat::get_rotation_matrix( camera.degrees, get_axis( camera.axis ) ) ;
+                return { Status::ok, 0 } ;
+            }
+
+            case Command::set_instances:
+                return set_instances( client, payload, header.size ) ;
+
+            case Command::render:
+                if( header.size != 0 )
+                    return { Status::bad_payload, 0 } ;
+
+                return { Status::ok, render( client ) } ;
+        }
+
+        return { Status::unknown_command, 0 } ;
+    }
+
+    RenderProtocol::Reply load_model( const std::string& path )
+    {
+        auto found = _model_ids.find( path ) ;
+        if( found != _model_ids.end() )
+            return { RenderProtocol::Status::ok, found->second } ;
+
+        auto model = _registry.load( path ) ;
+        if( ! model )
+            return { RenderProtocol::Status::bad_model, 0 } ;
+
+        auto id = static_cast<uint32_t>( _models.size() ) ;
+        _models.push_back( std::move( model ) ) ;
+        _model_ids.emplace( path, id ) ;
+        return { RenderProtocol::Status::ok, id } ;
+    }
+
+    RenderProtocol::Reply set_instances( Client& client, const uint8_t* payload, uint32_t size )
+    {
+        using Status = RenderProtocol::Status ;
+
+        std::vector<RenderProtocol::Instance> instances( size / sizeof( RenderProtocol::Instance ) ) ;
+        if( size % sizeof( RenderProtocol::Instance ) != 0 )
+            return { Status::bad_payload, 0 } ;
+
+        std::memcpy( instances.data(), payload, size ) ;
+        for( auto& instance : instances )
+        {
+            if( instance.model >= _models.size() )
+                return { Status::bad_model, instance.model } ;
+        }
+
+        client.instances.clear() ;
+        client.instances.reserve( instances.size() ) ;
+        for( auto& instance : instances )
+        {
+            client.instances.emplace_back( _models[ instance.model ], to_vec3f( instance.position ),
+                                           instance.scale, instance.degrees, get_axis( instance.axis ) ) ;
+        }
+
+        return { Status::ok, 0 } ;
+    }
+
+    // Returns the slot the frame went to
+    uint32_t render( Client& client )
+    {
+        _registry.update() ;
+
+        _canvas.set_camera_pos( client.camera_pos ) ;
+        _canvas.set_camera_orient( client.camera_orient ) ;
+
+        _canvas.clear() ;
+        for( auto& instance : client.instances )
+            _canvas.draw_simple_model( instance ) ;
+        _canvas.present() ;
+
+        auto slot = client.next_slot ;
+        client.next_slot = ( slot + 1 ) % frame_count ;
+
+        std::memcpy( static_cast<uint8_t*>( client.frames ) + slot * get_frame_bytes(),
+                     _canvas.get_pixels(), get_frame_bytes() ) ;
+        return slot ;
+    }
+
+    static vec3f to_vec3f( const float ( &values )[ 3 ] )
+    {
+        return { values[ 0 ], values[ 1 ], values[ 2 ] } ;
+    }
+
+    // Any axis will do for no rotation, but get_rotation_matrix() can not normalize 0
+    static vec3f get_axis( const float ( &values )[ 3 ] )
+    {
+        auto axis = to_vec3f( values ) ;
+        return axis.x == 0 && axis.y == 0 && axis.z == 0 ? vec3f { 1, 0, 0 } : axis ;
+    }
+} ;
+
+#endif
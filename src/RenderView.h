@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "Mat.h"
+#include "Vec.h"
+#include "Pixel.h"
+
+// One of several cameras drawn by Canvas::render_views(), with its own color and depth.
+//
+// Uses the canvas projection and stores inverse depth, like the canvas itself. Views can
+// have any size; the field of view stays the same, so a smaller one is a thumbnail.
+class RenderView
+{
+public:
+    RenderView( size_t width, size_t height )
+        : _width( width ),
+          _height( height ),
+          _pixels( width * height ),
+          _depth( width * height, 0.0f ),
+          _camera_transform( Mat::get_identity_matrix() ),
+          _camera_to_world( Mat::get_identity_matrix() )
+    {}
+
+    // Same convention as Canvas::set_camera_pos / set_camera_orient
+    void set_camera( const vec3f& position, const Mat& orientation )
+    {
+        _camera_transform = orientation.transpose() * Mat::get_translation_matrix( -position ) ;
+        _camera_to_world = Mat::get_translation_matrix( position ) * orientation ;
+    }
+
+    // World to camera space
+    const Mat& get_camera_transform() const
+    {
+        return _camera_transform ;
+    }
+
+    const Mat& get_camera_to_world() const
+    {
+        return _camera_to_world ;
+    }
+
+    size_t get_width() const
+    {
+        return _width ;
+    }
+
+    size_t get_height() const
+    {
+        return _height ;
+    }
+
+    void clear()
+    {
+        std::fill( _pixels.begin(), _pixels.end(), Pixel( 0, 0, 0 ) ) ;
+        std::fill( _depth.begin(), _depth.end(), 0.0f ) ;
+    }
+
+    // Row by row from the top
+    const Pixel* get_pixels() const
+    {
+        return _pixels.data() ;
+    }
+
+    Pixel* get_pixels()
+    {
+        return _pixels.data() ;
+    }
+
+    float* get_depth()
+    {
+        return _depth.data() ;
+    }
+
+private:
+    const size_t       _width ;
+    const size_t       _height ;
+    std::vector<Pixel> _pixels ;
+    std::vector<float> _depth ;
+    Mat                _camera_transform ;
+    Mat                _camera_to_world ;
+} ;
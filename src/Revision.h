@@ -0,0 +1,17 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Hands out revision stamps from one global counter, so that no two states of
+// anything that draws share one. Caches compare stamps to detect changes.
+inline uint64_t next_revisions( uint64_t count )
+{
+    static std::atomic<uint64_t> counter{ 0 } ;
+    return counter.fetch_add( count ) + 1 ;
+}
+
+inline uint64_t next_revision()
+{
+    return next_revisions( 1 ) ;
+}
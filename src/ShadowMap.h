@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "Mat.h"
+#include "Vec.h"
+
+// Depth of the scene as seen from a light, filled by Canvas::render_shadow_map().
+//
+// The light looks like a camera: it has a position and an orientation, uses the
+// canvas projection, and stores inverse depth (0 where nothing was drawn).
+class ShadowMap
+{
+public:
+    explicit ShadowMap( size_t size )
+        : _size( size ),
+          _depth( size * size, 0.0f ),
+          _light_transform( Mat::get_identity_matrix() )
+    {}
+
+    // Same convention as Canvas::set_camera_pos / set_camera_orient
+    void set_light( const vec3f& position, const Mat& orientation )
+    {
+        _light_transform = orientation.transpose() * Mat::get_translation_matrix( -position ) ;
+    }
+
+    // World to light space
+    const Mat& get_light_transform() const
+    {
+        return _light_transform ;
+    }
+
+    size_t get_size() const
+    {
+        return _size ;
+    }
+
+    // Surfaces within this fraction of the stored depth count as the occluder itself,
+    // which keeps lit surfaces from shadowing themselves
+    void set_bias( float bias )
+    {
+        _bias = bias ;
+    }
+
+    // How much of a surface's color is left where it is in shadow, from 0 to 1
+    void set_shadow_brightness( float brightness )
+    {
+        _shadow_brightness = std::min( std::max( brightness, 0.0f ), 1.0f ) ;
+    }
+
+    float get_shadow_brightness() const
+    {
+        return _shadow_brightness ;
+    }
+
+    void clear()
+    {
+        std::fill( _depth.begin(), _depth.end(), 0.0f ) ;
+    }
+
+    float* get_depth()
+    {
+        return _depth.data() ;
+    }
+
+    // "pt" is in shadow map buffer coordinates, "inverse_z" is the surface's inverse
+    // depth from the light. Anything the map does not cover is lit.
+    bool is_lit( const vec2i& pt, float inverse_z ) const
+    {
+        if( pt.x < 0 || pt.y < 0 || pt.x >= static_cast<int>( _size ) || pt.y >= static_cast<int>( _size ) )
+            return true ;
+
+        return inverse_z * ( 1.0f + _bias ) >= _depth[ static_cast<size_t>( pt.y ) * _size + static_cast<size_t>( pt.x ) ] ;
+    }
+
+private:
+    const size_t       _size ;
+    std::vector<float> _depth ;
+    Mat                _light_transform ;
+    float              _bias = 0.01f ;
+    float              _shadow_brightness = 0.4f ;
+} ;
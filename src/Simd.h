@@ -0,0 +1,24 @@
+#pragma once
+
+// Picks the vector instruction sets available for the target. Everything that
+// uses intrinsics also has a plain C++ path for targets without them.
+
+#if defined( __AVX__ )
+    #include <immintrin.h>
+    #define RASTERIZER_AVX 1
+#endif
+
+#if defined( __SSE__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 1 )
+    #include <xmmintrin.h>
+    #define RASTERIZER_SSE 1
+#endif
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+    #include <emmintrin.h>
+    #define RASTERIZER_SSE2 1
+#endif
+
+#if defined( __SSSE3__ )
+    #include <tmmintrin.h>
+    #define RASTERIZER_SSSE3 1
+#endif
@@ -0,0 +1,502 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Vec.h"
+#include "Color.h"
+#include "Model.h"
+#include "Canvas.h"
+#include "A3DBModel.h"
+#include "ModelCache.h"
+#include "ModelInstance.h"
+
+// A scene too big to load at once, streamed in around the camera.
+//
+// Scene files are text, one declaration per line; "#" starts a comment:
+//
+//   model    <name> <a3db file> [radius]
+//   instance <model name> <x> <y> <z> [scale [degrees axis_x axis_y axis_z]]
+//
+// Model files are relative to the scene file. "radius" bounds the model, and sizes its
+// placeholder while it is not loaded (1 when left out). Models must be declared before
+// their instances.
+//
+// open() returns as soon as the file is opened; a background thread parses it while
+// frames are drawn. Each update() hands the models near the camera, nearest first, to a
+// pool of loader threads and evicts the least recently used ones once the loaded
+// models exceed the memory budget. Instances whose model is not loaded are skipped or
+// drawn as a box the size of their bounds.
+class StreamingScene
+{
+public:
+    enum class Placeholder
+    {
+        skip,       // Draw nothing until the model is loaded
+        bounds,     // Draw a grey box that fits in the instance's bounds
+    } ;
+
+    explicit StreamingScene( size_t memory_budget_bytes, size_t loader_count = 2 )
+        : _cache( memory_budget_bytes ),
+          _proxy_model( make_proxy_model() )
+    {
+        for( size_t i = 0 ; i < std::max<size_t>( 1, loader_count ) ; ++i )
+            _loaders.emplace_back( [ this ] { load_models() ; } ) ;
+    }
+
+    StreamingScene( const StreamingScene& ) = delete ;
+    StreamingScene& operator=( const StreamingScene& ) = delete ;
+
+    // Abandons parsing and queued loads, then waits for the loads in progress
+    ~StreamingScene()
+    {
+        _stopping = true ;
+        {
+            std::lock_guard<std::mutex> lock( _load_mutex ) ;
+        }
+        _load_requested.notify_all() ;
+
+        if( _parser.joinable() )
+            _parser.join() ;
+
+        for( auto& loader : _loaders )
+            loader.join() ;
+    }
+
+    // Starts parsing "path" in the background. Returns false when it can not be opened
+    // or a scene was already opened.
+    bool open( const std::string& path )
+    {
+        if( _parser.joinable() )
+            return false ;
+
+        auto file = std::make_unique<std::ifstream>( path ) ;
+        if( ! file->good() )
+            return false ;
+
+        auto slash = path.find_last_of( '/' ) ;
+        auto directory = slash == std::string::npos ? std::string() : path.substr( 0, slash + 1 ) ;
+
+        _parser = std::thread( [ this, directory ]( std::unique_ptr<std::ifstream> in_file ) {
+            parse_scene( *in_file, directory ) ; }, std::move( file ) ) ;
+        return true ;
+    }
+
+    // Models with an instance within this distance of the camera are loaded
+    void set_load_distance( float distance )
+    {
+        _load_distance = distance ;
+    }
+
+    void set_placeholder( Placeholder placeholder )
+    {
+        _placeholder = placeholder ;
+    }
+
+    // How models loaded from now on are stored; compact ones take about half the memory,
+    // so about twice as many fit within the budget
+    void set_model_storage( ModelStorage storage )
+    {
+        _model_storage = storage ;
+    }
+
+    // Call once per frame, before draw() and outside clear() ... present(): instances
+    // drawn in the previous frame may be destroyed here.
+    void update( const vec3f& camera_pos )
+    {
+        ++_frame ;
+        take_parsed_declarations() ;
+        take_loaded_models() ;
+        find_wanted_models( camera_pos ) ;
+
+        // Room for the wanted models, going by the size of those loaded so far
+        auto reserve = std::min( _wanted_models.size() * _cache.get_average_bytes(), _cache.get_budget_bytes() ) ;
+        _cache.trim( _frame, reserve, [ this ]( size_t id ) { unload_model( id ) ; } ) ;
+
+        request_wanted_models() ;
+    }
+
+    // Draws every instance whose model is loaded, and placeholders for the others. They
+    // stay alive until the next update().
+    void draw( Canvas& canvas ) const
+    {
+        for( auto& instance : _instances )
+        {
+            if( instance.instance != nullptr )
+                canvas.draw_simple_model( *instance.instance ) ;
+            else if( _placeholder == Placeholder::bounds && instance.proxy != nullptr
+                     && _models[ instance.declaration.model ].state != ModelState::failed )
+                canvas.draw_simple_model( *instance.proxy ) ;
+        }
+    }
+
+    bool is_parsed() const
+    {
+        return _is_parsed.load() ;
+    }
+
+    // Parsing stops at the first malformed line, or at an instance of an undeclared model
+    bool has_parse_error() const
+    {
+        return _has_parse_error.load() ;
+    }
+
+    size_t get_model_count() const
+    {
+        return _models.size() ;
+    }
+
+    size_t get_instance_count() const
+    {
+        return _instances.size() ;
+    }
+
+    size_t get_loaded_model_count() const
+    {
+        return _cache.size() ;
+    }
+
+    size_t get_used_bytes() const
+    {
+        return _cache.get_used_bytes() ;
+    }
+
+private:
+    enum class ModelState
+    {
+        unloaded,
+        requested,  // Queued for, or being loaded by, a loader thread
+        loaded,
+        failed,
+    } ;
+
+    struct ModelDeclaration
+    {
+        std::string path ;
+        float       radius ;
+    } ;
+
+    struct InstanceDeclaration
+    {
+        size_t      model ;
+        vec3f       translation ;
+        float       scale ;
+        float       rotation_angle ;
+        vec3f       rotation_axis ;
+    } ;
+
+    struct SceneModel
+    {
+        ModelDeclaration        declaration ;
+        ModelState              state = ModelState::unloaded ;
+        std::vector<size_t>     instances ;
+    } ;
+
+    struct SceneInstance
+    {
+        InstanceDeclaration             declaration ;
+        std::unique_ptr<ModelInstance>  instance ;  // While the model is loaded
+        std::unique_ptr<ModelInstance>  proxy ;
+    } ;
+
+    struct LoadRequest
+    {
+        size_t      model ;
+        std::string path ;
+    } ;
+
+    // Parsed declarations are handed over in batches of this many lines
+    static constexpr size_t parse_batch_lines = 256 ;
+
+    ModelCache                  _cache ;
+    const Model                 _proxy_model ;
+    std::vector<SceneModel>     _models ;
+    std::vector<SceneInstance>  _instances ;
+    std::vector<float>          _model_distances ;
+    std::vector<size_t>         _wanted_models ;
+    uint64_t                    _frame = 0 ;
+    size_t                      _requested_count = 0 ;  // Models in the requested state
+    float                       _load_distance = 100 ;
+    Placeholder                 _placeholder = Placeholder::bounds ;
+    std::atomic<ModelStorage>   _model_storage { ModelStorage::full } ;  // Read by the loader threads
+    std::atomic<bool>           _stopping { false } ;
+
+    // Shared with the parser thread
+    std::mutex                          _parse_mutex ;
+    std::vector<ModelDeclaration>       _parsed_models ;
+    std::vector<InstanceDeclaration>    _parsed_instances ;
+    std::atomic<bool>                   _is_parsed { false } ;
+    std::atomic<bool>                   _has_parse_error { false } ;
+    std::thread                         _parser ;
+
+    // Shared with the loader threads
+    std::mutex                          _load_mutex ;
+    std::condition_variable             _load_requested ;
+    std::deque<LoadRequest>             _requests ;     // Nearest first
+    std::vector<std::pair<size_t, std::unique_ptr<Model>>> _loaded ;  // Null when loading failed
+    std::vector<std::thread>            _loaders ;
+
+    // Parser thread
+    void parse_scene( std::ifstream& in_file, const std::string& directory )
+    {
+        std::unordered_map<std::string, size_t> model_ids ;
+        std::vector<ModelDeclaration>    models ;
+        std::vector<InstanceDeclaration> instances ;
+        auto ok = true ;
+
+        auto hand_over = [ & ]
+        {
+            std::lock_guard<std::mutex> lock( _parse_mutex ) ;
+            _parsed_models.insert( _parsed_models.end(), models.begin(), models.end() ) ;
+            _parsed_instances.insert( _parsed_instances.end(), instances.begin(), instances.end() ) ;
+            models.clear() ;
+            instances.clear() ;
+        } ;
+
+        std::string line ;
+        for( size_t line_number = 1 ; ok && ! _stopping && std::getline( in_file, line ) ; ++line_number )
+        {
+            std::istringstream words( line.substr( 0, line.find( '#' ) ) ) ;
+            std::string object ;
+            if( ! ( words >> object ) )
+                continue ;
+
+            if( object == "model" )
+            {
+                std::string name, path ;
+                float radius = 1 ;
+                ok = static_cast<bool>( words >> name >> path ) ;
+                if( ok && ! ( words >> radius ) )
+                    radius = 1 ;
+
+                if( ok && model_ids.count( name ) == 0 )
+                {
+                    model_ids[ name ] = model_ids.size() ;
+                    models.push_back( { path.front() == '/' ? path : directory + path, radius } ) ;
+                }
+            }
+            else if( object == "instance" )
+            {
+                std::string name ;
+                InstanceDeclaration instance { 0, { 0, 0, 0 }, 1, 0, { 1, 0, 0 } } ;
+                ok = static_cast<bool>( words >> name
+                    >> instance.translation.x >> instance.translation.y >> instance.translation.z ) ;
+
+                // Read into temporaries, since a failed read zeroes its target
+                float scale, rotation_angle ;
+                if( ok && words >> scale )
+                {
+                    instance.scale = scale ;
+                    if( words >> rotation_angle )
+                    {
+                        instance.rotation_angle = rotation_angle ;
+                        ok = static_cast<bool>( words
+                            >> instance.rotation_axis.x >> instance.rotation_axis.y >> instance.rotation_axis.z ) ;
+                    }
+                }
+
+                auto found = model_ids.find( name ) ;
+                ok = ok && found != model_ids.end() ;
+                if( ok )
+                {
+                    instance.model = found->second ;
+                    instances.push_back( instance ) ;
+                }
+            }
+            else
+            {
+                ok = false ;
+            }
+
+            if( line_number % parse_batch_lines == 0 )
+                hand_over() ;
+        }
+
+        hand_over() ;
+        _has_parse_error = ! ok ;
+        _is_parsed = true ;
+    }
+
+    // Loader threads
+    void load_models()
+    {
+        for( ;; )
+        {
+            LoadRequest request ;
+            {
+                std::unique_lock<std::mutex> lock( _load_mutex ) ;
+                _load_requested.wait( lock, [ this ] { return _stopping || ! _requests.empty() ; } ) ;
+
+                if( _stopping )
+                    return ;
+
+                request = std::move( _requests.front() ) ;
+                _requests.pop_front() ;
+            }
+
+            auto model = A3DBModel::load( request.path, _model_storage ) ;
+
+            std::lock_guard<std::mutex> lock( _load_mutex ) ;
+            _loaded.emplace_back( request.model, std::move( model ) ) ;
+        }
+    }
+
+    void take_parsed_declarations()
+    {
+        std::vector<ModelDeclaration>    models ;
+        std::vector<InstanceDeclaration> instances ;
+        {
+            std::lock_guard<std::mutex> lock( _parse_mutex ) ;
+            models.swap( _parsed_models ) ;
+            instances.swap( _parsed_instances ) ;
+        }
+
+        for( auto& model : models )
+            _models.push_back( { std::move( model ), ModelState::unloaded, {} } ) ;
+
+        for( auto& declaration : instances )
+        {
+            auto& model = _models[ declaration.model ] ;
+            model.instances.push_back( _instances.size() ) ;
+
+            // Cube corners are sqrt( 3 ) from its center
+            auto proxy_scale = declaration.scale * model.declaration.radius / std::sqrt( 3.0f ) ;
+            _instances.push_back( { declaration, nullptr, std::make_unique<ModelInstance>( _proxy_model,
+                declaration.translation, proxy_scale, declaration.rotation_angle, declaration.rotation_axis ) } ) ;
+        }
+    }
+
+    void take_loaded_models()
+    {
+        std::vector<std::pair<size_t, std::unique_ptr<Model>>> loaded ;
+        {
+            std::lock_guard<std::mutex> lock( _load_mutex ) ;
+            loaded.swap( _loaded ) ;
+        }
+
+        for( auto& result : loaded )
+        {
+            auto& model = _models[ result.first ] ;
+            --_requested_count ;
+            if( result.second == nullptr )
+            {
+                model.state = ModelState::failed ;
+                continue ;
+            }
+
+            auto resident = _cache.insert( result.first, std::move( result.second ), _frame ) ;
+            model.state = ModelState::loaded ;
+
+            for( auto index : model.instances )
+            {
+                auto& instance = _instances[ index ] ;
+                instance.instance = std::make_unique<ModelInstance>( *resident,
+                    instance.declaration.translation, instance.declaration.scale,
+                    instance.declaration.rotation_angle, instance.declaration.rotation_axis ) ;
+            }
+        }
+    }
+
+    // Marks the loaded models near the camera as used and lists the missing ones,
+    // nearest first. Requests no loader has taken yet are withdrawn and listed again.
+    void find_wanted_models( const vec3f& camera_pos )
+    {
+        {
+            std::lock_guard<std::mutex> lock( _load_mutex ) ;
+            for( auto& request : _requests )
+                _models[ request.model ].state = ModelState::unloaded ;
+            _requested_count -= _requests.size() ;
+            _requests.clear() ;
+        }
+
+        _model_distances.assign( _models.size(), _load_distance + 1 ) ;
+        for( auto& instance : _instances )
+        {
+            const auto& declaration = instance.declaration ;
+            auto offset = declaration.translation - camera_pos ;
+            auto distance = std::sqrt( compute_dot_product( offset, offset ) )
+                - declaration.scale * _models[ declaration.model ].declaration.radius ;
+
+            auto& nearest = _model_distances[ declaration.model ] ;
+            nearest = std::min( nearest, distance ) ;
+        }
+
+        _wanted_models.clear() ;
+        for( size_t id = 0 ; id < _models.size() ; ++id )
+        {
+            if( _model_distances[ id ] > _load_distance )
+                continue ;
+
+            if( _models[ id ].state == ModelState::loaded )
+                _cache.find( id, _frame ) ;
+            else if( _models[ id ].state == ModelState::unloaded )
+                _wanted_models.push_back( id ) ;
+        }
+
+        std::sort( _wanted_models.begin(), _wanted_models.end(), [ this ]( size_t a, size_t b ) {
+            return _model_distances[ a ] < _model_distances[ b ] ; } ) ;
+    }
+
+    void request_wanted_models()
+    {
+        {
+            std::lock_guard<std::mutex> lock( _load_mutex ) ;
+            auto limit = get_request_limit() ;
+            for( size_t i = 0 ; i < _wanted_models.size() && i < limit ; ++i )
+            {
+                auto id = _wanted_models[ i ] ;
+                _models[ id ].state = ModelState::requested ;
+                _requests.push_back( { id, _models[ id ].declaration.path } ) ;
+            }
+            _requested_count += _requests.size() ;
+        }
+        _load_requested.notify_all() ;
+    }
+
+    // How many more models to queue: about as many as fit in what is left of the budget,
+    // going by the size of the models loaded so far, less those already being loaded.
+    // Models that would only be evicted again right away are not loaded.
+    size_t get_request_limit() const
+    {
+        if( _cache.size() == 0 )
+            return _loaders.size() > _requested_count ? _loaders.size() - _requested_count : 0 ;
+
+        auto left = _cache.get_budget_bytes() - std::min( _cache.get_used_bytes(), _cache.get_budget_bytes() ) ;
+        auto fitting = left / std::max<size_t>( 1, _cache.get_average_bytes() ) ;
+        return fitting > _requested_count ? fitting - _requested_count : 0 ;
+    }
+
+    void unload_model( size_t id )
+    {
+        auto& model = _models[ id ] ;
+        model.state = ModelState::unloaded ;
+        for( auto index : model.instances )
+            _instances[ index ].instance.reset() ;
+    }
+
+    // Same shape as Cube.a3db, in grey
+    static Model make_proxy_model()
+    {
+        auto grey = Color::custom( 128, 128, 128 ) ;
+        return Model {
+            { {  1,  1,  1 }, { -1,  1,  1 }, { -1, -1,  1 }, {  1, -1,  1 },
+              {  1,  1, -1 }, { -1,  1, -1 }, { -1, -1, -1 }, {  1, -1, -1 } },
+            { { { 0, 2, 1 }, grey }, { { 0, 3, 2 }, grey }, { { 4, 3, 0 }, grey },
+              { { 4, 7, 3 }, grey }, { { 5, 7, 4 }, grey }, { { 5, 6, 7 }, grey },
+              { { 1, 6, 5 }, grey }, { { 1, 2, 6 }, grey }, { { 4, 1, 5 }, grey },
+              { { 4, 0, 1 }, grey }, { { 2, 7, 6 }, grey }, { { 2, 3, 7 }, grey } } } ;
+    }
+} ;
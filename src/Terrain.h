@@ -0,0 +1,617 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "Vec.h"
+#include "Misc.h"
+#include "Color.h"
+#include "Model.h"
+#include "Canvas.h"
+#include "ModelCache.h"
+#include "ModelInstance.h"
+
+// A heightmap drawn as a quadtree of chunks, each a grid of chunk_quads x chunk_quads
+// quads, so that only the chunks in view are drawn and far ones have fewer triangles.
+//
+// Chunks at level 0 use every height sample; each level up covers four times the area
+// with every other sample. update() picks, for each part of the map, the coarsest level
+// whose height error is within the error tolerance at its distance from the camera, then
+// refines chunks until neighbors are at most one level apart. Along an edge shared with a
+// coarser neighbor, a chunk folds its odd vertices into the even ones before them, so both
+// sides have the same vertices there and no cracks open.
+//
+// Chunk meshes are built by a pool of loader threads when first needed and kept in a
+// ModelCache, which evicts the least recently used ones beyond the memory budget. The
+// chunks drawn only change once every mesh of a new selection is loaded, so nothing is
+// drawn until the first one is. draw() culls whole subtrees against the canvas frustum.
+class Terrain
+{
+public:
+    // Quads along each side of a chunk; a power of two
+    static constexpr uint32_t chunk_quads = 32 ;
+
+    // "heights" holds width x depth samples, row by row: the sample at x, z is at world
+    // position ( x * spacing, heights[ z * width + x ], z * spacing )
+    Terrain( std::vector<float> heights, size_t width, size_t depth, float spacing,
+             size_t memory_budget_bytes, size_t loader_count = 2 )
+        : _heights( std::move( heights ) ),
+          _width( static_cast<uint32_t>( width ) ),
+          _depth( static_cast<uint32_t>( depth ) ),
+          _spacing( spacing ),
+          _cache( memory_budget_bytes )
+    {
+        build_nodes() ;
+
+        for( size_t i = 0 ; i < std::max<size_t>( 1, loader_count ) ; ++i )
+            _loaders.emplace_back( [ this ] { load_chunks() ; } ) ;
+    }
+
+    Terrain( const Terrain& ) = delete ;
+    Terrain& operator=( const Terrain& ) = delete ;
+
+    // Abandons queued meshes, then waits for those being built
+    ~Terrain()
+    {
+        _stopping = true ;
+        {
+            std::lock_guard<std::mutex> lock( _load_mutex ) ;
+        }
+        _load_requested.notify_all() ;
+
+        for( auto& loader : _loaders )
+            loader.join() ;
+    }
+
+    // Chunks are refined until their height error over their distance from the camera is
+    // at most this. Times the canvas width, it is the error in pixels, since the view is
+    // one unit wide at a distance of one.
+    void set_error_tolerance( float tolerance )
+    {
+        _error_tolerance = tolerance ;
+    }
+
+    // Call once per frame, before draw() and outside clear() ... present(): chunks drawn
+    // in the previous frame may be destroyed here.
+    void update( const vec3f& camera_pos )
+    {
+        ++_frame ;
+        take_loaded_chunks() ;
+
+        select_chunks( camera_pos ) ;
+        balance_chunks() ;
+
+        // The chunks drawn now stay loaded until the new ones are
+        for( auto& drawn : _drawn_chunks )
+            _cache.find( drawn.second.key, _frame ) ;
+
+        _wanted_chunks.clear() ;
+        for( auto& chunk : _selected_chunks )
+        {
+            chunk.mask = get_stitch_mask( chunk ) ;
+            if( _cache.find( get_key( chunk ), _frame ) == nullptr )
+                _wanted_chunks.push_back( chunk ) ;
+        }
+
+        if( _wanted_chunks.empty() )
+            show_selected_chunks() ;
+
+        _cache.trim( _frame, 0, []( size_t ) {} ) ;
+        request_wanted_chunks( camera_pos ) ;
+    }
+
+    // Draws the chunks in view. They stay alive until the next update().
+    void draw( Canvas& canvas ) const
+    {
+        if( ! _drawn_chunks.empty() )
+            draw_node( canvas, _level_count - 1, 0, 0 ) ;
+    }
+
+    // Whether the chunks drawn are the ones the last update() selected
+    bool is_current() const
+    {
+        return _wanted_chunks.empty() ;
+    }
+
+    size_t get_chunk_count() const
+    {
+        return _drawn_chunks.size() ;
+    }
+
+    size_t get_loaded_chunk_count() const
+    {
+        return _cache.size() ;
+    }
+
+    size_t get_used_bytes() const
+    {
+        return _cache.get_used_bytes() ;
+    }
+
+private:
+    // Sides of a chunk, as bits of its stitch mask
+    static constexpr uint8_t low_x_side  = 1 ;
+    static constexpr uint8_t high_x_side = 2 ;
+    static constexpr uint8_t low_z_side  = 4 ;
+    static constexpr uint8_t high_z_side = 8 ;
+
+    // Level of the cells no chunk covers, past the edges of the map
+    static constexpr uint8_t no_level = 255 ;
+
+    enum class NodeState : uint8_t
+    {
+        none,
+        inner,      // Drawn through its children
+        leaf,       // Drawn itself
+    } ;
+
+    struct Node
+    {
+        float min_height ;
+        float max_height ;
+        float error ;           // Largest height difference to the samples it covers
+    } ;
+
+    struct Chunk
+    {
+        uint32_t level ;
+        uint32_t x ;            // In chunks of its level
+        uint32_t z ;
+        uint8_t  mask ;         // Sides folded to match a coarser neighbor
+    } ;
+
+    struct DrawnChunk
+    {
+        size_t                          key ;
+        std::unique_ptr<ModelInstance>  instance ;
+    } ;
+
+    const std::vector<float>    _heights ;
+    const uint32_t              _width ;
+    const uint32_t              _depth ;
+    const float                 _spacing ;
+    uint32_t                    _level_count = 0 ;
+    std::vector<uint32_t>       _level_sizes ;      // Chunks along each side, per level
+    std::vector<uint32_t>       _level_offsets ;    // Into _nodes, per level
+    std::vector<Node>           _nodes ;
+    float                       _error_tolerance = 0.002f ;
+
+    ModelCache                  _cache ;
+    uint64_t                    _frame = 0 ;
+    std::vector<Chunk>          _selected_chunks ;
+    std::vector<Chunk>          _wanted_chunks ;    // Selected, but not loaded yet
+    std::vector<uint8_t>        _cell_levels ;      // Level of the selected chunk over each level 0 cell
+    std::vector<NodeState>      _drawn_states ;
+    std::unordered_map<uint32_t, DrawnChunk> _drawn_chunks ;   // By node
+    std::unordered_set<size_t>  _requested ;        // Queued for, or being built by, a loader thread
+    std::atomic<bool>           _stopping { false } ;
+
+    // Shared with the loader threads
+    std::mutex                          _load_mutex ;
+    std::condition_variable             _load_requested ;
+    std::deque<Chunk>                   _requests ;     // Nearest first
+    std::vector<std::pair<size_t, std::unique_ptr<Model>>> _loaded ;
+    std::vector<std::thread>            _loaders ;
+
+    float get_height( uint32_t x, uint32_t z ) const
+    {
+        return _heights[ static_cast<size_t>( z ) * _width + x ] ;
+    }
+
+    uint32_t get_node( uint32_t level, uint32_t x, uint32_t z ) const
+    {
+        return _level_offsets[ level ] + z * _level_sizes[ level ] + x ;
+    }
+
+    // Cache key of a chunk's mesh
+    size_t get_key( const Chunk& chunk ) const
+    {
+        return static_cast<size_t>( get_node( chunk.level, chunk.x, chunk.z ) ) * 16 + chunk.mask ;
+    }
+
+    // Whether any of the chunk is on the map
+    bool is_on_map( uint32_t level, uint32_t x, uint32_t z ) const
+    {
+        auto samples = chunk_quads << level ;
+        return x * samples < _width - 1 && z * samples < _depth - 1 ;
+    }
+
+    // The chunk's box in world space
+    void get_bounds( uint32_t level, uint32_t x, uint32_t z, vec3f& min, vec3f& max ) const
+    {
+        auto samples = chunk_quads << level ;
+        const auto& node = _nodes[ get_node( level, x, z ) ] ;
+        min = { static_cast<float>( x * samples ) * _spacing, node.min_height, static_cast<float>( z * samples ) * _spacing } ;
+        max = { static_cast<float>( std::min( ( x + 1 ) * samples, _width - 1 ) ) * _spacing, node.max_height,
+                static_cast<float>( std::min( ( z + 1 ) * samples, _depth - 1 ) ) * _spacing } ;
+    }
+
+    // Lays out the quadtree and finds each node's height range and error, bottom up
+    void build_nodes()
+    {
+        uint32_t size = 1 ;
+        _level_count = 1 ;
+        while( size * chunk_quads < std::max( _width, _depth ) - 1 )
+        {
+            size *= 2 ;
+            ++_level_count ;
+        }
+
+        uint32_t offset = 0 ;
+        for( uint32_t level = 0 ; level < _level_count ; ++level )
+        {
+            _level_sizes.push_back( size >> level ) ;
+            _level_offsets.push_back( offset ) ;
+            offset += ( size >> level ) * ( size >> level ) ;
+        }
+        _nodes.assign( offset, { 0, 0, 0 } ) ;
+
+        for( uint32_t level = 0 ; level < _level_count ; ++level )
+        for( uint32_t z = 0 ; z < _level_sizes[ level ] ; ++z )
+        for( uint32_t x = 0 ; x < _level_sizes[ level ] ; ++x )
+        {
+            if( is_on_map( level, x, z ) )
+                _nodes[ get_node( level, x, z ) ] = measure_node( level, x, z ) ;
+        }
+    }
+
+    // How far the chunk's mesh strays from the samples under it, and from those its
+    // children strayed from, so errors never shrink going up the tree
+    Node measure_node( uint32_t level, uint32_t x, uint32_t z ) const
+    {
+        auto step = 1u << level ;
+        auto x0 = x * chunk_quads * step ;
+        auto z0 = z * chunk_quads * step ;
+        auto x_end = std::min( x0 + chunk_quads * step, _width - 1 ) ;
+        auto z_end = std::min( z0 + chunk_quads * step, _depth - 1 ) ;
+
+        Node node { get_height( x0, z0 ), get_height( x0, z0 ), 0 } ;
+        for( auto cell_z = z0 ; cell_z < z_end ; cell_z += step )
+        for( auto cell_x = x0 ; cell_x < x_end ; cell_x += step )
+        {
+            auto next_x = std::min( cell_x + step, x_end ) ;
+            auto next_z = std::min( cell_z + step, z_end ) ;
+            auto h00 = get_height( cell_x, cell_z ) ;
+            auto h10 = get_height( next_x, cell_z ) ;
+            auto h01 = get_height( cell_x, next_z ) ;
+            auto h11 = get_height( next_x, next_z ) ;
+
+            for( auto sample_z = cell_z ; sample_z <= next_z ; ++sample_z )
+            for( auto sample_x = cell_x ; sample_x <= next_x ; ++sample_x )
+            {
+                auto height = get_height( sample_x, sample_z ) ;
+                node.min_height = std::min( node.min_height, height ) ;
+                node.max_height = std::max( node.max_height, height ) ;
+
+                // Split along the diagonal from ( cell_x, cell_z ), like the mesh
+                auto u = static_cast<float>( sample_x - cell_x ) / static_cast<float>( next_x - cell_x ) ;
+                auto v = static_cast<float>( sample_z - cell_z ) / static_cast<float>( next_z - cell_z ) ;
+                auto mesh_height = u >= v ? h00 + u * ( h10 - h00 ) + v * ( h11 - h10 )
+                                          : h00 + v * ( h01 - h00 ) + u * ( h11 - h01 ) ;
+                node.error = std::max( node.error, std::abs( height - mesh_height ) ) ;
+            }
+        }
+
+        if( level > 0 )
+        {
+            for( uint32_t child = 0 ; child < 4 ; ++child )
+            {
+                auto child_x = x * 2 + ( child & 1 ) ;
+                auto child_z = z * 2 + ( child >> 1 ) ;
+                if( is_on_map( level - 1, child_x, child_z ) )
+                    node.error = std::max( node.error, _nodes[ get_node( level - 1, child_x, child_z ) ].error ) ;
+            }
+        }
+        return node ;
+    }
+
+    // The coarsest chunks within the error tolerance, regardless of their neighbors
+    void select_chunks( const vec3f& camera_pos )
+    {
+        _selected_chunks.clear() ;
+        select_node( camera_pos, _level_count - 1, 0, 0 ) ;
+    }
+
+    void select_node( const vec3f& camera_pos, uint32_t level, uint32_t x, uint32_t z )
+    {
+        if( ! is_on_map( level, x, z ) )
+            return ;
+
+        vec3f min, max ;
+        get_bounds( level, x, z, min, max ) ;
+        vec3f offset { std::max( { min.x - camera_pos.x, 0.0f, camera_pos.x - max.x } ),
+                       std::max( { min.y - camera_pos.y, 0.0f, camera_pos.y - max.y } ),
+                       std::max( { min.z - camera_pos.z, 0.0f, camera_pos.z - max.z } ) } ;
+        auto distance = std::sqrt( compute_dot_product( offset, offset ) ) ;
+
+        if( level == 0 || _nodes[ get_node( level, x, z ) ].error <= _error_tolerance * distance )
+        {
+            _selected_chunks.push_back( { level, x, z, 0 } ) ;
+            return ;
+        }
+
+        for( uint32_t child = 0 ; child < 4 ; ++child )
+            select_node( camera_pos, level - 1, x * 2 + ( child & 1 ), z * 2 + ( child >> 1 ) ) ;
+    }
+
+    // Splits chunks next to ones more than a level finer, until there are none
+    void balance_chunks()
+    {
+        auto cells = _level_sizes[ 0 ] ;
+        _cell_levels.assign( static_cast<size_t>( cells ) * cells, no_level ) ;
+        for( auto& chunk : _selected_chunks )
+            set_cell_levels( chunk ) ;
+
+        std::vector<Chunk> balanced ;
+        for( auto split = true ; split ; )
+        {
+            split = false ;
+            balanced.clear() ;
+            for( auto& chunk : _selected_chunks )
+            {
+                if( chunk.level < 2 || get_finest_neighbor( chunk ) + 1 >= chunk.level )
+                {
+                    balanced.push_back( chunk ) ;
+                    continue ;
+                }
+
+                for( uint32_t child = 0 ; child < 4 ; ++child )
+                {
+                    Chunk refined { chunk.level - 1, chunk.x * 2 + ( child & 1 ), chunk.z * 2 + ( child >> 1 ), 0 } ;
+                    if( is_on_map( refined.level, refined.x, refined.z ) )
+                    {
+                        set_cell_levels( refined ) ;
+                        balanced.push_back( refined ) ;
+                    }
+                }
+                split = true ;
+            }
+            _selected_chunks.swap( balanced ) ;
+        }
+    }
+
+    void set_cell_levels( const Chunk& chunk )
+    {
+        auto cells = _level_sizes[ 0 ] ;
+        auto span = 1u << chunk.level ;
+        for( auto z = chunk.z * span ; z < ( chunk.z + 1 ) * span ; ++z )
+            std::fill_n( _cell_levels.begin() + z * cells + chunk.x * span, span, static_cast<uint8_t>( chunk.level ) ) ;
+    }
+
+    // Lowest level among the chunks along the chunk's sides
+    uint32_t get_finest_neighbor( const Chunk& chunk ) const
+    {
+        auto cells = _level_sizes[ 0 ] ;
+        auto span = 1u << chunk.level ;
+        auto x0 = chunk.x * span ;
+        auto z0 = chunk.z * span ;
+
+        uint32_t finest = no_level ;
+        for( uint32_t i = 0 ; i < span ; ++i )
+        {
+            if( x0 > 0 )
+                finest = std::min<uint32_t>( finest, _cell_levels[ ( z0 + i ) * cells + x0 - 1 ] ) ;
+            if( x0 + span < cells )
+                finest = std::min<uint32_t>( finest, _cell_levels[ ( z0 + i ) * cells + x0 + span ] ) ;
+            if( z0 > 0 )
+                finest = std::min<uint32_t>( finest, _cell_levels[ ( z0 - 1 ) * cells + x0 + i ] ) ;
+            if( z0 + span < cells )
+                finest = std::min<uint32_t>( finest, _cell_levels[ ( z0 + span ) * cells + x0 + i ] ) ;
+        }
+        return finest ;
+    }
+
+    // The sides along which the neighbor is a level coarser, and covers the whole side
+    uint8_t get_stitch_mask( const Chunk& chunk ) const
+    {
+        auto cells = _level_sizes[ 0 ] ;
+        auto span = 1u << chunk.level ;
+        auto x0 = chunk.x * span ;
+        auto z0 = chunk.z * span ;
+        auto coarser = chunk.level + 1 ;
+
+        uint8_t mask = 0 ;
+        if( x0 > 0 && _cell_levels[ z0 * cells + x0 - 1 ] == coarser )
+            mask |= low_x_side ;
+        if( x0 + span < cells && _cell_levels[ z0 * cells + x0 + span ] == coarser )
+            mask |= high_x_side ;
+        if( z0 > 0 && _cell_levels[ ( z0 - 1 ) * cells + x0 ] == coarser )
+            mask |= low_z_side ;
+        if( z0 + span < cells && _cell_levels[ ( z0 + span ) * cells + x0 ] == coarser )
+            mask |= high_z_side ;
+        return mask ;
+    }
+
+    // Switches to the selected chunks, keeping the instances of those already drawn so
+    // the canvas can reuse their geometry
+    void show_selected_chunks()
+    {
+        _drawn_states.assign( _nodes.size(), NodeState::none ) ;
+
+        std::unordered_map<uint32_t, DrawnChunk> drawn ;
+        for( auto& chunk : _selected_chunks )
+        {
+            auto node = get_node( chunk.level, chunk.x, chunk.z ) ;
+            auto key = get_key( chunk ) ;
+            auto found = _drawn_chunks.find( node ) ;
+            if( found != _drawn_chunks.end() && found->second.key == key )
+                drawn[ node ] = std::move( found->second ) ;
+            else
+                drawn[ node ] = { key, std::make_unique<ModelInstance>( *_cache.find( key, _frame ) ) } ;
+
+            _drawn_states[ node ] = NodeState::leaf ;
+            for( auto level = chunk.level + 1 ; level < _level_count ; ++level )
+            {
+                auto shift = level - chunk.level ;
+                _drawn_states[ get_node( level, chunk.x >> shift, chunk.z >> shift ) ] = NodeState::inner ;
+            }
+        }
+        _drawn_chunks.swap( drawn ) ;
+    }
+
+    void draw_node( Canvas& canvas, uint32_t level, uint32_t x, uint32_t z ) const
+    {
+        auto node = get_node( level, x, z ) ;
+        auto state = _drawn_states[ node ] ;
+        if( state == NodeState::none )
+            return ;
+
+        vec3f min, max ;
+        get_bounds( level, x, z, min, max ) ;
+        auto half_size = 0.5f * ( max - min ) ;
+        if( ! canvas.is_sphere_visible( min + half_size, std::sqrt( compute_dot_product( half_size, half_size ) ) ) )
+            return ;
+
+        if( state == NodeState::leaf )
+        {
+            canvas.draw_simple_model( *_drawn_chunks.at( node ).instance ) ;
+            return ;
+        }
+
+        for( uint32_t child = 0 ; child < 4 ; ++child )
+            draw_node( canvas, level - 1, x * 2 + ( child & 1 ), z * 2 + ( child >> 1 ) ) ;
+    }
+
+    // Queues the wanted chunks, nearest first, replacing what no loader has taken yet
+    void request_wanted_chunks( const vec3f& camera_pos )
+    {
+        auto get_distance = [ this, &camera_pos ]( const Chunk& chunk ) {
+            vec3f min, max ;
+            get_bounds( chunk.level, chunk.x, chunk.z, min, max ) ;
+            auto offset = min + 0.5f * ( max - min ) - camera_pos ;
+            return compute_dot_product( offset, offset ) ; } ;
+
+        std::sort( _wanted_chunks.begin(), _wanted_chunks.end(), [ & ]( const Chunk& a, const Chunk& b ) {
+            return get_distance( a ) < get_distance( b ) ; } ) ;
+
+        {
+            std::lock_guard<std::mutex> lock( _load_mutex ) ;
+            for( auto& request : _requests )
+                _requested.erase( get_key( request ) ) ;
+            _requests.clear() ;
+
+            for( auto& chunk : _wanted_chunks )
+            {
+                if( _requested.insert( get_key( chunk ) ).second )
+                    _requests.push_back( chunk ) ;
+            }
+        }
+        _load_requested.notify_all() ;
+    }
+
+    void take_loaded_chunks()
+    {
+        std::vector<std::pair<size_t, std::unique_ptr<Model>>> loaded ;
+        {
+            std::lock_guard<std::mutex> lock( _load_mutex ) ;
+            loaded.swap( _loaded ) ;
+        }
+
+        for( auto& result : loaded )
+        {
+            _requested.erase( result.first ) ;
+            if( ! _cache.contains( result.first ) )
+                _cache.insert( result.first, std::move( result.second ), _frame ) ;
+        }
+    }
+
+    // Loader threads
+    void load_chunks()
+    {
+        for( ;; )
+        {
+            Chunk chunk ;
+            {
+                std::unique_lock<std::mutex> lock( _load_mutex ) ;
+                _load_requested.wait( lock, [ this ] { return _stopping || ! _requests.empty() ; } ) ;
+
+                if( _stopping )
+                    return ;
+
+                chunk = _requests.front() ;
+                _requests.pop_front() ;
+            }
+
+            auto model = build_chunk( chunk ) ;
+
+            std::lock_guard<std::mutex> lock( _load_mutex ) ;
+            _loaded.emplace_back( get_key( chunk ), std::move( model ) ) ;
+        }
+    }
+
+    // The chunk's mesh, in world space. Quads past the edges of the map are left out,
+    // and the last ones before them are narrower.
+    std::unique_ptr<Model> build_chunk( const Chunk& chunk ) const
+    {
+        auto step = 1u << chunk.level ;
+        auto x0 = chunk.x * chunk_quads * step ;
+        auto z0 = chunk.z * chunk_quads * step ;
+        auto row = chunk_quads + 1 ;
+
+        std::vector<vec3f> verticies ;
+        verticies.reserve( row * row ) ;
+        for( uint32_t j = 0 ; j <= chunk_quads ; ++j )
+        for( uint32_t i = 0 ; i <= chunk_quads ; ++i )
+        {
+            auto x = std::min( x0 + i * step, _width - 1 ) ;
+            auto z = std::min( z0 + j * step, _depth - 1 ) ;
+            verticies.push_back( { static_cast<float>( x ) * _spacing, get_height( x, z ), static_cast<float>( z ) * _spacing } ) ;
+        }
+
+        // Odd vertices along a folded side are replaced by the even one before them,
+        // unless they sit on the edge of the map, where the coarser neighbor also has one
+        auto get_index = [ & ]( uint32_t i, uint32_t j ) {
+            if( ( ( i == 0 && chunk.mask & low_x_side ) || ( i == chunk_quads && chunk.mask & high_x_side ) )
+                && j % 2 == 1 && z0 + j * step < _depth - 1 )
+                --j ;
+            if( ( ( j == 0 && chunk.mask & low_z_side ) || ( j == chunk_quads && chunk.mask & high_z_side ) )
+                && i % 2 == 1 && x0 + i * step < _width - 1 )
+                --i ;
+            return static_cast<int>( j * row + i ) ; } ;
+
+        std::vector<Triangle> triangles ;
+        triangles.reserve( 2 * chunk_quads * chunk_quads ) ;
+        auto add_triangle = [ & ]( int a, int b, int c ) {
+            if( a != b && b != c && c != a )
+                triangles.push_back( { { a, b, c }, get_color( verticies[ a ], verticies[ b ], verticies[ c ] ) } ) ; } ;
+
+        for( uint32_t j = 0 ; j < chunk_quads && z0 + j * step < _depth - 1 ; ++j )
+        for( uint32_t i = 0 ; i < chunk_quads && x0 + i * step < _width - 1 ; ++i )
+        {
+            auto a = get_index( i, j ) ;
+            auto b = get_index( i + 1, j ) ;
+            auto c = get_index( i + 1, j + 1 ) ;
+            auto d = get_index( i, j + 1 ) ;
+            add_triangle( a, b, c ) ;
+            add_triangle( a, c, d ) ;
+        }
+
+        return std::make_unique<Model>( std::move( verticies ), std::move( triangles ) ) ;
+    }
+
+    // Grass on gentle slopes, rock on steep ones, lit from above
+    static Color get_color( const vec3f& v0, const vec3f& v1, const vec3f& v2 )
+    {
+        auto normal = compute_cross_product( v2 - v0, v1 - v0 ) ;
+        auto length = std::sqrt( compute_dot_product( normal, normal ) ) ;
+        auto up = normal.y / length ;
+
+        vec3f light { -0.4f, 0.8f, -0.45f } ;
+        auto shade = 0.35f + 0.65f * std::max( 0.0f, compute_dot_product( normal, light ) / length ) ;
+        auto base = up > 0.8f ? vec3f { 96, 140, 64 } : vec3f { 128, 120, 110 } ;
+        return Color::custom( static_cast<uint8_t>( base.x * shade ),
+                              static_cast<uint8_t>( base.y * shade ),
+                              static_cast<uint8_t>( base.z * shade ) ) ;
+    }
+} ;
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Mat.h"
+#include "Vec.h"
+#include "Simd.h"
+#include "JobSystem.h"
+#include "Revision.h"
+
+// Transforms for large numbers of animated objects, stored as structure of arrays.
+//
+// Unlike ModelInstance, setters only write the new value and flag the entity; the
+// world matrices of all flagged entities are rebuilt together by update(), four at a
+// time with SSE and split across the threads of a JobSystem. Rotations are unit quaternions, so there is
+// no trigonometry in the update either.
+class TransformStore
+{
+    // Entities are processed in blocks of this many; the arrays are padded to match
+    static constexpr size_t block_size = 4 ;
+
+    // Each update() job covers this many entities; a multiple of block_size. Stores
+    // that fit in one job update on the calling thread.
+    static constexpr size_t entities_per_job = 4096 ;
+
+public:
+    using entity = uint32_t ;
+
+    entity create( const vec3f& position = { 0, 0, 0 }, float scale = 1,
+                   float rotation_angle = 0, const vec3f& rotation_axis = { 1, 0, 0 } )
+    {
+        auto id = static_cast<entity>( _count++ ) ;
+
+        if( _count > _scales.size() )
+            grow( _scales.size() + block_size ) ;
+
+        set_position( id, position ) ;
+        set_scale( id, scale ) ;
+        set_rotation( id, rotation_angle, rotation_axis ) ;
+        return id ;
+    }
+
+    size_t size() const
+    {
+        return _count ;
+    }
+
+    void set_position( entity id, const vec3f& position )
+    {
+        _position_x[ id ] = position.x ;
+        _position_y[ id ] = position.y ;
+        _position_z[ id ] = position.z ;
+        mark_dirty( id ) ;
+    }
+
+    vec3f get_position( entity id ) const
+    {
+        return { _position_x[ id ], _position_y[ id ], _position_z[ id ] } ;
+    }
+
+    void set_scale( entity id, float scale )
+    {
+        _scales[ id ] = scale ;
+        mark_dirty( id ) ;
+    }
+
+    float get_scale( entity id ) const
+    {
+        return _scales[ id ] ;
+    }
+
+    // Same convention as Mat::get_rotation_matrix
+    void set_rotation( entity id, float degrees, const vec3f& axis )
+    {
+        auto half_angle = degrees * pi / 360.0f ;
+        auto sin = std::sin( half_angle ) ;
+        auto u = compute_normalized( axis ) ;
+        set_rotation( id, { u.x * sin, u.y * sin, u.z * sin, std::cos( half_angle ) } ) ;
+    }
+
+    // "quaternion" must be unit length, with the scalar part in w
+    void set_rotation( entity id, const vec4f& quaternion )
+    {
+        _rotation_x[ id ] = quaternion.x ;
+        _rotation_y[ id ] = quaternion.y ;
+        _rotation_z[ id ] = quaternion.z ;
+        _rotation_w[ id ] = quaternion.w ;
+        mark_dirty( id ) ;
+    }
+
+    vec4f get_rotation( entity id ) const
+    {
+        return { _rotation_x[ id ], _rotation_y[ id ], _rotation_z[ id ], _rotation_w[ id ] } ;
+    }
+
+    // Valid as of the last update()
+    const Mat& get_world_matrix( entity id ) const
+    {
+        return _world_matrices[ id ] ;
+    }
+
+    // Changes whenever update() rebuilds the entity's world matrix
+    uint64_t get_revision( entity id ) const
+    {
+        return _revisions[ id ] ;
+    }
+
+    // Rebuilds the world matrix of every entity changed since the last update
+    void update()
+    {
+        if( _dirty_count == 0 )
+            return ;
+
+        // One stamp per entity slot, handed out once for the whole batch
+        auto first_revision = next_revisions( _scales.size() ) ;
+
+        auto job_count = ( _scales.size() + entities_per_job - 1 ) / entities_per_job ;
+        if( job_count <= 1 )
+            update_range( 0, _scales.size(), first_revision ) ;
+        else
+        {
+            if( ! _jobs )
+                _jobs = std::make_unique<JobSystem>() ;
+
+            _jobs->run( job_count, [ this, first_revision ]( size_t index, size_t ) {
+                auto begin = index * entities_per_job ;
+                update_range( begin, std::min( begin + entities_per_job, _scales.size() ), first_revision ) ; } ) ;
+        }
+
+        _dirty_count = 0 ;
+    }
+
+private:
+    size_t                _count = 0 ;
+    size_t                _dirty_count = 0 ;
+    std::vector<float>    _position_x ;
+    std::vector<float>    _position_y ;
+    std::vector<float>    _position_z ;
+    std::vector<float>    _rotation_x ;
+    std::vector<float>    _rotation_y ;
+    std::vector<float>    _rotation_z ;
+    std::vector<float>    _rotation_w ;
+    std::vector<float>    _scales ;
+    std::vector<uint8_t>  _dirty ;
+    std::vector<uint64_t> _revisions ;
+    std::vector<Mat>      _world_matrices ;
+    std::unique_ptr<JobSystem> _jobs ;      // Created on first use
+
+    void mark_dirty( entity id )
+    {
+        _dirty_count += _dirty[ id ] ? 0 : 1 ;
+        _dirty[ id ] = 1 ;
+    }
+
+    // Rebuilds the dirty entities in [ begin, end ), which are whole blocks
+    void update_range( size_t begin, size_t end, uint64_t first_revision )
+    {
+        for( auto i = begin ; i < end ; i += block_size )
+        {
+            if( ! ( _dirty[ i ] | _dirty[ i + 1 ] | _dirty[ i + 2 ] | _dirty[ i + 3 ] ) )
+                continue ;
+
+            compute_block( i ) ;
+
+            for( auto j = i ; j < i + block_size ; ++j )
+            {
+                if( _dirty[ j ] )
+                    _revisions[ j ] = first_revision + j ;
+                _dirty[ j ] = 0 ;
+            }
+        }
+    }
+
+    // Grows every array together, doubling to keep create() amortized constant.
+    // Padding slots hold an identity transform so whole blocks can always be computed.
+    void grow( size_t minimum )
+    {
+        auto capacity = std::max( minimum, _scales.size() * 2 ) ;
+        capacity = ( capacity + block_size - 1 ) / block_size * block_size ;
+
+        _position_x.resize( capacity, 0 ) ;
+        _position_y.resize( capacity, 0 ) ;
+        _position_z.resize( capacity, 0 ) ;
+        _rotation_x.resize( capacity, 0 ) ;
+        _rotation_y.resize( capacity, 0 ) ;
+        _rotation_z.resize( capacity, 0 ) ;
+        _rotation_w.resize( capacity, 1 ) ;
+        _scales.resize( capacity, 1 ) ;
+        _dirty.resize( capacity, 0 ) ;
+        _revisions.resize( capacity, 0 ) ;
+        _world_matrices.resize( capacity, Mat::get_identity_matrix() ) ;
+    }
+
+    // World matrix = translation * scale * rotation, for entities i .. i + 3
+    void compute_block( size_t i )
+    {
+#if defined( RASTERIZER_SSE )
+        auto x = _mm_loadu_ps( &_rotation_x[ i ] ) ;
+        auto y = _mm_loadu_ps( &_rotation_y[ i ] ) ;
+        auto z = _mm_loadu_ps( &_rotation_z[ i ] ) ;
+        auto w = _mm_loadu_ps( &_rotation_w[ i ] ) ;
+        auto scale = _mm_loadu_ps( &_scales[ i ] ) ;
+        auto two_scale = _mm_add_ps( scale, scale ) ;
+
+        auto xx = _mm_mul_ps( x, x ), yy = _mm_mul_ps( y, y ), zz = _mm_mul_ps( z, z ) ;
+        auto xy = _mm_mul_ps( x, y ), xz = _mm_mul_ps( x, z ), yz = _mm_mul_ps( y, z ) ;
+        auto wx = _mm_mul_ps( w, x ), wy = _mm_mul_ps( w, y ), wz = _mm_mul_ps( w, z ) ;
+
+        // Each register holds one matrix element for the four entities
+        auto m00 = _mm_sub_ps( scale, _mm_mul_ps( two_scale, _mm_add_ps( yy, zz ) ) ) ;
+        auto m01 = _mm_mul_ps( two_scale, _mm_sub_ps( xy, wz ) ) ;
+        auto m02 = _mm_mul_ps( two_scale, _mm_add_ps( xz, wy ) ) ;
+        auto m03 = _mm_loadu_ps( &_position_x[ i ] ) ;
+        auto m10 = _mm_mul_ps( two_scale, _mm_add_ps( xy, wz ) ) ;
+        auto m11 = _mm_sub_ps( scale, _mm_mul_ps( two_scale, _mm_add_ps( xx, zz ) ) ) ;
+        auto m12 = _mm_mul_ps( two_scale, _mm_sub_ps( yz, wx ) ) ;
+        auto m13 = _mm_loadu_ps( &_position_y[ i ] ) ;
+        auto m20 = _mm_mul_ps( two_scale, _mm_sub_ps( xz, wy ) ) ;
+        auto m21 = _mm_mul_ps( two_scale, _mm_add_ps( yz, wx ) ) ;
+        auto m22 = _mm_sub_ps( scale, _mm_mul_ps( two_scale, _mm_add_ps( xx, yy ) ) ) ;
+        auto m23 = _mm_loadu_ps( &_position_z[ i ] ) ;
+
+        // Transposing turns "element for four entities" into "row of one entity"
+        _MM_TRANSPOSE4_PS( m00, m01, m02, m03 ) ;
+        _MM_TRANSPOSE4_PS( m10, m11, m12, m13 ) ;
+        _MM_TRANSPOSE4_PS( m20, m21, m22, m23 ) ;
+
+        store_rows( _world_matrices[ i     ], m00, m10, m20 ) ;
+        store_rows( _world_matrices[ i + 1 ], m01, m11, m21 ) ;
+        store_rows( _world_matrices[ i + 2 ], m02, m12, m22 ) ;
+        store_rows( _world_matrices[ i + 3 ], m03, m13, m23 ) ;
+#else
+        for( auto j = i ; j < i + block_size ; ++j )
+        {
+            auto x = _rotation_x[ j ], y = _rotation_y[ j ], z = _rotation_z[ j ], w = _rotation_w[ j ] ;
+            auto s = _scales[ j ] ;
+            auto& e = _world_matrices[ j ].elements ;
+
+            e[  0 ] = s - 2 * s * ( y * y + z * z ) ;
+            e[  1 ] = 2 * s * ( x * y - w * z ) ;
+            e[  2 ] = 2 * s * ( x * z + w * y ) ;
+            e[  3 ] = _position_x[ j ] ;
+            e[  4 ] = 2 * s * ( x * y + w * z ) ;
+            e[  5 ] = s - 2 * s * ( x * x + z * z ) ;
+            e[  6 ] = 2 * s * ( y * z - w * x ) ;
+            e[  7 ] = _position_y[ j ] ;
+            e[  8 ] = 2 * s * ( x * z - w * y ) ;
+            e[  9 ] = 2 * s * ( y * z + w * x ) ;
+            e[ 10 ] = s - 2 * s * ( x * x + y * y ) ;
+            e[ 11 ] = _position_z[ j ] ;
+        }
+#endif
+    }
+
+#if defined( RASTERIZER_SSE )
+    // The last row never changes from the identity it was created with
+    static void store_rows( Mat& matrix, __m128 row0, __m128 row1, __m128 row2 )
+    {
+        _mm_store_ps( &matrix.elements[ 0 ], row0 ) ;
+        _mm_store_ps( &matrix.elements[ 4 ], row1 ) ;
+        _mm_store_ps( &matrix.elements[ 8 ], row2 ) ;
+    }
+#endif
+} ;
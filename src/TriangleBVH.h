@@ -0,0 +1,392 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Misc.h"
+#include "Ray.h"
+#include "Simd.h"
+#include "Vec.h"
+#include "Triangle.h"
+
+// Bounding volume hierarchy over a model's triangles, for ray queries in model space.
+//
+// Built top down, splitting each node where the surface area heuristic says rays will
+// test the fewest triangles, estimated over a few bins of triangle centers per axis.
+// Nodes are 32 bytes in one array, with both children of a node next to each other,
+// and the leaves' triangles are stored in tree order, ready for the ray test.
+class TriangleBVH
+{
+public:
+    TriangleBVH( const std::vector<vec3f>& verticies, const std::vector<Triangle>& triangles )
+    {
+        if( triangles.empty() )
+            return ;
+
+        std::vector<Bounds>   bounds( triangles.size() ) ;
+        std::vector<vec3f>    centers( triangles.size() ) ;
+        std::vector<uint32_t> order( triangles.size() ) ;
+        for( size_t i = 0 ; i < triangles.size() ; ++i )
+        {
+            const auto& indexes = triangles[ i ].vertex_indexes ;
+            bounds[ i ] = Bounds::around( verticies[ indexes.x ] ) ;
+            bounds[ i ].add( verticies[ indexes.y ] ) ;
+            bounds[ i ].add( verticies[ indexes.z ] ) ;
+            centers[ i ] = bounds[ i ].get_center() ;
+            order[ i ] = static_cast<uint32_t>( i ) ;
+        }
+
+        _nodes.reserve( 2 * triangles.size() ) ;
+        _nodes.push_back( {} ) ;
+        build( 0, 0, static_cast<uint32_t>( triangles.size() ), 1, bounds, centers, order ) ;
+        _nodes.shrink_to_fit() ;
+
+        _faces.reserve( triangles.size() ) ;
+        for( auto index : order )
+        {
+            const auto& indexes = triangles[ index ].vertex_indexes ;
+            auto& v0 = verticies[ indexes.x ] ;
+            _faces.push_back( { v0, verticies[ indexes.y ] - v0, verticies[ indexes.z ] - v0, index } ) ;
+        }
+    }
+
+    // The nearest triangle, from either side, before ray.max_distance
+    bool find_nearest( const Ray& ray, RayHit& hit ) const
+    {
+        hit.distance = ray.max_distance ;
+        return traverse<false>( ray, hit ) ;
+    }
+
+    // Whether any triangle is before ray.max_distance; quicker than find_nearest
+    bool is_blocked( const Ray& ray ) const
+    {
+        RayHit hit { ray.max_distance, 0 } ;
+        return traverse<true>( ray, hit ) ;
+    }
+
+    size_t get_bytes() const
+    {
+        return _nodes.capacity() * sizeof( Node ) + _faces.capacity() * sizeof( Face ) ;
+    }
+
+private:
+    // Leaves hold at most this many triangles
+    static constexpr uint32_t max_leaf_size = 4 ;
+
+    // Candidate split positions per axis are the edges between these bins
+    static constexpr int bin_count = 12 ;
+
+    // Cost of visiting a node, relative to testing a triangle
+    static constexpr float traversal_cost = 1.0f ;
+
+    // Deeper nodes are left as leaves, however many triangles they have, which bounds
+    // the traversal stack
+    static constexpr int max_depth = 64 ;
+
+    class Bounds
+    {
+    public:
+        vec3f min { std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(),
+                    std::numeric_limits<float>::infinity() } ;
+        vec3f max { -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(),
+                    -std::numeric_limits<float>::infinity() } ;
+
+        static Bounds around( const vec3f& point )
+        {
+            return { point, point } ;
+        }
+
+        void add( const vec3f& point )
+        {
+            min = { std::min( min.x, point.x ), std::min( min.y, point.y ), std::min( min.z, point.z ) } ;
+            max = { std::max( max.x, point.x ), std::max( max.y, point.y ), std::max( max.z, point.z ) } ;
+        }
+
+        void add( const Bounds& other )
+        {
+            min = { std::min( min.x, other.min.x ), std::min( min.y, other.min.y ), std::min( min.z, other.min.z ) } ;
+            max = { std::max( max.x, other.max.x ), std::max( max.y, other.max.y ), std::max( max.z, other.max.z ) } ;
+        }
+
+        vec3f get_center() const
+        {
+            return { ( min.x + max.x ) / 2, ( min.y + max.y ) / 2, ( min.z + max.z ) / 2 } ;
+        }
+
+        // Half of it, which is all the heuristic needs; 0 when empty
+        float get_half_area() const
+        {
+            if( min.x > max.x )
+                return 0 ;
+
+            auto size = max - min ;
+            return size.x * size.y + size.y * size.z + size.z * size.x ;
+        }
+    } ;
+
+    // Leaves have a count and their triangles start at "first"; inner nodes have a
+    // count of 0 and their children at "first" and "first" + 1
+    struct Node
+    {
+        vec3f    min ;
+        uint32_t first ;
+        vec3f    max ;
+        uint32_t count ;
+    } ;
+
+    // Ready for the Moller-Trumbore test
+    struct Face
+    {
+        vec3f    v0 ;
+        vec3f    edge1 ;
+        vec3f    edge2 ;
+        uint32_t index ;    // Into the model's triangles
+    } ;
+
+    std::vector<Node> _nodes ;
+    std::vector<Face> _faces ;
+
+    static float get_axis( const vec3f& v, int axis )
+    {
+        return axis == 0 ? v.x : axis == 1 ? v.y : v.z ;
+    }
+
+    // Fills node "index" with the triangles order[ first, first + count ), and splits it
+    void build( uint32_t index, uint32_t first, uint32_t count, int depth, const std::vector<Bounds>& bounds,
+                const std::vector<vec3f>& centers, std::vector<uint32_t>& order )
+    {
+        Bounds node_bounds ;
+        Bounds center_bounds ;
+        for( auto i = first ; i < first + count ; ++i )
+        {
+            node_bounds.add( bounds[ order[ i ] ] ) ;
+            center_bounds.add( centers[ order[ i ] ] ) ;
+        }
+
+        _nodes[ index ] = { node_bounds.min, first, node_bounds.max, count } ;
+        if( count <= max_leaf_size || depth == max_depth )
+            return ;
+
+        // Cheapest split over every axis and bin edge
+        auto best_cost = std::numeric_limits<float>::infinity() ;
+        auto best_axis = -1 ;
+        auto best_edge = 0 ;
+        for( auto axis = 0 ; axis < 3 ; ++axis )
+        {
+            auto low = get_axis( center_bounds.min, axis ) ;
+            auto extent = get_axis( center_bounds.max, axis ) - low ;
+            if( ! ( extent > 0 ) )
+                continue ;
+
+            Bounds   bin_bounds[ bin_count ] ;
+            uint32_t bin_counts[ bin_count ] = {} ;
+            auto scale = bin_count / extent ;
+            for( auto i = first ; i < first + count ; ++i )
+            {
+                auto bin = std::min( bin_count - 1, static_cast<int>( ( get_axis( centers[ order[ i ] ], axis ) - low ) * scale ) ) ;
+                bin_bounds[ bin ].add( bounds[ order[ i ] ] ) ;
+                ++bin_counts[ bin ] ;
+            }
+
+            // Sweep from the right, then from the left
+            float    right_areas[ bin_count ] ;
+            uint32_t right_counts[ bin_count ] ;
+            Bounds   right ;
+            uint32_t right_count = 0 ;
+            for( auto bin = bin_count - 1 ; bin > 0 ; --bin )
+            {
+                right.add( bin_bounds[ bin ] ) ;
+                right_count += bin_counts[ bin ] ;
+                right_areas[ bin ] = right.get_half_area() ;
+                right_counts[ bin ] = right_count ;
+            }
+
+            Bounds   left ;
+            uint32_t left_count = 0 ;
+            for( auto edge = 1 ; edge < bin_count ; ++edge )
+            {
+                left.add( bin_bounds[ edge - 1 ] ) ;
+                left_count += bin_counts[ edge - 1 ] ;
+
+                auto cost = left.get_half_area() * left_count + right_areas[ edge ] * right_counts[ edge ] ;
+                if( left_count != 0 && right_counts[ edge ] != 0 && cost < best_cost )
+                {
+                    best_cost = cost ;
+                    best_axis = axis ;
+                    best_edge = edge ;
+                }
+            }
+        }
+
+        // Splitting must beat testing every triangle here
+        auto parent_area = node_bounds.get_half_area() ;
+        if( best_axis < 0 || ( parent_area > 0 && traversal_cost + best_cost / parent_area >= count ) )
+            return ;
+
+        auto low = get_axis( center_bounds.min, best_axis ) ;
+        auto scale = bin_count / ( get_axis( center_bounds.max, best_axis ) - low ) ;
+        auto middle = std::partition( order.begin() + first, order.begin() + first + count, [ & ]( uint32_t triangle ) {
+            auto bin = std::min( bin_count - 1, static_cast<int>( ( get_axis( centers[ triangle ], best_axis ) - low ) * scale ) ) ;
+            return bin < best_edge ; } ) ;
+        auto left_count = static_cast<uint32_t>( middle - ( order.begin() + first ) ) ;
+
+        auto left_index = static_cast<uint32_t>( _nodes.size() ) ;
+        _nodes[ index ].first = left_index ;
+        _nodes[ index ].count = 0 ;
+        _nodes.push_back( {} ) ;
+        _nodes.push_back( {} ) ;
+
+        build( left_index, first, left_count, depth + 1, bounds, centers, order ) ;
+        build( left_index + 1, first + left_count, count - left_count, depth + 1, bounds, centers, order ) ;
+    }
+
+    // Ray data reused by every box test
+    struct RaySetup
+    {
+#if defined( RASTERIZER_SSE )
+        __m128 origin ;
+        __m128 inverse_direction ;
+#else
+        vec3f  origin ;
+        vec3f  inverse_direction ;
+#endif
+    } ;
+
+    static RaySetup make_ray_setup( const Ray& ray )
+    {
+        vec3f inverse { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z } ;
+#if defined( RASTERIZER_SSE )
+        return { _mm_setr_ps( ray.origin.x, ray.origin.y, ray.origin.z, 0 ),
+                 _mm_setr_ps( inverse.x, inverse.y, inverse.z, 0 ) } ;
+#else
+        return { ray.origin, inverse } ;
+#endif
+    }
+
+    // Distance along the ray to where it enters the node's box, or infinity when it
+    // misses it or enters it after "max_distance"
+    static float enter_box( const Node& node, const RaySetup& setup, float max_distance )
+    {
+#if defined( RASTERIZER_SSE )
+        // The slabs of all three axes at once; lane 3 repeats lane 2
+        auto low  = _mm_mul_ps( _mm_sub_ps( _mm_loadu_ps( &node.min.x ), setup.origin ), setup.inverse_direction ) ;
+        auto high = _mm_mul_ps( _mm_sub_ps( _mm_loadu_ps( &node.max.x ), setup.origin ), setup.inverse_direction ) ;
+        auto near = _mm_min_ps( low, high ) ;
+        auto far  = _mm_max_ps( low, high ) ;
+        near = _mm_shuffle_ps( near, near, _MM_SHUFFLE( 2, 2, 1, 0 ) ) ;
+        far  = _mm_shuffle_ps( far, far, _MM_SHUFFLE( 2, 2, 1, 0 ) ) ;
+
+        near = _mm_max_ps( near, _mm_shuffle_ps( near, near, _MM_SHUFFLE( 1, 0, 3, 2 ) ) ) ;
+        near = _mm_max_ps( near, _mm_shuffle_ps( near, near, _MM_SHUFFLE( 2, 3, 0, 1 ) ) ) ;
+        far  = _mm_min_ps( far, _mm_shuffle_ps( far, far, _MM_SHUFFLE( 1, 0, 3, 2 ) ) ) ;
+        far  = _mm_min_ps( far, _mm_shuffle_ps( far, far, _MM_SHUFFLE( 2, 3, 0, 1 ) ) ) ;
+
+        auto enter = std::max( _mm_cvtss_f32( near ), 0.0f ) ;
+        auto leave = std::min( _mm_cvtss_f32( far ), max_distance ) ;
+#else
+        auto slab = []( float min, float max, float origin, float inverse, float& enter, float& leave ) {
+            auto low = ( min - origin ) * inverse ;
+            auto high = ( max - origin ) * inverse ;
+            enter = std::max( enter, std::min( low, high ) ) ;
+            leave = std::min( leave, std::max( low, high ) ) ; } ;
+
+        auto enter = 0.0f ;
+        auto leave = max_distance ;
+        slab( node.min.x, node.max.x, setup.origin.x, setup.inverse_direction.x, enter, leave ) ;
+        slab( node.min.y, node.max.y, setup.origin.y, setup.inverse_direction.y, enter, leave ) ;
+        slab( node.min.z, node.max.z, setup.origin.z, setup.inverse_direction.z, enter, leave ) ;
+#endif
+        return enter <= leave ? enter : std::numeric_limits<float>::infinity() ;
+    }
+
+    // Distance along the ray to the face, from either side, or infinity when it misses
+    static float hit_face( const Face& face, const Ray& ray )
+    {
+        auto p = compute_cross_product( ray.direction, face.edge2 ) ;
+        auto determinant = compute_dot_product( face.edge1, p ) ;
+        if( determinant == 0 )
+            return std::numeric_limits<float>::infinity() ;
+
+        auto inverse_determinant = 1.0f / determinant ;
+        auto t = ray.origin - face.v0 ;
+        auto u = compute_dot_product( t, p ) * inverse_determinant ;
+        if( u < 0 || u > 1 )
+            return std::numeric_limits<float>::infinity() ;
+
+        auto q = compute_cross_product( t, face.edge1 ) ;
+        auto v = compute_dot_product( ray.direction, q ) * inverse_determinant ;
+        if( v < 0 || u + v > 1 )
+            return std::numeric_limits<float>::infinity() ;
+
+        auto distance = compute_dot_product( face.edge2, q ) * inverse_determinant ;
+        return distance >= 0 ? distance : std::numeric_limits<float>::infinity() ;
+    }
+
+    // Visits the nearer child first, and skips nodes entered after the nearest hit
+    template<bool any_hit>
+    bool traverse( const Ray& ray, RayHit& hit ) const
+    {
+        if( _nodes.empty() )
+            return false ;
+
+        auto setup = make_ray_setup( ray ) ;
+        if( enter_box( _nodes[ 0 ], setup, hit.distance ) == std::numeric_limits<float>::infinity() )
+            return false ;
+
+        auto found = false ;
+        uint32_t stack[ max_depth ] ;
+        int      stack_size = 0 ;
+        uint32_t index = 0 ;
+        for( ;; )
+        {
+            const auto& node = _nodes[ index ] ;
+            if( node.count != 0 )
+            {
+                for( auto i = node.first ; i < node.first + node.count ; ++i )
+                {
+                    auto distance = hit_face( _faces[ i ], ray ) ;
+                    if( distance < hit.distance )
+                    {
+                        hit = { distance, _faces[ i ].index } ;
+                        found = true ;
+                        if( any_hit )
+                            return true ;
+                    }
+                }
+
+                if( stack_size == 0 )
+                    return found ;
+
+                index = stack[ --stack_size ] ;
+                continue ;
+            }
+
+            auto near = node.first ;
+            auto far = node.first + 1 ;
+            auto near_distance = enter_box( _nodes[ near ], setup, hit.distance ) ;
+            auto far_distance = enter_box( _nodes[ far ], setup, hit.distance ) ;
+            if( far_distance < near_distance )
+            {
+                std::swap( near, far ) ;
+                std::swap( near_distance, far_distance ) ;
+            }
+
+            if( near_distance == std::numeric_limits<float>::infinity() )
+            {
+                if( stack_size == 0 )
+                    return found ;
+
+                index = stack[ --stack_size ] ;
+                continue ;
+            }
+
+            if( far_distance != std::numeric_limits<float>::infinity() )
+                stack[ stack_size++ ] = far ;
+
+            index = near ;
+        }
+    }
+} ;
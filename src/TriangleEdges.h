@@ -0,0 +1,87 @@
+#pragma once
+
+// Interpolates one value down the left and right sides of a triangle, a row at a time,
+// without building per row lists. The verticies must be sorted so that y0 <= y1 <= y2.
+//
+// The long side runs from vertex 0 to vertex 2 and the short side through vertex 1.
+// Values are accumulated step by step and restart exactly at vertex 1, so every
+// kernel that walks the same triangle gets bit for bit the same values, which the
+// "nearer or equal" depth test of a z-prepass relies on.
+//
+// Which side is left depends on x alone: edges of any other value, such as inverse
+// depth, take their sides from the x edges of the same triangle.
+class TriangleEdges
+{
+public:
+    // Edges of the x coordinates
+    TriangleEdges( int y0, float x0, int y1, float x1, int y2, float x2 )
+        : TriangleEdges( y0, x0, y1, x1, y2, x2, true )
+    {
+        // The sides are told apart half way down, where the triangle is widest apart
+        auto probe = *this ;
+        for( auto i = ( y2 - y0 + 1 ) / 2 ; i > 0 ; --i )
+            probe.step() ;
+
+        _short_is_left = probe._short_value <= probe._long_value ;
+    }
+
+    // Edges of another value, left and right as in "x_edges"
+    TriangleEdges( int y0, float v0, int y1, float v1, int y2, float v2, const TriangleEdges& x_edges )
+        : TriangleEdges( y0, v0, y1, v1, y2, v2, x_edges._short_is_left )
+    {}
+
+    float get_left() const
+    {
+        return _short_is_left ? _short_value : _long_value ;
+    }
+
+    float get_right() const
+    {
+        return _short_is_left ? _long_value : _short_value ;
+    }
+
+    // Moves on to the next row down
+    void step()
+    {
+        ++_y ;
+        _long_value += _long_step ;
+
+        if( _y == _y1 )
+        {
+            _short_value = _v1 ;
+            _short_step = _lower_short_step ;
+        }
+        else
+        {
+            _short_value += _short_step ;
+        }
+    }
+
+private:
+    int   _y ;
+    int   _y1 ;
+    float _v1 ;
+    float _long_value ;
+    float _long_step ;
+    float _short_value ;
+    float _short_step ;
+    float _lower_short_step ;
+    bool  _short_is_left ;
+
+    TriangleEdges( int y0, float v0, int y1, float v1, int y2, float v2, bool short_is_left )
+        : _y( y0 ),
+          _y1( y1 ),
+          _v1( v1 ),
+          _long_value( v0 ),
+          _long_step( get_step( y0, v0, y2, v2 ) ),
+          _short_value( y0 == y1 ? v1 : v0 ),
+          _short_step( y0 == y1 ? get_step( y1, v1, y2, v2 ) : get_step( y0, v0, y1, v1 ) ),
+          _lower_short_step( get_step( y1, v1, y2, v2 ) ),
+          _short_is_left( short_is_left )
+    {}
+
+    static float get_step( int y0, float v0, int y1, float v1 )
+    {
+        return y0 == y1 ? 0.0f : ( v1 - v0 ) / static_cast<float>( y1 - y0 ) ;
+    }
+} ;
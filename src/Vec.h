@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstdint>
+
+#include "Simd.h"
+
 template<typename T>
 
 class vec2
@@ -44,10 +48,12 @@ public:
 
 using vec3f = vec3<float>;
 using vec3i = vec3<int>;
+using vec3u16 = vec3<uint16_t>;
 
+// Aligned so a vec4f can be loaded straight into a SIMD register
 template<typename T>
 
-class vec4
+class alignas( 4 * sizeof( T ) ) vec4
 {
 public:
     T x;
@@ -57,4 +63,52 @@ public:
 };
 
 using vec4f = vec4<float>;
-using vec4i = vec4<int>;
\ No newline at end of file
+using vec4i = vec4<int>;
+
+#if defined( RASTERIZER_SSE )
+
+inline __m128 load( const vec4f& v )
+{
+    return _mm_load_ps( &v.x ) ;
+}
+
+inline vec4f store( __m128 v )
+{
+    vec4f output ;
+    _mm_store_ps( &output.x, v ) ;
+    return output ;
+}
+
+inline vec4f operator+( const vec4f& a, const vec4f& b )
+{
+    return store( _mm_add_ps( load( a ), load( b ) ) ) ;
+}
+
+inline vec4f operator-( const vec4f& a, const vec4f& b )
+{
+    return store( _mm_sub_ps( load( a ), load( b ) ) ) ;
+}
+
+inline vec4f operator*( float a, const vec4f& b )
+{
+    return store( _mm_mul_ps( _mm_set1_ps( a ), load( b ) ) ) ;
+}
+
+#else
+
+inline vec4f operator+( const vec4f& a, const vec4f& b )
+{
+    return { a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w } ;
+}
+
+inline vec4f operator-( const vec4f& a, const vec4f& b )
+{
+    return { a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w } ;
+}
+
+inline vec4f operator*( float a, const vec4f& b )
+{
+    return { a * b.x, a * b.y, a * b.z, a * b.w } ;
+}
+
+#endif
@@ -0,0 +1,652 @@
+// Renders a fixed set of scenes without a window and checks each against a golden
+// image, so that work on the raster kernels, clipping or the render queue cannot change
+// the picture unnoticed, and reports how long each takes against a timing baseline.
+// Build and run with "make regress". After an intended change to the output,
+// "make regress-update" records new golden images. "make regress-baseline" records
+// the timing baselines for this machine, and never touches the golden images. Timings
+// only fail the run when asked to, with "make regress-perf".
+//
+//   RegressionTests [options] [directory]
+//
+//   directory              Holds golden/<scene>.ppm and baseline.txt; "tests" by default
+//   --update               Writes the golden images instead of checking them
+//   --update-baselines     Writes the timing baselines; images are still checked
+//   --timing               Also fails scenes more than the threshold slower than their baseline
+//   --no-timing            Checks images only
+//   --threshold F          Slowdown that --timing fails on; 0.5 by default
+//   --channel-tolerance N  Pixels whose channels are all within N of the golden match; 0 by default
+//   --pixel-tolerance N    Images with at most N mismatched pixels match; 0 by default
+//
+// Mismatched images are saved as failed/<scene>.ppm next to the golden ones. Every
+// scene is also rendered with several geometry threads, which must give exactly the
+// same picture as one; scenes with an unsorted variant must match it too. Timing uses
+// a larger canvas than the golden images, so that each frame is long enough to measure
+// steadily. The baselines are machine specific, so baseline.txt is not checked in.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../src/Canvas.h"
+#include "../src/PixelSpans.h"
+#include "../src/PointCloud.h"
+#include "../src/ShadowMap.h"
+
+namespace
+{
+    constexpr size_t image_width = 200 ;
+    constexpr size_t image_height = 150 ;
+    constexpr size_t timing_width = 800 ;
+    constexpr size_t timing_height = 600 ;
+    constexpr size_t parallel_thread_count = 4 ;
+
+    // Each timing batch runs for at least this long, and the median batch counts
+    constexpr double batch_milliseconds = 50 ;
+    constexpr int batch_count = 11 ;
+
+    // Slowdowns up to this are noise for the shortest scenes, whatever the threshold
+    constexpr double timing_slack_milliseconds = 0.25 ;
+
+    class Options
+    {
+    public:
+        std::filesystem::path directory = "tests" ;
+        bool   update = false ;
+        bool   update_baselines = false ;
+        bool   timing = true ;
+        bool   timing_fails = false ;   // Otherwise timings are only reported
+        double threshold = 0.5 ;
+        int    channel_tolerance = 0 ;
+        size_t pixel_tolerance = 0 ;
+    } ;
+
+    // Fixed seed, so every run builds the same scenes on every platform
+    class Random
+    {
+    public:
+        float next( float min, float max )
+        {
+            _state = _state * 6364136223846793005ull + 1442695040888963407ull ;
+            return min + ( max - min ) * static_cast<float>( _state >> 40 ) / static_cast<float>( 1 << 24 ) ;
+        }
+
+    private:
+        uint64_t _state = 1 ;
+    } ;
+
+    // A unit cube around the origin, each face its own color
+    Model make_box( const Color* face_colors )
+    {
+        std::vector<vec3f> verticies {
+            { -0.5f, -0.5f, -0.5f }, { 0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, -0.5f }, { -0.5f, 0.5f, -0.5f },
+            { -0.5f, -0.5f,  0.5f }, { 0.5f, -0.5f,  0.5f }, { 0.5f, 0.5f,  0.5f }, { -0.5f, 0.5f,  0.5f } } ;
+
+        const int faces[ 6 ][ 4 ] = {
+            { 0, 1, 2, 3 }, { 4, 7, 6, 5 }, { 0, 3, 7, 4 }, { 1, 5, 6, 2 }, { 3, 2, 6, 7 }, { 0, 4, 5, 1 } } ;
+
+        std::vector<Triangle> triangles ;
+        for( int face = 0 ; face < 6 ; ++face )
+        {
+            const auto& f = faces[ face ] ;
+            triangles.push_back( { { f[ 0 ], f[ 1 ], f[ 2 ] }, face_colors[ face ] } ) ;
+            triangles.push_back( { { f[ 0 ], f[ 2 ], f[ 3 ] }, face_colors[ face ] } ) ;
+        }
+        return Model( std::move( verticies ), std::move( triangles ) ) ;
+    }
+
+    // Rolling hills of size x size quads, one unit each, centered on the origin
+    Model make_hills( int size )
+    {
+        std::vector<vec3f> verticies ;
+        for( int z = 0 ; z <= size ; ++z )
+        for( int x = 0 ; x <= size ; ++x )
+        {
+            auto height = 1.5f * std::sin( 0.35f * static_cast<float>( x ) ) * std::cos( 0.25f * static_cast<float>( z ) ) ;
+            verticies.push_back( { static_cast<float>( x - size / 2 ), height, static_cast<float>( z - size / 2 ) } ) ;
+        }
+
+        std::vector<Triangle> triangles ;
+        for( int z = 0 ; z < size ; ++z )
+        for( int x = 0 ; x < size ; ++x )
+        {
+            auto corner = z * ( size + 1 ) + x ;
+            auto shade = static_cast<uint8_t>( 90 + ( x * 7 + z * 13 ) % 120 ) ;
+            auto color = Color::custom( 40, shade, 60 ) ;
+            triangles.push_back( { { corner, corner + size + 2, corner + size + 1 }, color } ) ;
+            triangles.push_back( { { corner, corner + 1, corner + size + 2 }, color } ) ;
+        }
+        return Model( std::move( verticies ), std::move( triangles ) ) ;
+    }
+
+    class Scene
+    {
+    public:
+        std::string                    name ;
+        std::function<void( Canvas& )> render_frame ;       // From clear() to present()
+        std::function<void( Canvas& )> render_unsorted ;    // If set, the same frame without draw sorting
+    } ;
+
+    // Everything the scenes draw, built once
+    class SceneData
+    {
+    public:
+        SceneData()
+            : _box( make_box( box_colors ) ),
+              _hills( make_hills( 64 ) ),
+              _shadow_map( 256 ),
+              _cloud( make_cloud() )
+        {
+            Random random ;
+            _boxes.reserve( 300 ) ;
+            for( int i = 0 ; i < 300 ; ++i )
+            {
+                vec3f position { random.next( -10, 10 ), random.next( -8, 8 ), random.next( 6, 36 ) } ;
+                _boxes.emplace_back( _box, position, random.next( 0.5f, 1.5f ), random.next( 0, 360 ), vec3f { 1, 1, 0 } ) ;
+            }
+
+            _shadow_map.set_light( { 0, 12, 10 }, Mat::get_rotation_matrix( 90, { 1, 0, 0 } ) ) ;
+        }
+
+        std::vector<Scene> get_scenes()
+        {
+            return {
+                { "cubes", [ this ]( Canvas& canvas ) { render_cubes( canvas ) ; } },
+                { "sorted_boxes", [ this ]( Canvas& canvas ) { render_sorted_boxes( canvas ) ; } },
+                { "backdrop_first", [ this ]( Canvas& canvas ) { render_backdrop_first( canvas, true ) ; },
+                                    [ this ]( Canvas& canvas ) { render_backdrop_first( canvas, false ) ; } },
+                { "clipped_hills", [ this ]( Canvas& canvas ) { render_clipped_hills( canvas ) ; } },
+                { "shadows", [ this ]( Canvas& canvas ) { render_shadows( canvas ) ; } },
+                { "blending", [ this ]( Canvas& canvas ) { render_blending( canvas ) ; } },
+                { "wireframe", [ this ]( Canvas& canvas ) { render_wireframe( canvas ) ; } },
+                { "points", [ this ]( Canvas& canvas ) { render_points( canvas ) ; } },
+            } ;
+        }
+
+    private:
+        static inline const Color box_colors[ 6 ] = {
+            Color::custom( 220, 60, 60 ), Color::custom( 60, 200, 80 ), Color::custom( 70, 90, 230 ),
+            Color::custom( 230, 200, 60 ), Color::custom( 200, 80, 220 ), Color::custom( 60, 210, 210 ) } ;
+
+        Model                      _box ;
+        Model                      _hills ;
+        ShadowMap                  _shadow_map ;
+        PointCloud                 _cloud ;
+        std::vector<ModelInstance> _boxes ;
+
+        static PointCloud make_cloud()
+        {
+            Random random ;
+            std::vector<vec3f> positions ;
+            std::vector<Color> colors ;
+            for( int i = 0 ; i < 200000 ; ++i )
+            {
+                // A shell around ( 0, 0, 8 ), colored by position
+                vec3f direction { random.next( -1, 1 ), random.next( -1, 1 ), random.next( -1, 1 ) } ;
+                auto length = std::sqrt( compute_dot_product( direction, direction ) ) ;
+                if( length < 0.1f || length > 1 )
+                    continue ;
+
+                auto radius = random.next( 2.5f, 3 ) / length ;
+                positions.push_back( { direction.x * radius, direction.y * radius, 8 + direction.z * radius } ) ;
+                colors.push_back( Color::custom( static_cast<uint8_t>( 128 + 127 * direction.x / length ),
+                                         static_cast<uint8_t>( 128 + 127 * direction.y / length ),
+                                         static_cast<uint8_t>( 128 + 127 * direction.z / length ) ) ) ;
+            }
+            return PointCloud( positions, colors ) ;
+        }
+
+        // The demo in Main.cpp
+        void render_cubes( Canvas& canvas )
+        {
+            ModelInstance cube1 { _box, { -1.5, 0, 7 }, 0.75 } ;
+            ModelInstance cube2 { _box, { 1.25, 2.5, 7.5 }, 1, 195, { 0, 1, 0 } } ;
+            ModelInstance cube3 { _box, { -1.5, 1, 0 } } ;
+
+            canvas.set_camera_pos( { -3, 1, 2 } ) ;
+            canvas.set_camera_orient( Mat::get_rotation_matrix( 30, { 0, 1, 0 } ) ) ;
+            canvas.set_draw_sorting( true ) ;
+
+            canvas.clear() ;
+            canvas.draw_simple_model( cube1 ) ;
+            canvas.draw_simple_model( cube2 ) ;
+            canvas.draw_simple_model( cube3 ) ;
+            canvas.present() ;
+        }
+
+        // Overlapping boxes through the render queue, then a marker drawn without depth
+        // testing, which must end up over them
+        void render_sorted_boxes( Canvas& canvas )
+        {
+            ModelInstance backdrop { _box, { 0, 0, 70 }, 60 } ;
+            ModelInstance marker { _box, { 3, 2, 12 }, 1.5f, 30, { 1, 1, 1 } } ;
+
+            canvas.set_camera_pos( { 0, 0, 0 } ) ;
+            canvas.set_camera_orient( Mat::get_identity_matrix() ) ;
+            canvas.set_draw_sorting( true ) ;
+
+            PipelineState no_depth ;
+            no_depth.depth_test = DepthTest::off ;
+            no_depth.depth_write = false ;
+
+            canvas.clear() ;
+            canvas.set_pipeline_state( PipelineState() ) ;
+            canvas.draw_simple_model( backdrop ) ;
+            for( const auto& box : _boxes )
+                canvas.draw_simple_model( box ) ;
+            canvas.set_pipeline_state( no_depth ) ;
+            canvas.draw_simple_model( marker ) ;
+            canvas.set_pipeline_state( PipelineState() ) ;
+            canvas.present() ;
+        }
+
+        // Order dependent draws before and among the sorted ones: a backdrop without depth
+        // testing first, which must stay behind everything, and a blended box halfway,
+        // which must only cover the boxes drawn before it
+        void render_backdrop_first( Canvas& canvas, bool draw_sorting )
+        {
+            ModelInstance backdrop { _box, { 0, 0, 70 }, 60 } ;
+            ModelInstance blended { _box, { -1, 0, 14 }, 6, 20, { 0, 1, 1 } } ;
+
+            canvas.set_camera_pos( { 0, 0, 0 } ) ;
+            canvas.set_camera_orient( Mat::get_identity_matrix() ) ;
+            canvas.set_draw_sorting( draw_sorting ) ;
+
+            PipelineState no_depth ;
+            no_depth.depth_test = DepthTest::off ;
+            no_depth.depth_write = false ;
+            PipelineState alpha_blend ;
+            alpha_blend.blend_mode = BlendMode::alpha ;
+            alpha_blend.opacity = 150 ;
+
+            canvas.clear() ;
+            canvas.set_pipeline_state( no_depth ) ;
+            canvas.draw_simple_model( backdrop ) ;
+            canvas.set_pipeline_state( PipelineState() ) ;
+            for( size_t i = 0 ; i < _boxes.size() / 2 ; ++i )
+                canvas.draw_simple_model( _boxes[ i ] ) ;
+            canvas.set_pipeline_state( alpha_blend ) ;
+            canvas.draw_simple_model( blended ) ;
+            canvas.set_pipeline_state( PipelineState() ) ;
+            for( auto i = _boxes.size() / 2 ; i < _boxes.size() ; ++i )
+                canvas.draw_simple_model( _boxes[ i ] ) ;
+            canvas.present() ;
+        }
+
+        // Low over dense terrain, so many triangles cross the near and side planes
+        void render_clipped_hills( Canvas& canvas )
+        {
+            ModelInstance hills { _hills, { 0, -2, 20 } } ;
+
+            canvas.set_camera_pos( { -4, 0.5f, -10 } ) ;
+            canvas.set_camera_orient( Mat::get_rotation_matrix( 20, { 0, 1, 0 } ) * Mat::get_rotation_matrix( 8, { 1, 0, 0 } ) ) ;
+            canvas.set_draw_sorting( false ) ;
+
+            canvas.clear() ;
+            canvas.draw_simple_model( hills ) ;
+            canvas.draw_debug_clip_edges( hills, Color::custom( 255, 255, 255 ) ) ;
+            canvas.present() ;
+        }
+
+        void render_shadows( Canvas& canvas )
+        {
+            ModelInstance floor { _box, { 0, -12, 14 }, 20 } ;
+            ModelInstance tall { _box, { -2, -0.5f, 12 }, 3, 30, { 0, 1, 0 } } ;
+            ModelInstance tilted { _box, { 3, 0.5f, 15 }, 2, 45, { 1, 1, 0 } } ;
+            std::vector<const ModelInstance*> casters { &floor, &tall, &tilted } ;
+
+            canvas.set_camera_pos( { 0, 3, 0 } ) ;
+            canvas.set_camera_orient( Mat::get_rotation_matrix( 20, { 1, 0, 0 } ) ) ;
+            canvas.set_draw_sorting( true ) ;
+            canvas.render_shadow_map( _shadow_map, casters ) ;
+            canvas.set_shadow_map( &_shadow_map ) ;
+
+            PipelineState shadowed ;
+            shadowed.color_source = ColorSource::shadowed ;
+
+            canvas.clear() ;
+            canvas.set_pipeline_state( shadowed ) ;
+            for( auto instance : casters )
+                canvas.draw_simple_model( *instance ) ;
+            canvas.set_pipeline_state( PipelineState() ) ;
+            canvas.present() ;
+            canvas.set_shadow_map( nullptr ) ;
+        }
+
+        // Alpha, additive and order independent blending over opaque boxes
+        void render_blending( Canvas& canvas )
+        {
+            ModelInstance back { _box, { 0, 0, 12 }, 4, 20, { 1, 1, 0 } } ;
+            ModelInstance alpha { _box, { -2, 0.5f, 8 }, 2.5f, 40, { 0, 1, 0 } } ;
+            ModelInstance additive { _box, { 2, -0.5f, 8 }, 2.5f, 60, { 1, 0, 0 } } ;
+            ModelInstance glass1 { _box, { -0.5f, -1, 6 }, 2, 15, { 0, 0, 1 } } ;
+            ModelInstance glass2 { _box, { 0.5f, 1, 6.5f }, 2, 75, { 0, 1, 1 } } ;
+
+            canvas.set_camera_pos( { 0, 0, 0 } ) ;
+            canvas.set_camera_orient( Mat::get_identity_matrix() ) ;
+            canvas.set_draw_sorting( true ) ;
+
+            PipelineState alpha_blend ;
+            alpha_blend.blend_mode = BlendMode::alpha ;
+            alpha_blend.opacity = 140 ;
+            PipelineState additive_blend ;
+            additive_blend.blend_mode = BlendMode::additive ;
+            additive_blend.opacity = 100 ;
+
+            canvas.clear() ;
+            canvas.set_pipeline_state( PipelineState() ) ;
+            canvas.draw_simple_model( back ) ;
+            canvas.set_pipeline_state( alpha_blend ) ;
+            canvas.draw_simple_model( alpha ) ;
+            canvas.set_pipeline_state( additive_blend ) ;
+            canvas.draw_simple_model( additive ) ;
+            canvas.set_pipeline_state( PipelineState() ) ;
+            canvas.draw_translucent_model( glass1, 120 ) ;
+            canvas.draw_translucent_model( glass2, 180 ) ;
+            canvas.present() ;
+        }
+
+        void render_wireframe( Canvas& canvas )
+        {
+            ModelInstance hills { _hills, { 0, -4, 30 }, 0.5f, 25, { 0, 1, 0 } } ;
+
+            canvas.set_camera_pos( { 0, 4, 0 } ) ;
+            canvas.set_camera_orient( Mat::get_rotation_matrix( 20, { 1, 0, 0 } ) ) ;
+            canvas.set_draw_sorting( false ) ;
+            canvas.set_wireframe( true ) ;
+
+            canvas.clear() ;
+            canvas.draw_simple_model( hills ) ;
+            canvas.present() ;
+            canvas.set_wireframe( false ) ;
+        }
+
+        // A point cloud crossing a box, so points are depth tested against triangles
+        void render_points( Canvas& canvas )
+        {
+            ModelInstance box { _box, { 0, 0, 8 }, 5, 35, { 1, 1, 0 } } ;
+
+            canvas.set_camera_pos( { 0, 0, 0 } ) ;
+            canvas.set_camera_orient( Mat::get_identity_matrix() ) ;
+            canvas.set_draw_sorting( false ) ;
+
+            canvas.clear() ;
+            canvas.draw_simple_model( box ) ;
+            canvas.draw_point_cloud( _cloud, 2 ) ;
+            canvas.present() ;
+        }
+    } ;
+
+    std::vector<uint8_t> to_rgb( const Canvas& canvas )
+    {
+        std::vector<uint8_t> rgb( image_width * image_height * 3 ) ;
+        convert_span_to_rgb24( canvas.get_pixels(), rgb.data(), image_width * image_height ) ;
+        return rgb ;
+    }
+
+    bool write_ppm( const std::filesystem::path& path, const std::vector<uint8_t>& rgb )
+    {
+        auto file = std::fopen( path.string().c_str(), "wb" ) ;
+        if( file == nullptr )
+            return false ;
+
+        std::fprintf( file, "P6\n%zu %zu\n255\n", image_width, image_height ) ;
+        auto written = std::fwrite( rgb.data(), 1, rgb.size(), file ) ;
+        return std::fclose( file ) == 0 && written == rgb.size() ;
+    }
+
+    // Only reads images of this harness' size, as written by write_ppm()
+    bool read_ppm( const std::filesystem::path& path, std::vector<uint8_t>& rgb )
+    {
+        auto file = std::fopen( path.string().c_str(), "rb" ) ;
+        if( file == nullptr )
+            return false ;
+
+        size_t width = 0 ;
+        size_t height = 0 ;
+        int max_value = 0 ;
+        auto is_valid = std::fscanf( file, "P6 %zu %zu %d", &width, &height, &max_value ) == 3
+            && width == image_width && height == image_height && max_value == 255
+            && std::fgetc( file ) != EOF ;
+
+        rgb.resize( width * height * 3 ) ;
+        is_valid = is_valid && std::fread( rgb.data(), 1, rgb.size(), file ) == rgb.size() ;
+        std::fclose( file ) ;
+        return is_valid ;
+    }
+
+    size_t count_mismatched_pixels( const std::vector<uint8_t>& a, const std::vector<uint8_t>& b, int channel_tolerance )
+    {
+        size_t count = 0 ;
+        for( size_t i = 0 ; i < a.size() ; i += 3 )
+        {
+            for( size_t channel = 0 ; channel < 3 ; ++channel )
+            {
+                if( std::abs( a[ i + channel ] - b[ i + channel ] ) > channel_tolerance )
+                {
+                    ++count ;
+                    break ;
+                }
+            }
+        }
+        return count ;
+    }
+
+    // Milliseconds per frame of the median batch, with geometry caching off so that
+    // every frame runs the whole pipeline
+    double time_scene( const Scene& scene )
+    {
+        Canvas canvas( timing_width, timing_height ) ;
+        canvas.set_geometry_threads( 1 ) ;
+        canvas.set_geometry_caching( false ) ;
+        scene.render_frame( canvas ) ;
+
+        std::vector<double> per_frame ;
+        for( int batch = 0 ; batch < batch_count ; ++batch )
+        {
+            int frames = 0 ;
+            auto start = std::chrono::steady_clock::now() ;
+            double elapsed = 0 ;
+            do
+            {
+                scene.render_frame( canvas ) ;
+                ++frames ;
+                elapsed = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count() ;
+            } while( elapsed < batch_milliseconds ) ;
+
+            per_frame.push_back( elapsed / frames ) ;
+        }
+
+        auto median = per_frame.begin() + per_frame.size() / 2 ;
+        std::nth_element( per_frame.begin(), median, per_frame.end() ) ;
+        return *median ;
+    }
+
+    std::map<std::string, double> read_baselines( const std::filesystem::path& path )
+    {
+        std::map<std::string, double> baselines ;
+        auto file = std::fopen( path.string().c_str(), "r" ) ;
+        if( file == nullptr )
+            return baselines ;
+
+        char line[ 256 ] ;
+        while( std::fgets( line, sizeof( line ), file ) != nullptr )
+        {
+            char name[ 128 ] ;
+            double milliseconds ;
+            if( line[ 0 ] != '#' && std::sscanf( line, "%127s %lf", name, &milliseconds ) == 2 )
+                baselines[ name ] = milliseconds ;
+        }
+        std::fclose( file ) ;
+        return baselines ;
+    }
+
+    bool write_baselines( const std::filesystem::path& path, const std::map<std::string, double>& baselines )
+    {
+        auto file = std::fopen( path.string().c_str(), "w" ) ;
+        if( file == nullptr )
+            return false ;
+
+        std::fprintf( file, "# Milliseconds per frame of each scene in RegressionTests.cpp, at %zu x %zu.\n", timing_width, timing_height ) ;
+        std::fprintf( file, "# Machine specific: record them with \"make regress-baseline\" where the checks run.\n" ) ;
+        for( const auto& [ name, milliseconds ] : baselines )
+            std::fprintf( file, "%s %.4f\n", name.c_str(), milliseconds ) ;
+        return std::fclose( file ) == 0 ;
+    }
+
+    bool parse_options( int argc, char* argv[], Options& options )
+    {
+        for( int i = 1 ; i < argc ; ++i )
+        {
+            auto has_value = i + 1 < argc ;
+            if( std::strcmp( argv[ i ], "--update" ) == 0 )
+                options.update = true ;
+            else if( std::strcmp( argv[ i ], "--update-baselines" ) == 0 )
+                options.update_baselines = true ;
+            else if( std::strcmp( argv[ i ], "--timing" ) == 0 )
+                options.timing = options.timing_fails = true ;
+            else if( std::strcmp( argv[ i ], "--no-timing" ) == 0 )
+                options.timing = false ;
+            else if( std::strcmp( argv[ i ], "--threshold" ) == 0 && has_value )
+                options.threshold = std::atof( argv[ ++i ] ) ;
+            else if( std::strcmp( argv[ i ], "--channel-tolerance" ) == 0 && has_value )
+                options.channel_tolerance = std::atoi( argv[ ++i ] ) ;
+            else if( std::strcmp( argv[ i ], "--pixel-tolerance" ) == 0 && has_value )
+                options.pixel_tolerance = static_cast<size_t>( std::atol( argv[ ++i ] ) ) ;
+            else if( argv[ i ][ 0 ] != '-' )
+                options.directory = argv[ i ] ;
+            else
+                return false ;
+        }
+        return true ;
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    Options options ;
+    if( ! parse_options( argc, argv, options ) )
+    {
+        std::printf( "usage: %s [--update] [--update-baselines] [--timing] [--no-timing] [--threshold F] [--channel-tolerance N] [--pixel-tolerance N] [directory]\n", argv[ 0 ] ) ;
+        return 2 ;
+    }
+
+    auto golden_directory = options.directory / "golden" ;
+    auto failed_directory = options.directory / "failed" ;
+    auto baseline_path = options.directory / "baseline.txt" ;
+    if( options.update )
+        std::filesystem::create_directories( golden_directory ) ;
+
+    auto baselines = read_baselines( baseline_path ) ;
+    SceneData data ;
+    int failures = 0 ;
+
+    for( const auto& scene : data.get_scenes() )
+    {
+        Canvas canvas( image_width, image_height ) ;
+        canvas.set_geometry_threads( 1 ) ;
+        scene.render_frame( canvas ) ;
+        auto image = to_rgb( canvas ) ;
+
+        Canvas parallel_canvas( image_width, image_height ) ;
+        parallel_canvas.set_geometry_threads( parallel_thread_count ) ;
+        scene.render_frame( parallel_canvas ) ;
+        auto parallel_mismatches = count_mismatched_pixels( image, to_rgb( parallel_canvas ), 0 ) ;
+
+        size_t unsorted_mismatches = 0 ;
+        if( scene.render_unsorted )
+        {
+            Canvas unsorted_canvas( image_width, image_height ) ;
+            scene.render_unsorted( unsorted_canvas ) ;
+            unsorted_mismatches = count_mismatched_pixels( image, to_rgb( unsorted_canvas ), 0 ) ;
+        }
+
+        std::string result ;
+        auto passed = true ;
+        if( parallel_mismatches != 0 )
+        {
+            result = std::to_string( parallel_mismatches ) + " pixels differ with " + std::to_string( parallel_thread_count ) + " threads" ;
+            passed = false ;
+        }
+        else if( unsorted_mismatches != 0 )
+        {
+            result = std::to_string( unsorted_mismatches ) + " pixels differ without draw sorting" ;
+            passed = false ;
+        }
+        else if( options.update )
+        {
+            passed = write_ppm( golden_directory / ( scene.name + ".ppm" ), image ) ;
+            result = passed ? "image written" : "could not write the image" ;
+        }
+        else
+        {
+            std::vector<uint8_t> golden ;
+            if( ! read_ppm( golden_directory / ( scene.name + ".ppm" ), golden ) )
+            {
+                result = "no golden image" ;
+                passed = false ;
+            }
+            else
+            {
+                auto mismatches = count_mismatched_pixels( image, golden, options.channel_tolerance ) ;
+                passed = mismatches <= options.pixel_tolerance ;
+                result = passed ? "image matches" : std::to_string( mismatches ) + " pixels differ" ;
+            }
+        }
+
+        if( ! passed && ! options.update )
+        {
+            std::filesystem::create_directories( failed_directory ) ;
+            write_ppm( failed_directory / ( scene.name + ".ppm" ), image ) ;
+        }
+
+        if( options.timing || options.update_baselines )
+        {
+            char timing[ 128 ] ;
+            auto milliseconds = time_scene( scene ) ;
+            auto baseline = baselines.find( scene.name ) ;
+            if( options.update_baselines )
+            {
+                baselines[ scene.name ] = milliseconds ;
+                std::snprintf( timing, sizeof( timing ), ", %.3f ms recorded", milliseconds ) ;
+            }
+            else if( baseline == baselines.end() )
+            {
+                std::snprintf( timing, sizeof( timing ), ", %.3f ms, no baseline", milliseconds ) ;
+                passed = passed && ! options.timing_fails ;
+            }
+            else
+            {
+                auto change = milliseconds / baseline->second - 1 ;
+                auto is_slower = change > options.threshold
+                              && milliseconds - baseline->second > timing_slack_milliseconds ;
+                std::snprintf( timing, sizeof( timing ), ", %.3f ms (baseline %.3f, %+.0f%%%s)", milliseconds,
+                               baseline->second, 100 * change, is_slower ? ", slower" : "" ) ;
+                passed = passed && ! ( is_slower && options.timing_fails ) ;
+            }
+            result += timing ;
+        }
+
+        std::printf( "%-4s %-14s %s\n", passed ? "ok" : "FAIL", scene.name.c_str(), result.c_str() ) ;
+        failures += passed ? 0 : 1 ;
+    }
+
+    if( options.update_baselines && ! write_baselines( baseline_path, baselines ) )
+    {
+        std::printf( "could not write %s\n", baseline_path.string().c_str() ) ;
+        return 1 ;
+    }
+
+    if( failures != 0 )
+        std::printf( "%d scenes failed\n", failures ) ;
+    return failures == 0 ? 0 : 1 ;
+}